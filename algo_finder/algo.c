@@ -6,15 +6,50 @@
 
 #define DATA_FILE               "data.txt"
 #define BANK_STRING             "Bank"
+/* Can be overridden at build time for wider windows/larger banks,
+ * e.g. make CFLAGS="-Wall -Werror -g3 -DEND_INDEX=39 -DMAX_ADDR_PER_BANK=4000"
+ */
+#ifndef START_INDEX
 #define START_INDEX             11
+#endif
+#ifndef END_INDEX
 #define END_INDEX               24
+#endif
 #define MAX_DEPTH               (END_INDEX - START_INDEX + 1)
+#ifndef MAX_ADDR_PER_BANK
 #define MAX_ADDR_PER_BANK       1000
+#endif
 #define MAX_BANK                64
 #define MAX_SOLUTION            1000
 
 #define DEBUG                   0
 
+/* Robust mode: Instead of rejecting a function if any address in a bank
+ * disagrees, score it by the fraction of addresses agreeing with the majority
+ * value of their bank. Functions scoring at least MIN_CONFIDENCE are solutions
+ * and addresses disagreeing with them are reported as outliers.
+ */
+#define ROBUST_SOLVER           0
+#define MIN_CONFIDENCE          0.95
+
+/* Truth table mode: Finds functions of any boolean form (not only XOR) over up
+ * to MAX_TT_ARITY bits. A bit subset is reported if the address patterns of
+ * the subset seen in banks fall in exactly two groups, i.e. the subset carries
+ * exactly one bank function, and that function depends on all the bits.
+ */
+#define TRUTH_TABLE_SEARCH      0
+#define MAX_TT_ARITY            4
+
+/* Meet in the middle mode: Finds XOR functions of up to MITM_MAX_DEPTH bits in
+ * about C(n, d/2) instead of C(n, d) work, for wide windows. Each half-depth
+ * bit subset gets a signature of its parities over the differences of
+ * addresses in a bank, and subsets with equal signatures XOR to a function.
+ */
+#define MEET_IN_THE_MIDDLE      0
+#ifndef MITM_MAX_DEPTH
+#define MITM_MAX_DEPTH          8
+#endif
+
 typedef enum {
     OR,
     AND,
@@ -38,6 +73,10 @@ typedef struct solution_array {
 
 } solution_array_t;
 
+/* Window of address bits searched by find_algo(), at most MAX_DEPTH wide */
+int start_index = START_INDEX;
+int end_index = END_INDEX;
+
 solution_array_t cpu_solution_array = {
 
     .num_solutions = 5,
@@ -92,32 +131,40 @@ void print_solution(const solution_t *s)
     printf("\n");
 }
 
+static inline int eval(uint64_t addr, const solution_t *s)
+{
+    int j;
+    int curres = (addr >> s->indexes[0]) & 1;
+
+    for (j = 0; j < s->depth - 1; j++) {
+        switch(s->ops[j]) {
+            case OR:
+                curres = curres | (addr >> s->indexes[j + 1]);
+                break;
+            case AND:
+                curres = curres & (addr >> s->indexes[j + 1]);
+                break;
+            case XOR:
+                curres = curres ^ (addr >> s->indexes[j + 1]);
+                break;
+            default:
+                assert(0);
+        }
+        curres = curres & 0x1;
+    }
+
+    return curres;
+}
+
 int check(uint64_t *addr, size_t count, const solution_t *s)
 {
     size_t i;
-    int j;
     int res = -1;
 
     assert(s->depth >= 1);
 
     for (i = 0; i < count; i++) {
-        int curres = (addr[i] >> s->indexes[0]) & 1;
-        for (j = 0; j < s->depth - 1; j++) {
-            switch(s->ops[j]) {
-                case OR:
-                    curres = curres | (addr[i] >> s->indexes[j + 1]);
-                    break;
-                case AND:
-                    curres = curres & (addr[i] >> s->indexes[j + 1]);
-                    break;
-                case XOR:
-                    curres = curres ^ (addr[i] >> s->indexes[j + 1]);
-                    break;
-                default:
-                    assert(0);
-            }
-            curres = curres & 0x1;
-        }
+        int curres = eval(addr[i], s);
 
         if (res != -1) {
             if (res != curres)
@@ -209,7 +256,9 @@ void find_algo(uint64_t *addr, size_t count, solution_array_t *sarray)
         }
     }
 
-    for (i = 0; i < MAX_DEPTH; i++) {
+    assert(end_index - start_index + 1 <= MAX_DEPTH);
+
+    for (i = 0; i < end_index - start_index + 1; i++) {
     
         int isFirst = 1;
 
@@ -217,7 +266,7 @@ void find_algo(uint64_t *addr, size_t count, solution_array_t *sarray)
             s = &sarray->s[solutions_found];
             s->depth = i + 1;
 
-            if (permute(s->indexes, s->depth, START_INDEX, END_INDEX, isFirst) == 0)
+            if (permute(s->indexes, s->depth, start_index, end_index, isFirst) == 0)
                 break;
             
             if (check(addr, count, s) == 1) {
@@ -319,9 +368,549 @@ void find_unique(solution_array_t *sarray)
     }
 }
 
-int main()
+typedef struct bank_data {
+    uint64_t *addr;
+    size_t count;
+} bank_data_t;
+
+/* Reads all banks of the data file. Returns number of banks */
+int load_banks(FILE *fp, bank_data_t *banks)
+{
+    char *line = NULL;
+    size_t len = 0, size = 0;
+    int num_banks = 0;
+    bank_data_t *bank = NULL;
+
+    while (getline(&line, &len, fp) != -1) {
+
+        if (strncmp(line, BANK_STRING, strlen(BANK_STRING)) == 0) {
+            assert(num_banks < MAX_BANK);
+            bank = &banks[num_banks++];
+            bank->addr = NULL;
+            bank->count = 0;
+            size = 0;
+            continue;
+        }
+
+        if (bank == NULL)
+            continue;
+
+        if (bank->count == size) {
+            size = size ? size * 2 : MAX_ADDR_PER_BANK;
+            bank->addr = realloc(bank->addr, size * sizeof(uint64_t));
+            assert(bank->addr != NULL);
+        }
+
+        if (sscanf(line, "0x%lx", &bank->addr[bank->count]) != 1) {
+            printf("Line:%s\n", line);
+            fprintf(stderr, "Couldn't read line\n");
+            exit(EXIT_FAILURE);
+        }
+        bank->count++;
+    }
+
+    free(line);
+
+    // Drop empty banks
+    while (num_banks > 0 && banks[num_banks - 1].count == 0)
+        num_banks--;
+
+    return num_banks;
+}
+
+#if (ROBUST_SOLVER == 1)
+/* Returns fraction of addresses agreeing with majority value of their bank.
+ * Stops early (returning less than min_confidence) once too many disagree
+ */
+double score(const bank_data_t *banks, int num_banks, const solution_t *s,
+                size_t total, double min_confidence)
+{
+    size_t allowed = (size_t)((1.0 - min_confidence) * total);
+    size_t disagree = 0, i, ones;
+    int b;
+
+    for (b = 0; b < num_banks; b++) {
+        const bank_data_t *bank = &banks[b];
+
+        for (i = 0, ones = 0; i < bank->count; i++)
+            ones += eval(bank->addr[i], s);
+
+        disagree += ones < bank->count - ones ? ones : bank->count - ones;
+        if (disagree > allowed)
+            return 0;
+    }
+
+    return 1.0 - (double)disagree / total;
+}
+
+/* Like find_algo() but across all banks at once, keeping functions that score
+ * at least min_confidence. confidence[i] is the score of sarray->s[i]
+ */
+void find_algo_robust(const bank_data_t *banks, int num_banks,
+                        solution_array_t *sarray, double *confidence,
+                        double min_confidence)
+{
+    int i, j, b;
+    int solutions_found = 0;
+    size_t total;
+    double conf;
+    solution_t *s;
+
+    for (b = 0, total = 0; b < num_banks; b++)
+        total += banks[b].count;
+
+    for (i = 0; i < sarray->max_solutions; i++) {
+        s = &sarray->s[i];
+        for (j = 0; j < MAX_DEPTH - 1; j++) {
+            s->ops[j] = XOR;
+        }
+    }
+
+    for (i = 0; i < end_index - start_index + 1; i++) {
+
+        int isFirst = 1;
+
+        while (1) {
+            s = &sarray->s[solutions_found];
+            s->depth = i + 1;
+
+            if (permute(s->indexes, s->depth, start_index, end_index, isFirst) == 0)
+                break;
+
+            conf = score(banks, num_banks, s, total, min_confidence);
+            if (conf >= min_confidence) {
+                assert(solutions_found + 1 < sarray->max_solutions);
+                memcpy(&sarray->s[solutions_found + 1], &sarray->s[solutions_found], sizeof(solution_t));
+                s->valid = 1;
+                confidence[solutions_found] = conf;
+                solutions_found++;
+            }
+
+            isFirst = 0;
+        }
+    }
+
+    sarray->num_solutions = solutions_found;
+}
+
+/* Reports addresses disagreeing with the majority of their bank on any of
+ * the solutions. Returns number of outliers
+ */
+int report_outliers(const bank_data_t *banks, int num_banks,
+                        const solution_array_t *sarray)
+{
+    int b, k, majority, disagree, outliers = 0;
+    size_t i, ones;
+
+    for (b = 0; b < num_banks; b++) {
+        const bank_data_t *bank = &banks[b];
+        int majorities[MAX_SOLUTION];
+
+        for (k = 0; k < sarray->num_solutions; k++) {
+            if (sarray->s[k].valid != 1)
+                continue;
+            for (i = 0, ones = 0; i < bank->count; i++)
+                ones += eval(bank->addr[i], &sarray->s[k]);
+            majorities[k] = ones * 2 > bank->count;
+        }
+
+        for (i = 0; i < bank->count; i++) {
+            for (k = 0, disagree = 0; k < sarray->num_solutions; k++) {
+                if (sarray->s[k].valid != 1)
+                    continue;
+                majority = majorities[k];
+                disagree += eval(bank->addr[i], &sarray->s[k]) != majority;
+            }
+
+            if (disagree) {
+                printf("Outlier: Bank: %d, Addr: 0x%lx, Disagrees with %d solutions\n",
+                        b, bank->addr[i], disagree);
+                outliers++;
+            }
+        }
+    }
+
+    return outliers;
+}
+
+/* Robust counterpart of main()'s loop */
+int solve_robust(FILE *fp, solution_array_t *sarray)
+{
+    static bank_data_t banks[MAX_BANK];
+    static double confidence[MAX_SOLUTION];
+    int num_banks, i, count, outliers;
+
+    num_banks = load_banks(fp, banks);
+    printf("Banks: %d\n", num_banks);
+
+    find_algo_robust(banks, num_banks, sarray, confidence, MIN_CONFIDENCE);
+    find_unique(sarray);
+
+    for (i = 0, count = 0; i < sarray->num_solutions; i++) {
+        if (sarray->s[i].valid == 1) {
+            print_solution(&sarray->s[i]);
+            printf("Confidence: %0.4f\n", confidence[i]);
+            count++;
+        }
+    }
+
+    outliers = report_outliers(banks, num_banks, sarray);
+    printf("Number of outliers:%d\n", outliers);
+
+    for (i = 0; i < num_banks; i++)
+        free(banks[i].addr);
+
+    return count;
+}
+#endif /* ROBUST_SOLVER == 1 */
+
+#if (TRUTH_TABLE_SEARCH == 1)
+#define TT_PATTERNS             (1 << MAX_TT_ARITY)
+
+/* Bits of addr at indexes as a pattern, indexes[0] being the LSB */
+static inline int tt_pattern(uint64_t addr, const int *indexes, int k)
+{
+    int i, p = 0;
+
+    for (i = 0; i < k; i++)
+        p |= ((addr >> indexes[i]) & 1) << i;
+
+    return p;
+}
+
+static int uf_find(int *parent, int x)
+{
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+
+/* Returns 1 if truth table depends on every one of its k inputs, judging only
+ * by seen patterns
+ */
+static int tt_depends_on_all(uint32_t tt, uint32_t seen, int k)
+{
+    int i, p, q, depends;
+
+    for (i = 0; i < k; i++) {
+        for (p = 0, depends = 0; p < (1 << k) && !depends; p++) {
+            q = p ^ (1 << i);
+            depends = ((seen >> p) & 1) && ((seen >> q) & 1) &&
+                        ((tt >> p) & 1) != ((tt >> q) & 1);
+        }
+        if (!depends)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Finds a chain of ops (as evaluated by eval()) with given truth table or its
+ * complement, which is the same bank function. Returns 1 if found
+ */
+static int tt_to_ops(uint32_t tt, int k, solution_t *s)
+{
+    uint32_t mask = (1ULL << (1 << k)) - 1, chain_tt;
+    int combo, combos, i, p, c;
+
+    for (i = 0; i < k; i++)
+        s->indexes[i] = i;
+    s->depth = k;
+
+    for (i = 0, combos = 1; i < k - 1; i++)
+        combos *= 3;
+
+    for (combo = 0; combo < combos; combo++) {
+        for (i = 0, c = combo; i < k - 1; i++, c /= 3)
+            s->ops[i] = c % 3;
+
+        for (p = 0, chain_tt = 0; p < (1 << k); p++)
+            chain_tt |= (uint32_t)eval(p, s) << p;
+
+        if (chain_tt == tt || chain_tt == (~tt & mask))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Searches all bit subsets of up to max_arity bits of the window over all
+ * banks. Returns number of functions found
+ */
+int find_algo_tt(const bank_data_t *banks, int num_banks, int max_arity)
+{
+    int indexes[MAX_TT_ARITY], parent[TT_PATTERNS];
+    int k, b, p, first, root, merges, groups, found = 0;
+    uint32_t seen, tt;
+    size_t i;
+    solution_t s;
+
+    assert(max_arity <= MAX_TT_ARITY);
+
+    for (k = 1; k <= max_arity && k <= end_index - start_index + 1; k++) {
+
+        int isFirst = 1;
+
+        while (permute(indexes, k, start_index, end_index, isFirst)) {
+            isFirst = 0;
+
+            for (p = 0; p < (1 << k); p++)
+                parent[p] = p;
+            seen = 0;
+            merges = 0;
+
+            /* Patterns seen in the same bank must have the same value */
+            for (b = 0; b < num_banks; b++) {
+                for (i = 0, first = -1; i < banks[b].count; i++) {
+                    p = tt_pattern(banks[b].addr[i], indexes, k);
+                    seen |= 1U << p;
+                    if (first < 0) {
+                        first = uf_find(parent, p);
+                        continue;
+                    }
+                    root = uf_find(parent, p);
+                    if (root != first) {
+                        parent[root] = first;
+                        merges++;
+                    }
+                }
+
+                // Only constant functions left
+                if (__builtin_popcount(seen) - merges == 1 &&
+                        seen == (1ULL << (1 << k)) - 1)
+                    break;
+            }
+
+            groups = __builtin_popcount(seen) - merges;
+            if (groups != 2)
+                continue;
+
+            /* Unseen patterns are taken as 0 */
+            first = uf_find(parent, __builtin_ctz(seen));
+            for (p = 0, tt = 0; p < (1 << k); p++) {
+                if ((seen >> p) & 1)
+                    tt |= (uint32_t)(uf_find(parent, p) != first) << p;
+            }
+
+            if (!tt_depends_on_all(tt, seen, k))
+                continue;
+
+            printf("Indexes: ");
+            for (p = 0; p < k; p++)
+                printf("%d ", indexes[p]);
+            printf("\n");
+
+            if (tt_to_ops(tt, k, &s)) {
+                printf("Ops: ");
+                for (p = 0; p < k - 1; p++)
+                    printf("%d ", s.ops[p]);
+                printf("\n");
+            } else {
+                printf("Truth table: 0x%x\n", tt);
+            }
+
+            if (seen != (1ULL << (1 << k)) - 1)
+                printf("Unseen patterns: 0x%llx\n", ~seen & ((1ULL << (1 << k)) - 1));
+
+            found++;
+        }
+    }
+
+    return found;
+}
+
+int solve_tt(FILE *fp)
+{
+    static bank_data_t banks[MAX_BANK];
+    int num_banks, i, count;
+
+    num_banks = load_banks(fp, banks);
+    printf("Banks: %d\n", num_banks);
+
+    count = find_algo_tt(banks, num_banks, MAX_TT_ARITY);
+
+    for (i = 0; i < num_banks; i++)
+        free(banks[i].addr);
+
+    return count;
+}
+#endif /* TRUTH_TABLE_SEARCH == 1 */
+
+#if (MEET_IN_THE_MIDDLE == 1)
+typedef struct mitm_entry {
+    uint64_t sig;
+    uint64_t mask;
+    int next;
+} mitm_entry_t;
+
+/* Next mask with same number of bits set (Gosper's hack) */
+static inline uint64_t next_subset(uint64_t x)
+{
+    uint64_t c = x & -x, r = x + c;
+
+    return (((r ^ x) >> 2) / c) | r;
+}
+
+static inline uint64_t mitm_sig(const uint64_t *col, uint64_t mask)
+{
+    uint64_t sig = 0;
+
+    for (; mask; mask &= mask - 1)
+        sig ^= col[__builtin_ctzll(mask)];
+
+    return sig;
+}
+
+static inline uint64_t mitm_hash(uint64_t sig)
+{
+    return sig * 0x9e3779b97f4a7c15ULL;
+}
+
+static void mitm_add_solution(solution_array_t *sarray, uint64_t mask)
+{
+    solution_t *s;
+    int bit;
+
+    if (sarray->num_solutions + 1 >= sarray->max_solutions) {
+        fprintf(stderr, "Too many solutions, increase MAX_SOLUTION\n");
+        return;
+    }
+
+    s = &sarray->s[sarray->num_solutions++];
+    memset(s, 0, sizeof(*s));
+    for (; mask; mask &= mask - 1) {
+        bit = __builtin_ctzll(mask);
+        s->indexes[s->depth] = start_index + bit;
+        s->ops[s->depth] = XOR;
+        s->depth++;
+    }
+    s->valid = 1;
+}
+
+/* Finds XOR functions of window bits constant in every bank, depth by depth
+ * so that sarray suits find_unique(). Data is assumed to be noise free
+ */
+void find_algo_mitm(const bank_data_t *banks, int num_banks,
+                        solution_array_t *sarray, int max_depth)
+{
+    int width = end_index - start_index + 1;
+    uint64_t window = (1ULL << width) - 1;
+    uint64_t basis[64] = {0}, col[64] = {0};
+    uint64_t d, a, b, sig, h;
+    int rank = 0, bit, b_idx, depth, half;
+    size_t i, count, num_buckets;
+    mitm_entry_t *table;
+    int *buckets, e;
+
+    // Room for next_subset() to step past the window
+    assert(width < 63);
+    sarray->num_solutions = 0;
+
+    /* All address differences within banks span the constraints,
+     * a function must have even parity with each
+     */
+    for (b_idx = 0; b_idx < num_banks; b_idx++) {
+        for (i = 1; i < banks[b_idx].count; i++) {
+            d = ((banks[b_idx].addr[i] ^ banks[b_idx].addr[0]) >> start_index) & window;
+            for (bit = width - 1; bit >= 0 && d; bit--) {
+                if (!((d >> bit) & 1))
+                    continue;
+                if (basis[bit] == 0) {
+                    basis[bit] = d;
+                    break;
+                }
+                d ^= basis[bit];
+            }
+        }
+    }
+
+    /* Signature of bit i: its value in every basis vector */
+    for (bit = 0; bit < width; bit++) {
+        if (basis[bit] == 0)
+            continue;
+        for (i = 0; i < (size_t)width; i++)
+            col[i] |= ((basis[bit] >> i) & 1) << rank;
+        rank++;
+    }
+
+    for (depth = 1; depth <= max_depth && depth <= width; depth++) {
+        half = depth / 2;
+
+        /* Table of all subsets of lower half size */
+        for (count = 1, i = 0; i < (size_t)half; i++)
+            count = count * (width - i) / (i + 1);
+        for (num_buckets = 1; num_buckets < 2 * count; num_buckets <<= 1)
+            ;
+
+        table = malloc(sizeof(mitm_entry_t) * count);
+        buckets = malloc(sizeof(int) * num_buckets);
+        assert(table != NULL && buckets != NULL);
+        memset(buckets, -1, sizeof(int) * num_buckets);
+
+        for (i = 0, a = (1ULL << half) - 1; i < count; i++) {
+            sig = mitm_sig(col, a);
+            h = mitm_hash(sig) & (num_buckets - 1);
+            table[i].sig = sig;
+            table[i].mask = a;
+            table[i].next = buckets[h];
+            buckets[h] = i;
+            // Only the empty subset for depth 1
+            if (a)
+                a = next_subset(a);
+        }
+
+        /* Match with upper half subsets lying fully above them */
+        for (b = (1ULL << (depth - half)) - 1; b < 1ULL << width; b = next_subset(b)) {
+            sig = mitm_sig(col, b);
+            h = mitm_hash(sig) & (num_buckets - 1);
+            for (e = buckets[h]; e >= 0; e = table[e].next) {
+                if (table[e].sig != sig)
+                    continue;
+                if (table[e].mask && (63 - __builtin_clzll(table[e].mask)) >= __builtin_ctzll(b))
+                    continue;
+                mitm_add_solution(sarray, table[e].mask | b);
+            }
+        }
+
+        free(table);
+        free(buckets);
+    }
+}
+
+int solve_mitm(FILE *fp, solution_array_t *sarray)
+{
+    static bank_data_t banks[MAX_BANK];
+    int num_banks, i, count;
+
+    num_banks = load_banks(fp, banks);
+    printf("Banks: %d\n", num_banks);
+
+    find_algo_mitm(banks, num_banks, sarray, MITM_MAX_DEPTH);
+    find_unique(sarray);
+
+    for (i = 0, count = 0; i < sarray->num_solutions; i++) {
+        if (sarray->s[i].valid == 1) {
+            print_solution(&sarray->s[i]);
+            count++;
+        }
+    }
+
+    for (i = 0; i < num_banks; i++)
+        free(banks[i].addr);
+
+    return count;
+}
+#endif /* MEET_IN_THE_MIDDLE == 1 */
+
+/* Benchmarks include this file and call the solver directly */
+#ifndef ALGO_NO_MAIN
+/* Usage: algo [data file] */
+int main(int argc, char *argv[])
 {
     FILE *fp;
+    const char *data_file = argc > 1 ? argv[1] : DATA_FILE;
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
@@ -337,12 +926,33 @@ int main()
     sarray.max_solutions = MAX_SOLUTION;
     sarray.num_solutions = -1;
 
-    fp = fopen(DATA_FILE, "r");
+    fp = fopen(data_file, "r");
     if (fp == NULL) {
         fprintf(stderr, "Couldn't open file\n");
         exit(EXIT_FAILURE);
     }
 
+#if (ROBUST_SOLVER == 1)
+    count = solve_robust(fp, &sarray);
+    fclose(fp);
+    printf("Number of solutions:%d\n", count);
+    exit(EXIT_SUCCESS);
+#endif
+
+#if (MEET_IN_THE_MIDDLE == 1)
+    count = solve_mitm(fp, &sarray);
+    fclose(fp);
+    printf("Number of solutions:%d\n", count);
+    exit(EXIT_SUCCESS);
+#endif
+
+#if (TRUTH_TABLE_SEARCH == 1)
+    count = solve_tt(fp);
+    fclose(fp);
+    printf("Number of solutions:%d\n", count);
+    exit(EXIT_SUCCESS);
+#endif
+
     while (((read = getline(&line, &len, fp)) != -1) || addr_count != 0) {
 
         /* Found new bank */
@@ -403,3 +1013,4 @@ exit:
 
     exit(EXIT_SUCCESS);
 }
+#endif /* ALGO_NO_MAIN */
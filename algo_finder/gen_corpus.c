@@ -0,0 +1,294 @@
+/*
+ * Generates synthetic bank clustered addresses from known XOR bank/channel
+ * functions, in the format algo_finder reads (a line starting with "Bank"
+ * starts a new bank, followed by one address per line).
+ * Used to see how the solver scales on hypothetical mappings.
+ *
+ * Usage: gen_corpus [options] > data.txt
+ *  -f <fns>    Bank functions, e.g. "14;15,18;16,19" (';' separates functions,
+ *              ',' separates bits XORed in a function)
+ *  -c <fns>    Channel functions, same format
+ *  -B <n>      Number of random bank functions (if -f not given)
+ *  -C <n>      Number of random channel functions (if -c not given)
+ *  -d <depth>  Max bits in a random function
+ *  -l <bit>    Lowest address bit that varies
+ *  -h <bit>    Highest address bit that varies (at most MAX_BIT)
+ *  -n <count>  Addresses per bank
+ *  -e <frac>   Fraction of addresses replaced by one of another bank (label
+ *              noise)
+ *  -p <frac>   Fraction of banks emitted (partial coverage)
+ *  -s <seed>   Random seed
+ *  -t <file>   Write the functions used, in algo_finder's solution format
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_BIT                 39
+#define MAX_FNS                 16
+#define DEFAULT_BANK_FNS        5
+#define DEFAULT_CHANNEL_FNS     0
+#define DEFAULT_DEPTH           4
+#define DEFAULT_LOW_BIT         11
+#define DEFAULT_HIGH_BIT        24
+#define DEFAULT_ADDR_PER_BANK   100
+
+typedef struct corpus {
+    uint64_t fns[MAX_FNS];      // Mask of bits XORed in every function
+    int num_fns;
+    int num_bank_fns;           // First num_bank_fns are bank functions
+    int low_bit;
+    int high_bit;
+} corpus_t;
+
+static uint64_t rng_state;
+
+static uint64_t gen_rand(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double gen_frac(void)
+{
+    return (gen_rand() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static uint64_t window_mask(const corpus_t *c)
+{
+    return ((2ULL << c->high_bit) - 1) & ~((1ULL << c->low_bit) - 1);
+}
+
+/* Returns 1 if mask is linearly independent (over XOR) of functions so far,
+ * within the window of bits that vary. Else some clusters can't be filled
+ */
+static int is_independent(const corpus_t *c, uint64_t mask)
+{
+    uint64_t basis[MAX_BIT + 1] = {0};
+    uint64_t v;
+    int i, bit;
+
+    for (i = 0; i <= c->num_fns; i++) {
+        v = (i == c->num_fns ? mask : c->fns[i]) & window_mask(c);
+        for (bit = MAX_BIT; bit >= 0 && v; bit--) {
+            if (!((v >> bit) & 1))
+                continue;
+            if (basis[bit] == 0) {
+                basis[bit] = v;
+                break;
+            }
+            v ^= basis[bit];
+        }
+        if (v == 0 && i == c->num_fns)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int add_fn(corpus_t *c, uint64_t mask)
+{
+    if (c->num_fns == MAX_FNS || (mask & window_mask(c)) == 0 || !is_independent(c, mask))
+        return -1;
+
+    c->fns[c->num_fns++] = mask;
+    return 0;
+}
+
+/* Parses "14;15,18;16,19" into functions */
+static int parse_fns(corpus_t *c, const char *spec)
+{
+    char *copy = strdup(spec), *fn, *bit, *fn_save, *bit_save;
+    uint64_t mask;
+    int b, n;
+
+    for (fn = strtok_r(copy, ";", &fn_save), n = 0; fn;
+            fn = strtok_r(NULL, ";", &fn_save), n++) {
+        for (mask = 0, bit = strtok_r(fn, ",", &bit_save); bit;
+                bit = strtok_r(NULL, ",", &bit_save)) {
+            b = atoi(bit);
+            if (b < 0 || b > MAX_BIT) {
+                fprintf(stderr, "Bit %d out of range\n", b);
+                free(copy);
+                return -1;
+            }
+            mask ^= 1ULL << b;
+        }
+
+        if (add_fn(c, mask) < 0) {
+            fprintf(stderr, "Function %d of %s is dependent on others within bits %d to %d\n",
+                    n + 1, spec, c->low_bit, c->high_bit);
+            free(copy);
+            return -1;
+        }
+    }
+
+    free(copy);
+    return 0;
+}
+
+static void gen_fns(corpus_t *c, int count, int depth)
+{
+    int width = c->high_bit - c->low_bit + 1;
+    int added, bits, i, tries;
+    uint64_t mask;
+
+    for (added = 0, tries = 0; added < count && tries < 1000000; tries++) {
+        bits = 1 + gen_rand() % depth;
+        for (i = 0, mask = 0; i < bits; i++)
+            mask |= 1ULL << (c->low_bit + gen_rand() % width);
+
+        if (add_fn(c, mask) == 0)
+            added++;
+    }
+
+    if (added != count) {
+        fprintf(stderr, "Couldn't generate %d independent functions\n", count);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int cluster_of(const corpus_t *c, uint64_t addr)
+{
+    int i, cluster;
+
+    for (i = 0, cluster = 0; i < c->num_fns; i++)
+        cluster |= __builtin_parityll(addr & c->fns[i]) << i;
+
+    return cluster;
+}
+
+static void write_fns(const corpus_t *c, FILE *fp)
+{
+    int i, bit, depth;
+
+    for (i = 0; i < c->num_fns; i++) {
+        fprintf(fp, "# %s function\n", i < c->num_bank_fns ? "Bank" : "Channel");
+        fprintf(fp, "Indexes: ");
+        for (bit = 0, depth = 0; bit <= MAX_BIT; bit++) {
+            if ((c->fns[i] >> bit) & 1) {
+                fprintf(fp, "%d ", bit);
+                depth++;
+            }
+        }
+        fprintf(fp, "\nOps: ");
+        // XOR in algo_finder's ops_t
+        while (--depth > 0)
+            fprintf(fp, "2 ");
+        fprintf(fp, "\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    corpus_t corpus = { .low_bit = DEFAULT_LOW_BIT, .high_bit = DEFAULT_HIGH_BIT };
+    const char *bank_spec = NULL, *channel_spec = NULL, *truth_file = NULL;
+    int bank_fns = DEFAULT_BANK_FNS, channel_fns = DEFAULT_CHANNEL_FNS;
+    int depth = DEFAULT_DEPTH, per_bank = DEFAULT_ADDR_PER_BANK;
+    double noise = 0, coverage = 1;
+    uint64_t *addrs, addr, range_mask;
+    int *filled, num_clusters, cluster, emitted;
+    int opt, i;
+
+    rng_state = 0x5eed;
+
+    while ((opt = getopt(argc, argv, "f:c:B:C:d:l:h:n:e:p:s:t:")) != -1) {
+        switch (opt) {
+            case 'f': bank_spec = optarg; break;
+            case 'c': channel_spec = optarg; break;
+            case 'B': bank_fns = atoi(optarg); break;
+            case 'C': channel_fns = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'l': corpus.low_bit = atoi(optarg); break;
+            case 'h': corpus.high_bit = atoi(optarg); break;
+            case 'n': per_bank = atoi(optarg); break;
+            case 'e': noise = atof(optarg); break;
+            case 'p': coverage = atof(optarg); break;
+            case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+            case 't': truth_file = optarg; break;
+            default:
+                fprintf(stderr, "See the top of gen_corpus.c for usage\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (corpus.low_bit < 0 || corpus.high_bit > MAX_BIT ||
+            corpus.low_bit > corpus.high_bit || depth < 1 || per_bank < 1) {
+        fprintf(stderr, "Invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bank_spec != NULL) {
+        if (parse_fns(&corpus, bank_spec) < 0)
+            exit(EXIT_FAILURE);
+    } else {
+        gen_fns(&corpus, bank_fns, depth);
+    }
+    corpus.num_bank_fns = corpus.num_fns;
+
+    if (channel_spec != NULL) {
+        if (parse_fns(&corpus, channel_spec) < 0)
+            exit(EXIT_FAILURE);
+    } else {
+        gen_fns(&corpus, channel_fns, depth);
+    }
+
+    if (truth_file != NULL) {
+        FILE *fp = fopen(truth_file, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Couldn't open %s\n", truth_file);
+            exit(EXIT_FAILURE);
+        }
+        write_fns(&corpus, fp);
+        fclose(fp);
+    }
+
+    // Every bank of every channel is a cluster of bank_test
+    num_clusters = 1 << corpus.num_fns;
+    addrs = malloc(sizeof(uint64_t) * num_clusters * per_bank);
+    filled = calloc(sizeof(int), num_clusters);
+    assert(addrs != NULL && filled != NULL);
+
+    range_mask = window_mask(&corpus);
+    for (i = 0; i < num_clusters * per_bank; ) {
+        addr = gen_rand() & range_mask;
+        cluster = cluster_of(&corpus, addr);
+        if (filled[cluster] == per_bank)
+            continue;
+        addrs[cluster * per_bank + filled[cluster]++] = addr;
+        i++;
+    }
+
+    // Label noise: Replace addresses by ones of another cluster, one per event
+    for (i = 0; i < num_clusters * per_bank && num_clusters > 1; i++) {
+        if (gen_frac() >= noise)
+            continue;
+        do {
+            addr = gen_rand() & range_mask;
+        } while (cluster_of(&corpus, addr) == i / per_bank);
+        addrs[i] = addr;
+    }
+
+    for (cluster = 0, emitted = 0; cluster < num_clusters; cluster++) {
+        if (gen_frac() >= coverage)
+            continue;
+
+        printf("Bank: %d\n", emitted++);
+        for (i = 0; i < per_bank; i++)
+            printf("0x%" PRIx64 "\n", addrs[cluster * per_bank + i]);
+    }
+
+    fprintf(stderr, "Functions: %d bank, %d channel, Banks: %d of %d, "
+            "Addresses per bank: %d\n", corpus.num_bank_fns,
+            corpus.num_fns - corpus.num_bank_fns, emitted, num_clusters, per_bank);
+
+    free(addrs);
+    free(filled);
+    return 0;
+}
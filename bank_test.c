@@ -15,6 +15,17 @@
 #include <sched.h>
 #include <stdbool.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <cpuid.h>
+#include <math.h>
+#include <time.h>
+#include <linux/perf_event.h>
+
+#include <glob.h>
+
+#include "kam.h"
 
 #define DEBUG                           1
 #if (DEBUG == 1)
@@ -28,6 +39,7 @@
 #define PAGE_SHIFT                      12
 #define PAGE_SIZE                       (1 << PAGE_SHIFT)
 #define PAGE_MASK                       (PAGE_SIZE - 1)
+#define CACHELINE_SIZE                  64
 
 // Enable at most one of these option
 // Priority order is: Kernel Allocator module > Huge Page > Simple Iterative mmap()
@@ -39,10 +51,74 @@
 
 #define MEM_SIZE                        (1 << 25)
 
+// Simulated timing: Needs no root, hugepages or MSR access. Memory comes from
+// the heap and is given fake contiguous physical addresses from
+// SIMULATED_PHY_START. Pair timings are generated using DEFAULT_BANK_MAPPING:
+// Pairs in same bank but different rows take SIMULATED_CONFLICT_TICKS more,
+// with some jitter and an interrupt spike once every
+// SIMULATED_INTERRUPT_PERIOD samples on average. Used by the benchmarks.
+#ifndef SIMULATED_TIMING
+#define SIMULATED_TIMING                0
+#endif
+#define SIMULATED_PHY_START             0x3c0000000UL
+#define SIMULATED_ROW_SHIFT             17
+#define SIMULATED_BASE_TICKS            300
+#define SIMULATED_CONFLICT_TICKS        150
+#define SIMULATED_JITTER_TICKS          20
+#define SIMULATED_INTERRUPT_PERIOD      5000
+#define SIMULATED_INTERRUPT_TICKS       (50 * SIMULATED_BASE_TICKS)
+// Single uncached reads (profile mode) take half of SIMULATED_BASE_TICKS, plus
+// a few ticks on some banks. Those falling in a refresh, for
+// SIMULATED_REFRESH_BUSY_TICKS every SIMULATED_REFRESH_TICKS of simulated
+// time, wait for it to finish
+#define SIMULATED_REFRESH_TICKS         16384
+#define SIMULATED_REFRESH_BUSY_TICKS    800
+// Single uncached reads in row policy mode take half of SIMULATED_BASE_TICKS
+// when their row is open in the bank, SIMULATED_ACTIVATE_TICKS more when no
+// row is, and also SIMULATED_PRECHARGE_TICKS more when another row is. Rows are
+// closed SIMULATED_ROW_TIMEOUT_TICKS after their last read
+#define SIMULATED_ACTIVATE_TICKS        40
+#define SIMULATED_PRECHARGE_TICKS       40
+#define SIMULATED_ROW_TIMEOUT_TICKS     2000
+
+// Scatter mode: Drops the contiguity requirement, so that bank and channel bits
+// up to the top of memory can be discovered without hugepages or the kernel
+// allocator module. A pool of SCATTER_POOL_SIZE of ordinary locked pages is
+// allocated and all their PFNs are read from pagemap at once. The region of
+// entries is made of SCATTER_REGION_SIZE worth of pool pages, spread across
+// the pool's physical range and chosen so that every physical address bit up
+// to the pool's highest PFN varies. Entries in a page are still MIN_BANK_SIZE
+// apart. With SIMULATED_TIMING the pool gets random PFNs below
+// SIMULATED_SCATTER_MEM_SIZE
+#define SCATTER_MODE                    0
+#define SCATTER_POOL_SIZE               (1UL << 30)
+#define SCATTER_REGION_SIZE             KERNEL_HUGEPAGE_SIZE
+#define SIMULATED_SCATTER_MEM_SIZE      (1UL << 36)
+
+#if (SCATTER_MODE == 1) && ((KERNEL_ALLOCATOR_MODULE == 1) || (KERNEL_PAIR_TIMING == 1))
+#error "Scatter mode allocates from the page allocator, not the kernel allocator module"
+#endif
+
+// Persistent region: Back the region with the hugetlbfs file PERSISTENT_FILE
+// instead of anonymous hugepages. Its hugepages outlive the run, so that
+// repeated runs map the same physical memory. The offset and physical address
+// of the contiguous run, and the calibration (TSC frequency, measurement
+// kernel, sampling and run_exp()'s threshold) are cached in
+// PERSISTENT_CACHE_FILE. Later runs skip the contiguity scan and calibration
+// if the file is the same (inode and size) and the first and last page of the
+// run are still where the cache says. Remove both files to start over.
+#define PERSISTENT_REGION               0
+#define PERSISTENT_FILE                 "/dev/hugepages/bank_test_region"
+#define PERSISTENT_CACHE_FILE           "bank_test_region.cache"
+
 // Using mmap(), we might/might not get contigous pages. We need to try multiple
 // times.
-// Using kernel module, if we can get, we wll get all contiguous on first attempt
-#if (KERNEL_ALLOCATOR_MODULE == 1)
+// Using kernel module, we get all memory on first attempt, with its PFN list
+// In scatter mode, the region is not contiguous at all
+#if (SCATTER_MODE == 1)
+#define NUM_CONTIGOUS_PAGES             (SCATTER_REGION_SIZE / PAGE_SIZE)
+#define MAX_MMAP_ITR                    1
+#elif (KERNEL_ALLOCATOR_MODULE == 1)
 #define NUM_CONTIGOUS_PAGES             (MEM_SIZE / PAGE_SIZE)
 #define MAX_MMAP_ITR                    1
 #elif (KERNEL_HUGEPAGE_ENABLED == 1)
@@ -55,9 +131,63 @@
 #define MAX_INNER_LOOP                  10
 #define MAX_OUTER_LOOP                  100000
 
+// Measurement kernel used for timing a pair (index into measure_kernels[]).
+// -1 to calibrate at startup and pick the supported kernel with the widest
+// conflict/non-conflict gap relative to the noise
+#define MEASURE_KERNEL                  -1
+// Calibration times the first entry against these many entries spread across
+// the region, with fewer samples per pair
+#define CALIBRATION_ENTRIES             64
+#define CALIBRATION_OUTER_LOOP          (MAX_OUTER_LOOP / 100)
+
 // Threshold for timing
 #define THRESHOLD_MULTIPLIER            5
 
+// Tune inner_loop, outer_loop and threshold_multiplier at startup: The cheapest
+// sampling which misclassifies a known conflict and non-conflict pair in at
+// most TUNE_TARGET_ERROR_PERCENTAGE of TUNE_REPETITIONS is used for the run
+#define AUTO_TUNE_SAMPLING              1
+#define TUNE_REPETITIONS                20
+#define TUNE_TARGET_ERROR_PERCENTAGE    1
+
+// As there are interrupts, samples above threshold are rejected and redone.
+// A pair is deferred to the retry queue if more than
+// NOISE_WINDOW_REJECT_PERCENTAGE of its last NOISE_WINDOW samples got rejected,
+// or if it rejected more than MAX_REJECT_PERCENTAGE of outer_loop samples.
+// Deferred pairs are retried at most MAX_PAIR_RETRIES times, with
+// RETRY_BACKOFF_US * attempt sleep before each attempt.
+#define NOISE_WINDOW                    64
+#define NOISE_WINDOW_REJECT_PERCENTAGE  50
+#define MAX_REJECT_PERCENTAGE           100
+#define MAX_PAIR_RETRIES                5
+#define RETRY_BACKOFF_US                1000
+// Rejection rate is also tracked over wall clock windows of this size
+#define NOISE_TIME_WINDOW_MS            100
+#define PAIR_DEFERRED                   (-1.0)
+
+// Measure at SCHED_FIFO priority with all memory locked. Beware, this can
+// starve other tasks on the measurement core
+#define REALTIME_MEASUREMENT            0
+
+// In-kernel pair timing: kam.c times all pairs of a row in one ioctl, with
+// preemption and IRQs disabled for bursts of KERNEL_TIMING_BURST samples.
+// As samples are rarely disturbed, far fewer are needed per pair. Needs the
+// kernel allocator module; with SIMULATED_TIMING the ioctl is emulated. If
+// the loaded module can't time pairs, they are timed in userspace
+#define KERNEL_PAIR_TIMING              0
+#define KERNEL_TIMING_OUTER_LOOP        1000
+#define KERNEL_TIMING_BURST             16
+
+#if (KERNEL_PAIR_TIMING == 1) && (KERNEL_ALLOCATOR_MODULE == 0) && (SIMULATED_TIMING == 0)
+#error "In-kernel pair timing needs the kernel allocator module"
+#endif
+
+// Instrumentation: Per phase wall clock timers (exclusive of nested phases),
+// counters and hardware counters (via perf_event_open()) around measurement
+// loops. Summary is written as JSON to STATS_FILE at exit
+#define INSTRUMENTATION                 1
+#define STATS_FILE                      "bank_test_stats.json"
+
 // By what percentage does a timing needs to be away from average to be considered
 // outlier and hence we can assume that pair of address lie on same bank, different
 // rows
@@ -71,6 +201,10 @@
 // On some systems, HW prefetch details are not well know. Use BIOS setting for
 // disabling it
 #define SOFTWARE_CONTROL_HWPREFETCH     1
+#if (SIMULATED_TIMING == 1)
+#undef SOFTWARE_CONTROL_HWPREFETCH
+#define SOFTWARE_CONTROL_HWPREFETCH     0
+#endif
 
 // Following values need not be exact, just approximation. Limits used for
 // memory allocation
@@ -78,6 +212,202 @@
 #define MAX_BANKS                       64
 #define MIN_BANK_SIZE                   (PAGE_SIZE/ 2)
 
+// Channel/rank discovery mode: Instead of single core latency, drive concurrent
+// streams from multiple cores and find entries that share a channel/rank by
+// the drop in aggregate throughput. Half the threads stream the master entry,
+// other half the candidate entry. An entry is streamed as up to
+// CHANNEL_PROBE_LINES lines of its row (same bits from ROW_SHIFT up) in its
+// bank by the bank mapping hypothesis (MAPPING_FILE), whose functions hold
+// the channel/rank bits, so that many misses to one channel/rank are in flight.
+// The lines are split between the threads of an entry.
+#define CHANNEL_PROBE_MODE              0
+#define CHANNEL_PROBE_THREADS           4
+#define CHANNEL_PROBE_TICKS             (10 * 1000 * 1000)
+#define CHANNEL_PROBE_LINES             64
+// By what percentage does throughput need to drop from the best seen to
+// consider the pair sharing a channel/rank
+#define CHANNEL_PROBE_DROP_PERCENTAGE   15
+// Sets found are written here in algo_finder's input format
+#define CHANNEL_DATA_FILE               "channel_data.txt"
+
+// NUMA mode: Fork one worker per NUMA node. Each worker runs on the last core
+// of its node, binds its memory to the node and prints its mapping to
+// NUMA_OUTPUT_FILE (formatted with node number). All nodes run concurrently.
+// Needs per node hugepage pools (or simple mmap), not the kernel module.
+#define NUMA_MODE                       0
+#define MAX_NUMA_NODES                  8
+#define NUMA_OUTPUT_FILE                "bank_test_node%d.txt"
+#define NUMA_STATS_FILE                 "bank_test_stats_node%d.json"
+#define NUMA_SYSFS_DIR                  "/sys/devices/system/node"
+#define MPOL_BIND                       2
+#define MPOL_MF_STRICT                  (1 << 0)
+
+#if (NUMA_MODE == 1) && (KERNEL_ALLOCATOR_MODULE == 1)
+#error "NUMA mode can't bind kernel allocator module memory"
+#endif
+
+#if (PERSISTENT_REGION == 1) && ((KERNEL_ALLOCATOR_MODULE == 1) || (SCATTER_MODE == 1) || \
+        (KERNEL_HUGEPAGE_ENABLED == 0) || (NUMA_MODE == 1))
+#error "Persistent region needs hugepages, and one run at a time"
+#endif
+
+// Parallel mode: Entries in different channels never conflict, so given the
+// channel functions in PARALLEL_CHANNEL_FILE (MAPPING_FILE's format, e.g.
+// algo_finder's solution on the sets of channel probe mode), run_exp() only
+// times pairs within a channel. Channels are handed out to up to
+// PARALLEL_WORKERS threads, each on its own core counting down from the last
+// one, so that concurrent pairs never share a channel. Every worker times a
+// control pair of its channel after every master entry, and if it takes
+// PARALLEL_INTERFERENCE_PERCENTAGE more than it did alone, the row is timed
+// again with the other workers paused. Without the file run_exp() is serial.
+#define PARALLEL_MODE                   0
+#define PARALLEL_WORKERS                4
+#define PARALLEL_CHANNEL_FILE           "channel_mapping.txt"
+#define PARALLEL_INTERFERENCE_PERCENTAGE 10
+
+#if (PARALLEL_MODE == 1) && ((KERNEL_PAIR_TIMING == 1) || (CHANNEL_PROBE_MODE == 1))
+#error "Parallel mode times pairs in userspace run_exp()"
+#endif
+
+// Cluster mode: Instead of associating entries greedily per master, time every
+// entry against a set of reference entries and cluster the latency vectors.
+// References start as CLUSTER_REFERENCES entries spread across the region, and
+// an entry conflicting with none of them (its bank has no reference yet) is
+// added as one, up to CLUSTER_MAX_REFERENCES. Every reference comes with a
+// second one in another row of its bank. Entries with the same pattern of
+// conflicts are grouped, groups of at least CLUSTER_MIN_GROUP_PERCENTAGE of the
+// largest one give the number of banks, and k-means on the latency vectors
+// assigns every entry. Costs about NUM_ENTRIES * references pairs.
+#define CLUSTER_MODE                    0
+#define CLUSTER_REFERENCES              16
+#define CLUSTER_MAX_REFERENCES          256
+#define CLUSTER_MIN_GROUP_PERCENTAGE    25
+#define CLUSTER_KMEANS_ITERATIONS       20
+// Latencies are normalized by the reference's median, and clamped to this to
+// bound the effect of interrupted samples
+#define CLUSTER_MAX_NORMALIZED          3.0
+// Entries whose confidence (1 - distance to own centroid / distance to nearest
+// other centroid) is below this are listed. Entries in the row of a reference
+// of their bank are expected around 0.4
+#define CLUSTER_LOW_CONFIDENCE          0.25
+
+// Mapping database: Mappings in MAPPING_DB_FILE are keyed by a hardware
+// fingerprint (CPU model, memory size and DIMMs reported by EDAC). On a hit,
+// the stored mapping is only verified with verify_mapping(). On a miss
+// or failed verification, the mapping is discovered, using MAPPING_FILE
+// (algo_finder's output) as hypothesis if present, and stored if
+// check_mapping() finds it consistent.
+#define MAPPING_DB                      0
+#define MAPPING_DB_FILE                 "bank_test_mappings.db"
+#define MAPPING_FILE                    "mapping.txt"
+#define EDAC_SYSFS_DIR                  "/sys/devices/system/edac/mc"
+#define MAX_MAPPING_FNS                 6       // log2(MAX_BANKS)
+// Entries of a bank differing in some bit from ROW_SHIFT up are taken to be in
+// different rows, and those differing only below it in the same row
+#define ROW_SHIFT                       17
+
+// Verify mode: Instead of discovering the mapping, only verify MAPPING_FILE
+// (or the built in hypothesis) and exit with failure if it is refuted.
+// Verification draws pairs per predicted bank, one in the bank (differing in
+// some bit from ROW_SHIFT up, to likely be in a different row) and one
+// against another bank per round. Rounds are timed with
+// VERIFY_OUTER_LOOP_PERCENTAGE of outer_loop samples per pair, until every
+// bank's mismatch rate is shown to be below VERIFY_MAX_MISMATCH_PERCENTAGE, or
+// some bank's above it, at VERIFY_CONFIDENCE. Banks still undecided after
+// VERIFY_MAX_PAIRS_PER_BANK pairs fail the verification.
+#define VERIFY_MODE                     0
+#define VERIFY_CONFIDENCE               0.99
+#define VERIFY_MAX_MISMATCH_PERCENTAGE  5
+#define VERIFY_MIN_PAIRS_PER_BANK       8
+#define VERIFY_MAX_PAIRS_PER_BANK       512
+#define VERIFY_OUTER_LOOP_PERCENTAGE    25
+
+#if (VERIFY_MODE == 1) && ((MAPPING_DB == 1) || (CHANNEL_PROBE_MODE == 1))
+#error "Verify mode can't be combined with mapping database or channel probe"
+#endif
+
+#if (MAPPING_DB == 1) && (CHANNEL_PROBE_MODE == 1)
+#error "Mapping database stores bank mappings, not channel probe results"
+#endif
+
+// Incremental mode: Extends the result of a previous run in INCREMENTAL_FILE
+// (its functions followed by its sets of sibling entries) when MEM_SIZE grows,
+// instead of starting over. Entries varying only in the bits the previous sets
+// varied in are assigned by the previous functions without being timed. Every
+// other entry is timed against a rep of the bank the previous functions
+// predict (and another entry of it in a different row), trying other banks only
+// if it doesn't conflict there, so the cost is in the new entries only. How the
+// new bits change the bank is solved over GF(2) and XORed into the functions;
+// entries in none of the previous banks must be given by one new function.
+// Without INCREMENTAL_FILE (or if extending fails) the mapping is discovered
+// from scratch. The result is written if check_mapping() finds it consistent.
+#define INCREMENTAL_MODE                0
+#define INCREMENTAL_FILE                "bank_test_result.txt"
+// Pairs of reps of different banks giving the non-conflict latency
+#define INCREMENTAL_BASELINE_PAIRS      16
+// Entries tried for the second entry of a bank, in another row than its rep
+#define INCREMENTAL_COMPANION_TRIES     16
+
+#if (INCREMENTAL_MODE == 1) && ((VERIFY_MODE == 1) || (MAPPING_DB == 1) || (CHANNEL_PROBE_MODE == 1))
+#error "Incremental mode can't be combined with verify mode, mapping database or channel probe"
+#endif
+
+// Profile mode: Instead of discovering the mapping, profile the latency of
+// every bank of MAPPING_FILE (or the built in hypothesis), e.g. to find slow
+// banks and refresh (every tREFI) interference. Two entries of every bank, in
+// different rows if possible, are read uncached in turn, every bank in turn,
+// so that all banks share one timeline of PROFILE_SAMPLES_PER_BANK samples per
+// bank. Samples above the bank's median by OUTLIER_PERCENTAGE are spikes. The
+// autocorrelation of spikes over lags in bins of PROFILE_BIN_NS, from
+// PROFILE_MIN_PERIOD_NS to PROFILE_MAX_PERIOD_NS, gives their period if it is
+// at least PROFILE_MIN_AUTOCORRELATION. Latency histograms in buckets of
+// PROFILE_HIST_BUCKET_NS go to PROFILE_HIST_FILE, and the mean latency of
+// every bank per phase within the period (per time window if not periodic) to
+// PROFILE_HEATMAP_FILE.
+#define PROFILE_MODE                    0
+#define PROFILE_SAMPLES_PER_BANK        4096
+#define PROFILE_BIN_NS                  50
+#define PROFILE_MIN_PERIOD_NS           1000
+#define PROFILE_MAX_PERIOD_NS           100000
+#define PROFILE_MIN_AUTOCORRELATION     0.3
+// Lags with fewer pairs than this per spike rate are ignored, which leaves
+// sparsely hit banks to the period of all banks
+#define PROFILE_MIN_SPIKE_PAIRS         8
+#define PROFILE_HIST_BUCKET_NS          5
+#define PROFILE_HEATMAP_COLUMNS         64
+#define PROFILE_HIST_FILE               "bank_latency_hist.csv"
+#define PROFILE_HEATMAP_FILE            "bank_heatmap.csv"
+
+#if (PROFILE_MODE == 1) && ((VERIFY_MODE == 1) || (MAPPING_DB == 1) || \
+                            (CHANNEL_PROBE_MODE == 1) || (INCREMENTAL_MODE == 1))
+#error "Profile mode can't be combined with other modes using the mapping"
+#endif
+
+// Row policy mode: Instead of discovering the mapping, characterize the row
+// buffer of a bank of MAPPING_FILE (or the built in hypothesis). The latency
+// of an uncached read is timed ROW_POLICY_SAMPLES times after a read of
+// another entry in the same row (row hit) and after one in another row of the
+// bank (row conflict), with delays between the two reads from 0 and
+// ROW_POLICY_MIN_DELAY_NS up to ROW_POLICY_MAX_DELAY_NS,
+// ROW_POLICY_STEPS_PER_DECADE per decade. Under an open page policy hits are
+// faster than conflicts by at least ROW_POLICY_MIN_GAP_NS, until the
+// controller closes the row: both then take a row miss. Under a closed page
+// policy all three are the same. Delays are spun on the TSC and latencies
+// reported in ns.
+#define ROW_POLICY_MODE                 0
+#define ROW_POLICY_SAMPLES              1000
+#define ROW_POLICY_MIN_DELAY_NS         10
+#define ROW_POLICY_MAX_DELAY_NS         100000
+#define ROW_POLICY_STEPS_PER_DECADE     4
+#define ROW_POLICY_MIN_GAP_NS           5
+// Entries tried before giving up on finding a row conflict in the mapping
+#define ROW_POLICY_CANDIDATES           8
+
+#if (ROW_POLICY_MODE == 1) && ((VERIFY_MODE == 1) || (MAPPING_DB == 1) || \
+        (CHANNEL_PROBE_MODE == 1) || (INCREMENTAL_MODE == 1) || (PROFILE_MODE == 1))
+#error "Row policy mode can't be combined with other modes using the mapping"
+#endif
+
 // An entry is an address we tested to see on which address it lied
 #define NUM_ENTRIES    ((NUM_CONTIGOUS_PAGES * PAGE_SIZE) / (MIN_BANK_SIZE))
 #define MAX_NUM_ENTRIES_IN_BANK         (NUM_ENTRIES)
@@ -100,19 +430,99 @@ typedef struct banks_t {
 
 bank_t banks[MAX_BANKS];
 
-// This is the crux of program. This function is a hypothesis of the 
+// Sampling done per pair
+int inner_loop = MAX_INNER_LOOP;
+#if (KERNEL_PAIR_TIMING == 1)
+int outer_loop = KERNEL_TIMING_OUTER_LOOP;
+#else
+int outer_loop = MAX_OUTER_LOOP;
+#endif
+double threshold_multiplier = THRESHOLD_MULTIPLIER;
+
+// TSC ticks per nanosecond, set by calibrate_tsc()
+double tsc_per_ns;
+
+// Noise statistics of the measurements, per thread. Those of parallel
+// workers are added to the main thread's when they are done
+struct sched_stats {
+    uint64_t samples;               // Accepted samples
+    uint64_t samples_rejected;
+    uint64_t pairs;
+    uint64_t pairs_deferred;
+    uint64_t pair_retries;
+    uint64_t pairs_given_up;
+    uint64_t windows;               // Wall clock windows seen
+    uint64_t windows_noisy;         // Windows above NOISE_WINDOW_REJECT_PERCENTAGE
+    double max_window_reject_rate;
+    uint64_t window_start_ticks;
+    uint64_t window_samples;
+    uint64_t window_rejects;
+};
+
+__thread struct sched_stats sched_stats;
+
+// PFN of every page of the allocated region, if the allocator reported them.
+// Otherwise the region is physically contiguous
+uint64_t *region_pfns;
+// Virtual address of every page of the region in scatter mode. Otherwise the
+// region is virtually contiguous
+uintptr_t *region_pages;
+
+// Device file and start of the kernel allocator module mapping
+int kam_fd = -1;
+uintptr_t kam_virt_start;
+
+#if (KERNEL_PAIR_TIMING == 1)
+// Cleared if the module can't time pairs, which are then timed in userspace
+int kernel_pair_timing;
+#else
+#define kernel_pair_timing              0
+#endif
+
+// Core to measure on and node to allocate from (-1 for don't care)
+int measure_core = CORE;
+int numa_node = -1;
+
+// Bank bit i of an address is the parity of its bits in fns[i]
+typedef struct bank_mapping {
+    uint64_t fns[MAX_MAPPING_FNS];
+    int num_fns;
+} bank_mapping_t;
+
+#define ADDR_BIT(n)                     (1ULL << (n))
+
+// This is the crux of program. This is a hypothesis of the 
 // physical address to dram bank mapping function.
-// It takes a physical address and returns the bank it thinks it belongs to.
+// phy_to_bank_mapping() takes a physical address and returns the bank it
+// thinks it belongs to.
 // The program will try to test if this function/hypothesis is correct/complete
+#define DEFAULT_BANK_MAPPING {                                          \
+    .fns = {                                                            \
+        ADDR_BIT(14),                                                   \
+        ADDR_BIT(15) | ADDR_BIT(18),                                    \
+        ADDR_BIT(16) | ADDR_BIT(19),                                    \
+        ADDR_BIT(17) | ADDR_BIT(20),                                    \
+        ADDR_BIT(12) | ADDR_BIT(13) | ADDR_BIT(14) | ADDR_BIT(15) |     \
+            ADDR_BIT(16),                                               \
+    },                                                                  \
+    .num_fns = 5,                                                       \
+}
+
+bank_mapping_t bank_mapping = DEFAULT_BANK_MAPPING;
+
+static inline int mapping_bank(const bank_mapping_t *m, uint64_t phy_addr)
+{
+    int i, bank = 0;
+
+    for (i = 0; i < m->num_fns; i++)
+        bank |= __builtin_parityll(phy_addr & m->fns[i]) << i;
+
+    return bank;
+}
+
 int phy_to_bank_mapping(uint64_t phy_addr)
 {
-    bool bit0 = ((phy_addr >> 14) & 1);
-    bool bit1 = (((phy_addr >> 15) ^ (phy_addr >> 18)) & 1);
-    bool bit2 = (((phy_addr >> 16) ^ (phy_addr >> 19)) & 1);
-    bool bit3 = (((phy_addr >> 17) ^ (phy_addr >> 20)) & 1);
-    bool bit4 = (((phy_addr >> 12) ^ (phy_addr >> 13) ^ (phy_addr >> 14) ^
-		  (phy_addr >> 15) ^ (phy_addr >> 16)) & 1);    
-    return (bit0 | (bit1 << 1) | (bit2 << 2) | (bit3 << 3) | (bit4 << 4));
+    return mapping_bank(&bank_mapping, phy_addr);
 }
 
 static void init_banks(void)
@@ -123,6 +533,25 @@ static void init_banks(void)
     }
 }
 
+// Physical address of offset in the allocated region
+static uint64_t region_phy_addr(uintptr_t phy_start, uint64_t offset)
+{
+    if (region_pfns != NULL)
+        return (region_pfns[offset >> PAGE_SHIFT] << PAGE_SHIFT) |
+                (offset & PAGE_MASK);
+
+    return phy_start + offset;
+}
+
+// Virtual address of offset in the allocated region
+static uint64_t region_virt_addr(uint64_t virt_start, uint64_t offset)
+{
+    if (region_pages != NULL)
+        return region_pages[offset >> PAGE_SHIFT] | (offset & PAGE_MASK);
+
+    return virt_start + offset;
+}
+
 static void init_entries(uint64_t virt_start, uintptr_t phy_start)
 {
     uintptr_t inter_bank_spacing = MIN_BANK_SIZE;
@@ -130,24 +559,20 @@ static void init_entries(uint64_t virt_start, uintptr_t phy_start)
     for (i = 0; i < NUM_ENTRIES; i++) {
         entry_t *entry = &entries[i];
         memset(entry, 0, sizeof(*entry));
-        entry->virt_addr = virt_start + i * inter_bank_spacing;
-        entry->phy_addr = phy_start + i * inter_bank_spacing;
+        entry->virt_addr = region_virt_addr(virt_start, i * inter_bank_spacing);
+        entry->phy_addr = region_phy_addr(phy_start, i * inter_bank_spacing);
         entry->bank = -1;
         entry->num_sibling = 0;
         entry->associated = false;
     }
 }
 
-#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
-static int disable_prefetch(int *core, uint64_t *flag)
+// Pins the process to cpu (-1 for last processor). Returns the core
+static int pin_to_core(int cpu)
 {
-    // Assocaite with a single processor
     int num_cpu = get_nprocs();
-    int cpu = CORE;
     cpu_set_t  mask;
-    int ret, fd;
-    char fname[100];
-    uint64_t msr;
+    int ret;
 
     if (cpu == -1) {
         cpu = num_cpu - 1;
@@ -165,8 +590,17 @@ static int disable_prefetch(int *core, uint64_t *flag)
         return -1;
     }
     
-    *core = cpu;
     dprintf("Running on core %d\n", cpu);
+    return cpu;
+}
+
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+// Disables the prefetchers of cpu, their old MSR is saved in flag
+static int disable_prefetch_on(int cpu, uint64_t *flag)
+{
+    int ret, fd;
+    char fname[100];
+    uint64_t msr;
 
     // See: https://software.intel.com/en-us/articles/disclosure-of-hw-prefetcher-control-on-some-intel-processors
     // For details on how to disable prefetching
@@ -202,6 +636,19 @@ static int disable_prefetch(int *core, uint64_t *flag)
     return 0;
 }
 
+static int disable_prefetch(int *core, uint64_t *flag)
+{
+    int cpu;
+
+    // Assocaite with a single processor
+    cpu = pin_to_core(measure_core);
+    if (cpu < 0)
+        return -1;
+
+    *core = cpu;
+    return disable_prefetch_on(cpu, flag);
+}
+
 static int enable_prefetch(int core, uint64_t flag)
 {
     int ret, fd;
@@ -235,459 +682,4813 @@ static int enable_prefetch(int core, uint64_t flag)
 }
 #endif /* SOFTWARE_CONTROL_HWPREFETCH == 1 */
 
-static inline uint64_t currentTicks(void)
+#if (INSTRUMENTATION == 1)
+typedef enum {
+    PHASE_ALLOCATION,
+    PHASE_CONTIGUITY_SCAN,
+    PHASE_PAGEMAP,
+    PHASE_CALIBRATION,
+    PHASE_SAMPLING,
+    PHASE_ASSOCIATION,
+    PHASE_CHECK_MAPPING,
+    NUM_PHASES,
+} phase_t;
+
+static const char *phase_names[NUM_PHASES] = {
+    "allocation",
+    "contiguity_scan",
+    "pagemap",
+    "calibration",
+    "sampling",
+    "association",
+    "check_mapping",
+};
+
+enum {
+    PERF_CYCLES,
+    PERF_LLC_MISSES,
+    PERF_CONTEXT_SWITCHES,
+    NUM_PERF_COUNTERS,
+};
+
+#define MAX_PHASE_DEPTH                 8
+
+struct instr {
+    uint64_t phase_ns[NUM_PHASES];
+    uint64_t phase_start_ns[NUM_PHASES];
+    phase_t phase_stack[MAX_PHASE_DEPTH];
+    int depth;
+    uint64_t start_ns;
+    uint64_t pagemap_reads;
+    int perf_fds[NUM_PERF_COUNTERS];
+    int core;
+    uint64_t start_interrupts;
+};
+
+// Per thread, so that parallel workers keep their own phase stack. Only the
+// main thread's is summarized
+__thread struct instr instr;
+
+#define PHASE_BEGIN(p)                  phase_begin(p)
+#define PHASE_END(p)                    phase_end(p)
+#define INSTR_COUNT(c)                  (instr.c++)
+#define PERF_START()                    perf_counters_enable(PERF_EVENT_IOC_ENABLE)
+#define PERF_STOP()                     perf_counters_enable(PERF_EVENT_IOC_DISABLE)
+
+static uint64_t now_ns(void)
 {
-      unsigned int a, d;
-      asm volatile("rdtsc" : "=a" (a), "=d" (d));
-      return (uint64_t)(a) | ((uint64_t)(d) << 32);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-// Returns the avg time
-double find_read_time(void *_a, void *_b, double threshold)
+// Time is accounted only to the innermost phase
+static void phase_begin(phase_t p)
 {
-    uint64_t a = (uint64_t)(uintptr_t)_a;
-    uint64_t b = (uint64_t)(uintptr_t)_b;
-    int i, j;
-    uint64_t start_ticks, end_ticks, ticks;
-    uint64_t min_ticks, max_ticks, sum_ticks;
-    double avg_ticks;
-    int sum;
+    uint64_t now = now_ns();
 
-    assert((uintptr_t)(a) == (uintptr_t)(_a));
-    assert((uintptr_t)(b) == (uintptr_t)(_b));
+    assert(instr.depth < MAX_PHASE_DEPTH);
+    if (instr.depth > 0) {
+        phase_t top = instr.phase_stack[instr.depth - 1];
+        instr.phase_ns[top] += now - instr.phase_start_ns[top];
+    }
 
-    *(uint64_t *)(_a) = 0;
-    *(uint64_t *)(_b) = 0;
-    for (i = 0, sum_ticks = 0, min_ticks = LONG_MAX, max_ticks = 0;
-            i < MAX_OUTER_LOOP; i++) {
-        
-        start_ticks = currentTicks();
-        for (j = 0, sum = 0; j < MAX_INNER_LOOP; j++) {
-            asm volatile ("addl (%1), %0\n\t"
-                          "addl (%2), %0\n\t"
-                          "clflush (%1)\n\t"
-                          "clflush (%2)\n\t"
-                          "mfence\n\t": "=r" (sum) : "r" (a), "r" (b) : "memory");
-        }
-        end_ticks = currentTicks();
+    instr.phase_stack[instr.depth++] = p;
+    instr.phase_start_ns[p] = now;
+}
 
-        ticks = end_ticks - start_ticks;
-        assert(ticks > 0);
-        assert(*(uint64_t *)_a == 0);
-        assert(*(uint64_t *)_b == 0);
-        // TODO: Why is sum not zero?
-        //if (sum != 0)
-        //    printf("Sum is:%d\n", sum);
-        //assert(sum == 0);
+static void phase_end(phase_t p)
+{
+    uint64_t now = now_ns();
 
-        /* As there are timer interrupts, we reject outliers based on threshold */
-        if ((double)(ticks) > threshold) {
-            i--;
-            continue;
-        }
-        min_ticks = ticks < min_ticks ? ticks : min_ticks;
-        max_ticks = ticks > max_ticks ? ticks : max_ticks;
-        sum_ticks += ticks;
+    assert(instr.depth > 0 && instr.phase_stack[instr.depth - 1] == p);
+    instr.phase_ns[p] += now - instr.phase_start_ns[p];
+
+    if (--instr.depth > 0)
+        instr.phase_start_ns[instr.phase_stack[instr.depth - 1]] = now;
+}
+
+static int perf_counter_open(uint32_t type, uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    if (fd < 0) {
+        // Might not be allowed to count kernel events
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
     }
 
-    avg_ticks = (sum_ticks * 1.0f) / MAX_OUTER_LOOP;
-    dprintf("Avg Ticks: %0.3f,\tMax Ticks: %ld,\tMin Ticks: %ld\n",
-            avg_ticks, max_ticks, min_ticks);
-    return avg_ticks;
+    return fd;
 }
 
-uintptr_t get_physical_addr(uintptr_t virtual_addr) {
-    
-    uint64_t frame_num;
-    int ret;
-    uint64_t value;
-    off_t pos;
-    int fd = open("/proc/self/pagemap", O_RDONLY);
-    assert(fd >= 0);
-    
-    pos = lseek(fd, (virtual_addr / PAGE_SIZE) * 8, SEEK_SET);
-    assert(pos >= 0);
-    
-    ret = read(fd, &value, 8);
-    assert(ret == 8);
-    
-    ret = close(fd);
-    assert(ret == 0);
-    
-    frame_num = value & ((1ULL << 54) - 1);
-    return (frame_num * PAGE_SIZE) | (virtual_addr & PAGE_MASK);
+static void perf_counters_enable(unsigned long op)
+{
+    if (instr.perf_fds[0] >= 0)
+        ioctl(instr.perf_fds[0], op, PERF_IOC_FLAG_GROUP);
 }
 
-/* Searches if from start to start + length - 1 has at any point contigous pages
- * which are contigous. If so, returns the start address of them
- */
-void *is_contiguous(void *_start, size_t length, int contigous_pages)
+// Sums the interrupts on core from /proc/interrupts
+static uint64_t read_core_interrupts(int core)
 {
-    uintptr_t start = (uintptr_t)_start;
-    uintptr_t end = start + length - 1;
-    uintptr_t current;
-    uintptr_t prev_phy_addr;
-    int found = 1;
+    FILE *fp = fopen("/proc/interrupts", "r");
+    char *line = NULL, *p, *end;
+    size_t len = 0;
+    uint64_t total = 0, val = 0;
+    int col;
 
-    assert((start & PAGE_MASK) == 0);
-    assert((length & PAGE_MASK) == 0);
-    assert((start + length) > start);
+    if (fp == NULL)
+        return 0;
 
-    for(current = start + PAGE_SIZE, prev_phy_addr = get_physical_addr(start);
-            current <= end && found < contigous_pages;
-            current += PAGE_SIZE) {
-        
-        uintptr_t cur_phy_addr = get_physical_addr(current);
-        if (cur_phy_addr == (prev_phy_addr + PAGE_SIZE)) {
-                found++;
-        } else {
-            start = current;
-            found = 1;
-        }
+    // Skip header of CPU columns. Assumes all cpus are online
+    if (getline(&line, &len, fp) < 0)
+        goto out;
 
-        prev_phy_addr = cur_phy_addr;
-    } 
+    while (getline(&line, &len, fp) >= 0) {
+        p = strchr(line, ':');
+        if (p == NULL)
+            continue;
+        p++;
 
-    if (found >= contigous_pages) {
-       
-        dprintf("Found contiguous pages\n");
-        for (int i = 0; i < found; i++) {
-            dprintf("Virt:0x%lx, Phy:0x%lx\n", start + i * PAGE_SIZE,
-                    get_physical_addr(start + i * PAGE_SIZE));
+        for (col = 0; col <= core; col++) {
+            val = strtoull(p, &end, 10);
+            if (end == p)
+                break;
+            p = end;
         }
-        return (void *)start;
+
+        if (col > core)
+            total += val;
     }
 
-    return NULL;
+out:
+    free(line);
+    fclose(fp);
+    return total;
 }
 
-#if (KERNEL_ALLOCATOR_MODULE==1)
-void *mmap_contiguous(size_t len, uint64_t *phy_start_addr)
+void instr_init(void)
 {
-    void *ret;
-    int iret;
-    int fd = open(KERNEL_ALLOCATOR_MODULE_FILE, O_RDWR);
-    if (fd < 0) {
-        eprint("Couldn't open device file\n");
-        return NULL;
-    }
+    int i;
 
-    ret = mmap(NULL, len, PROT_READ | PROT_WRITE,
-            MAP_SHARED, fd, 0);
+    memset(&instr, 0, sizeof(instr));
+    instr.start_ns = now_ns();
+    instr.core = sched_getcpu();
+    instr.start_interrupts = read_core_interrupts(instr.core);
 
-    /* We don't close the file. We let it close when exit */
-    if (ret == MAP_FAILED) {
-        eprint("Couldn't allocate memory from device\n");
-        return MAP_FAILED;
-    }
+    instr.perf_fds[PERF_CYCLES] = perf_counter_open(PERF_TYPE_HARDWARE,
+                                    PERF_COUNT_HW_CPU_CYCLES, -1);
+    instr.perf_fds[PERF_LLC_MISSES] = perf_counter_open(PERF_TYPE_HARDWARE,
+                                    PERF_COUNT_HW_CACHE_MISSES, instr.perf_fds[0]);
+    instr.perf_fds[PERF_CONTEXT_SWITCHES] = perf_counter_open(PERF_TYPE_SOFTWARE,
+                                    PERF_COUNT_SW_CONTEXT_SWITCHES, instr.perf_fds[0]);
 
-    // Get the physcal address of start address
-    iret = ioctl(fd, 0, phy_start_addr);
-    if (iret < 0) {
-        eprint("Couldn't find the physical address of start\n");
-        return MAP_FAILED;
+    for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (instr.perf_fds[i] < 0) {
+            eprint("Couldn't open perf counters, not counting them\n");
+            for (i = 0; i < NUM_PERF_COUNTERS; i++) {
+                if (instr.perf_fds[i] >= 0)
+                    close(instr.perf_fds[i]);
+                instr.perf_fds[i] = -1;
+            }
+            break;
+        }
     }
+}
 
-    dprintf("Device allocate: Virt Addr: %p, Phy Addr: %p, Len: 0x%lx\n",
-            ret, (void *)*phy_start_addr, len);
-   
-    /*
-     * TODO: Find why /proc/self/pagemap is not having proper entry 
-     * for this page
-
-    for (int i = 0; i < len / PAGE_SIZE; i++) {
-        uintptr_t v = (uintptr_t)(ret) + i * PAGE_SIZE;
-        printf("Virt:0x%lx, Phy:0x%lx\n", v,  get_physical_addr(v));
-    }
-    */
+// Instrumentation of a worker thread, which doesn't count perf events
+void instr_thread_init(void)
+{
+    int i;
 
-    return ret;
+    memset(&instr, 0, sizeof(instr));
+    for (i = 0; i < NUM_PERF_COUNTERS; i++)
+        instr.perf_fds[i] = -1;
 }
-#endif // KERNEL_ALLOCATOR_MODULE==1
 
-/* Tries to allocate physical contigous pages and return the start address */
-void *allocate_contigous(int contiguous_pages, uintptr_t *phy_start) {
-    
-    int max_itr = MAX_MMAP_ITR;
+// Writes the summary of the run as JSON
+void instr_summary(const char *fname)
+{
+    struct sched_stats *st = &sched_stats;
+    struct {
+        uint64_t nr;
+        uint64_t values[NUM_PERF_COUNTERS];
+    } perf_values;
+    bool perf_valid = false;
+    FILE *fp;
     int i;
-    size_t len = MEM_SIZE;
 
-    if (contiguous_pages * PAGE_SIZE > len) {
-        eprint("Number of contiguous pages requested is too large\n");
-        return NULL;
+    if (instr.perf_fds[0] >= 0) {
+        perf_valid = read(instr.perf_fds[0], &perf_values, sizeof(perf_values)) ==
+                        sizeof(perf_values);
+        for (i = 0; i < NUM_PERF_COUNTERS; i++)
+            close(instr.perf_fds[i]);
     }
 
-    for (i = 0; i < max_itr; i++) {
-#if (KERNEL_ALLOCATOR_MODULE == 1)
-        void *virt_start = mmap_contiguous(len, phy_start);
-#elif   (KERNEL_HUGEPAGE_ENABLED == 1)
-        void *virt_start = mmap(NULL, len, PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
-                            -1, 0);
-#else
-        void *virt_start = mmap(NULL, len, PROT_READ | PROT_WRITE,
-                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
-                           -1, 0);
-#endif
-        if(virt_start == MAP_FAILED || virt_start == NULL) {
-            eprint("Memory allocation failed\n");
-            return NULL;
-        }
-        assert(mlock(virt_start, len) == 0);
+    fp = fopen(fname, "w");
+    if (fp == NULL) {
+        eprint("Couldn't open %s: %s\n", fname, strerror(errno));
+        return;
+    }
 
-#if (KERNEL_ALLOCATOR_MODULE == 1)
-        // Allocation by kernel is always contigous
-        return virt_start;
-#endif
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"total_ms\": %0.3f,\n", (now_ns() - instr.start_ns) / 1e6);
+    fprintf(fp, "  \"phases_ms\": {\n");
+    for (i = 0; i < NUM_PHASES; i++) {
+        fprintf(fp, "    \"%s\": %0.3f%s\n", phase_names[i],
+                instr.phase_ns[i] / 1e6, i == NUM_PHASES - 1 ? "" : ",");
+    }
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"counters\": {\n");
+    fprintf(fp, "    \"pairs_measured\": %ld,\n", st->pairs);
+    fprintf(fp, "    \"pairs_deferred\": %ld,\n", st->pairs_deferred);
+    fprintf(fp, "    \"pair_retries\": %ld,\n", st->pair_retries);
+    fprintf(fp, "    \"pairs_given_up\": %ld,\n", st->pairs_given_up);
+    fprintf(fp, "    \"samples\": %ld,\n", st->samples);
+    fprintf(fp, "    \"samples_rejected\": %ld,\n", st->samples_rejected);
+    fprintf(fp, "    \"noisy_windows\": %ld,\n", st->windows_noisy);
+    fprintf(fp, "    \"pagemap_reads\": %ld\n", instr.pagemap_reads);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"core\": %d,\n", instr.core);
+    fprintf(fp, "  \"interrupts\": %ld,\n",
+            read_core_interrupts(instr.core) - instr.start_interrupts);
+    if (perf_valid) {
+        fprintf(fp, "  \"perf\": {\n");
+        fprintf(fp, "    \"cycles\": %ld,\n", perf_values.values[PERF_CYCLES]);
+        fprintf(fp, "    \"llc_misses\": %ld,\n", perf_values.values[PERF_LLC_MISSES]);
+        fprintf(fp, "    \"context_switches\": %ld\n",
+                perf_values.values[PERF_CONTEXT_SWITCHES]);
+        fprintf(fp, "  }\n");
+    } else {
+        fprintf(fp, "  \"perf\": null\n");
+    }
+    fprintf(fp, "}\n");
+
+    fclose(fp);
+    printf("Run statistics written to %s\n", fname);
+}
+#else
+#define PHASE_BEGIN(p)
+#define PHASE_END(p)
+#define INSTR_COUNT(c)
+#define PERF_START()
+#define PERF_STOP()
+#endif /* INSTRUMENTATION == 1 */
+
+static inline uint64_t currentTicks(void)
+{
+      unsigned int a, d;
+      asm volatile("rdtsc" : "=a" (a), "=d" (d));
+      return (uint64_t)(a) | ((uint64_t)(d) << 32);
+}
+
+// rdtsc is not serializing. Fence it so that it is not executed before the
+// loads preceding it have finished (or after the loads following it started)
+static inline uint64_t fencedStartTicks(void)
+{
+      unsigned int a, d;
+      asm volatile("lfence\n\t"
+                   "rdtsc\n\t"
+                   "lfence" : "=a" (a), "=d" (d) :: "memory");
+      return (uint64_t)(a) | ((uint64_t)(d) << 32);
+}
+
+static inline uint64_t fencedEndTicks(void)
+{
+      unsigned int a, d, c;
+      asm volatile("rdtscp\n\t"
+                   "lfence" : "=a" (a), "=d" (d), "=c" (c) :: "memory");
+      return (uint64_t)(a) | ((uint64_t)(d) << 32);
+}
+
+static bool cpu_has_clflush(void)
+{
+    unsigned int a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (d & (1 << 19));
+}
+
+static bool cpu_has_sse41(void)
+{
+    unsigned int a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 19));
+}
+
+static bool cpu_has_clflushopt(void)
+{
+    unsigned int a, b, c, d;
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 23));
+}
+
+static bool cpu_has_rdtscp(void)
+{
+    unsigned int a, b, c, d;
+    return __get_cpuid(0x80000001, &a, &b, &c, &d) && (d & (1 << 27));
+}
+
+static bool cpu_has_chase(void)
+{
+    return cpu_has_clflush() && cpu_has_rdtscp();
+}
+
+static bool cpu_has_sse_load(void)
+{
+    return cpu_has_sse41() && cpu_has_rdtscp();
+}
+
+// Original kernel: Unserialized rdtsc around loads followed by clflush
+static uint64_t time_pair_clflush(uint64_t a, uint64_t b, int inner)
+{
+    uint64_t start_ticks, end_ticks;
+    int j, sum;
+
+    start_ticks = currentTicks();
+    for (j = 0, sum = 0; j < inner; j++) {
+        asm volatile ("addl (%1), %0\n\t"
+                      "addl (%2), %0\n\t"
+                      "clflush (%1)\n\t"
+                      "clflush (%2)\n\t"
+                      "mfence\n\t": "=r" (sum) : "r" (a), "r" (b) : "memory");
+    }
+    end_ticks = currentTicks();
+
+    // TODO: Why is sum not zero?
+    //if (sum != 0)
+    //    printf("Sum is:%d\n", sum);
+    //assert(sum == 0);
+
+    return end_ticks - start_ticks;
+}
+
+static uint64_t time_pair_rdtscp(uint64_t a, uint64_t b, int inner)
+{
+    uint64_t start_ticks, end_ticks;
+    int j, sum;
+
+    start_ticks = fencedStartTicks();
+    for (j = 0, sum = 0; j < inner; j++) {
+        asm volatile ("addl (%1), %0\n\t"
+                      "addl (%2), %0\n\t"
+                      "clflush (%1)\n\t"
+                      "clflush (%2)\n\t"
+                      "mfence\n\t": "=r" (sum) : "r" (a), "r" (b) : "memory");
+    }
+    end_ticks = fencedEndTicks();
+
+    return end_ticks - start_ticks;
+}
+
+// clflushopt is weakly ordered, so needs the mfence to finish flushing
+static uint64_t time_pair_clflushopt(uint64_t a, uint64_t b, int inner)
+{
+    uint64_t start_ticks, end_ticks;
+    int j, sum;
+
+    start_ticks = fencedStartTicks();
+    for (j = 0, sum = 0; j < inner; j++) {
+        asm volatile ("addl (%1), %0\n\t"
+                      "addl (%2), %0\n\t"
+                      "clflushopt (%1)\n\t"
+                      "clflushopt (%2)\n\t"
+                      "mfence\n\t": "=r" (sum) : "r" (a), "r" (b) : "memory");
+    }
+    end_ticks = fencedEndTicks();
+
+    return end_ticks - start_ticks;
+}
+
+// a holds pointer to b, so both loads are serialized in the pipeline
+static uint64_t time_pair_chase(uint64_t a, uint64_t b, int inner)
+{
+    uint64_t start_ticks, end_ticks;
+    uint64_t p;
+    int j;
+
+    start_ticks = fencedStartTicks();
+    for (j = 0; j < inner; j++) {
+        asm volatile ("mov (%1), %0\n\t"
+                      "mov (%0), %0\n\t"
+                      "clflush (%1)\n\t"
+                      "clflush (%2)\n\t"
+                      "mfence\n\t": "=&r" (p) : "r" (a), "r" (b) : "memory");
+    }
+    end_ticks = fencedEndTicks();
+
+    return end_ticks - start_ticks;
+}
+
+/* Like clflush but with 16 byte SSE loads, fenced. movntdqa only streams from
+ * write-combining memory, on the write-back pages here it is a plain load
+ */
+static uint64_t time_pair_sse(uint64_t a, uint64_t b, int inner)
+{
+    uint64_t start_ticks, end_ticks;
+    int j;
+
+    start_ticks = fencedStartTicks();
+    for (j = 0; j < inner; j++) {
+        asm volatile ("movntdqa (%0), %%xmm0\n\t"
+                      "movntdqa (%1), %%xmm1\n\t"
+                      "clflush (%0)\n\t"
+                      "clflush (%1)\n\t"
+                      "mfence\n\t" :: "r" (a), "r" (b) : "memory", "xmm0", "xmm1");
+    }
+    end_ticks = fencedEndTicks();
+
+    return end_ticks - start_ticks;
+}
+
+#if (SIMULATED_TIMING == 1)
+uintptr_t sim_virt_start;
+// Fake PFN of every page from sim_virt_start in scatter mode, else the memory
+// is contiguous from SIMULATED_PHY_START
+uint64_t *sim_pfns;
+static __thread uint64_t sim_rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t sim_rand(void)
+{
+    // xorshift64 - Deterministic so that runs are reproducible
+    sim_rng_state ^= sim_rng_state << 13;
+    sim_rng_state ^= sim_rng_state >> 7;
+    sim_rng_state ^= sim_rng_state << 17;
+    return sim_rng_state;
+}
+
+// Simulated machine, independent of the hypothesis being checked
+static const bank_mapping_t sim_bank_mapping = DEFAULT_BANK_MAPPING;
+
+static uint64_t sim_phy_addr(uint64_t virt)
+{
+    uint64_t offset = virt - sim_virt_start;
+
+    if (sim_pfns != NULL)
+        return (sim_pfns[offset >> PAGE_SHIFT] << PAGE_SHIFT) | (offset & PAGE_MASK);
+
+    return SIMULATED_PHY_START + offset;
+}
+
+static uint64_t time_pair_simulated(uint64_t a, uint64_t b, int inner)
+{
+    uint64_t phy_a = sim_phy_addr(a);
+    uint64_t phy_b = sim_phy_addr(b);
+    uint64_t ticks = SIMULATED_BASE_TICKS;
+
+    if (mapping_bank(&sim_bank_mapping, phy_a) == mapping_bank(&sim_bank_mapping, phy_b) &&
+            (phy_a >> SIMULATED_ROW_SHIFT) != (phy_b >> SIMULATED_ROW_SHIFT))
+        ticks += SIMULATED_CONFLICT_TICKS;
+
+    ticks = ticks * inner + sim_rand() % SIMULATED_JITTER_TICKS;
+    if (sim_rand() % SIMULATED_INTERRUPT_PERIOD == 0)
+        ticks += SIMULATED_INTERRUPT_TICKS;
+
+    return ticks;
+}
+
+#if (PROFILE_MODE == 1) || (ROW_POLICY_MODE == 1)
+static uint64_t sim_clock;
+#endif
+
+#if (PROFILE_MODE == 1)
+static uint64_t time_access_simulated(uint64_t a, uint64_t *when)
+{
+    uint64_t ticks = SIMULATED_BASE_TICKS / 2 + sim_rand() % SIMULATED_JITTER_TICKS;
+    uint64_t phase = sim_clock % SIMULATED_REFRESH_TICKS;
+
+    ticks += 4 * (mapping_bank(&sim_bank_mapping, sim_phy_addr(a)) % 3);
+    if (phase < SIMULATED_REFRESH_BUSY_TICKS)
+        ticks += SIMULATED_REFRESH_BUSY_TICKS - phase;
+    if (sim_rand() % SIMULATED_INTERRUPT_PERIOD == 0)
+        ticks += SIMULATED_INTERRUPT_TICKS;
+
+    *when = sim_clock;
+    sim_clock += ticks;
+    return ticks;
+}
+#endif
+
+#if (ROW_POLICY_MODE == 1)
+// Row open in every bank (plus one, 0 if none) and when it was last read
+static uint64_t sim_open_row[MAX_BANKS], sim_row_used[MAX_BANKS];
+
+static uint64_t time_row_access_simulated(uint64_t a)
+{
+    uint64_t phy = sim_phy_addr(a), row = (phy >> SIMULATED_ROW_SHIFT) + 1;
+    uint64_t ticks = SIMULATED_BASE_TICKS / 2 + sim_rand() % SIMULATED_JITTER_TICKS;
+    int bank = mapping_bank(&sim_bank_mapping, phy);
+
+    if (sim_clock - sim_row_used[bank] > SIMULATED_ROW_TIMEOUT_TICKS)
+        sim_open_row[bank] = 0;
+    if (sim_open_row[bank] != row)
+        ticks += SIMULATED_ACTIVATE_TICKS;
+    if (sim_open_row[bank] != row && sim_open_row[bank] != 0)
+        ticks += SIMULATED_PRECHARGE_TICKS;
+    if (sim_rand() % SIMULATED_INTERRUPT_PERIOD == 0)
+        ticks += SIMULATED_INTERRUPT_TICKS;
+
+    sim_clock += ticks;
+    sim_open_row[bank] = row;
+    sim_row_used[bank] = sim_clock;
+    return ticks;
+}
+#endif
+#endif /* SIMULATED_TIMING == 1 */
+
+typedef struct measure_kernel {
+    const char *name;
+    bool (*supported)(void);
+    // Returns the ticks taken for accessing a and b inner number of times
+    uint64_t (*time_pair)(uint64_t a, uint64_t b, int inner);
+    bool chase;                 // Pair needs to hold pointers to each other
+} measure_kernel_t;
+
+measure_kernel_t measure_kernels[] = {
+    { "clflush",    cpu_has_clflush,    time_pair_clflush,      false },
+    { "rdtscp",     cpu_has_chase,      time_pair_rdtscp,       false },
+    { "clflushopt", cpu_has_clflushopt, time_pair_clflushopt,   false },
+    { "chase",      cpu_has_chase,      time_pair_chase,        true  },
+    { "sse",        cpu_has_sse_load,   time_pair_sse,          false },
+};
+
+#define NUM_MEASURE_KERNELS     (sizeof(measure_kernels) / sizeof(measure_kernels[0]))
+
+measure_kernel_t *measure_kernel = &measure_kernels[0];
+
+// Accounts samples in the current wall clock window
+static void account_window(uint64_t samples, uint64_t rejects)
+{
+    struct sched_stats *st = &sched_stats;
+    uint64_t now = currentTicks();
+    double rate;
+
+    st->window_samples += samples;
+    st->window_rejects += rejects;
+
+    if (tsc_per_ns == 0 ||
+            (now - st->window_start_ticks) < NOISE_TIME_WINDOW_MS * 1e6 * tsc_per_ns)
+        return;
+
+    if (st->window_start_ticks != 0 && st->window_samples + st->window_rejects > 0) {
+        rate = (st->window_rejects * 100.0) /
+                    (st->window_samples + st->window_rejects);
+        st->windows++;
+        st->windows_noisy += rate > NOISE_WINDOW_REJECT_PERCENTAGE;
+        st->max_window_reject_rate = rate > st->max_window_reject_rate ?
+                                        rate : st->max_window_reject_rate;
+    }
+
+    st->window_start_ticks = now;
+    st->window_samples = 0;
+    st->window_rejects = 0;
+}
+
+#if (KERNEL_PAIR_TIMING == 1)
+#if (SIMULATED_TIMING == 1)
+// Emulates KAM_IOCTL_TIME_PAIRS on the simulated region
+static int kam_time_pairs_ioctl(struct kam_time_pairs *req)
+{
+    const struct kam_pair *pairs = (const struct kam_pair *)(uintptr_t)req->pairs;
+    struct kam_pair_stat *stats = (struct kam_pair_stat *)(uintptr_t)req->stats;
+    uint32_t i, attempts;
+    uint64_t ticks;
+
+    for (i = 0; i < req->num_pairs; i++) {
+        struct kam_pair_stat *st = &stats[i];
+
+        memset(st, 0, sizeof(*st));
+        st->min = UINT64_MAX;
+        for (attempts = 0; st->samples < req->samples &&
+                attempts < req->samples * KAM_MAX_ATTEMPTS_FACTOR; attempts++) {
+            ticks = time_pair_simulated(kam_virt_start + pairs[i].a,
+                                        kam_virt_start + pairs[i].b, req->inner);
+            if (req->threshold && ticks > req->threshold) {
+                st->rejected++;
+                continue;
+            }
+            st->sum += ticks;
+            st->min = ticks < st->min ? ticks : st->min;
+            st->max = ticks > st->max ? ticks : st->max;
+            st->samples++;
+        }
+    }
+
+    return 0;
+}
+#else
+static int kam_time_pairs_ioctl(struct kam_time_pairs *req)
+{
+    return ioctl(kam_fd, KAM_IOCTL_TIME_PAIRS, req);
+}
+#endif /* SIMULATED_TIMING == 1 */
+
+// Times pairs (a, b[k]) in kernel, in batches. Fills avgs[k] like
+// find_read_time() does
+static void kernel_time_pairs(uintptr_t a, const uintptr_t *b, int num,
+                                double threshold, double *avgs)
+{
+    // Allocated once, as entries[] already takes most of .bss
+    static struct kam_pair *pairs;
+    static struct kam_pair_stat *stats;
+    struct kam_time_pairs req;
+    int done, batch, k, ret;
+
+    assert(inner_loop <= KAM_MAX_INNER && outer_loop <= KAM_MAX_SAMPLES);
+
+    if (pairs == NULL) {
+        pairs = calloc(KAM_MAX_TIME_PAIRS, sizeof(*pairs));
+        stats = calloc(KAM_MAX_TIME_PAIRS, sizeof(*stats));
+        assert(pairs != NULL && stats != NULL);
+    }
+
+    for (done = 0; done < num; done += batch) {
+        batch = num - done < KAM_MAX_TIME_PAIRS ? num - done : KAM_MAX_TIME_PAIRS;
+
+        for (k = 0; k < batch; k++) {
+            pairs[k].a = a - kam_virt_start;
+            pairs[k].b = b[done + k] - kam_virt_start;
+        }
+
+        req.vaddr = kam_virt_start;
+        req.pairs = (uintptr_t)pairs;
+        req.stats = (uintptr_t)stats;
+        req.threshold = threshold >= (double)LONG_MAX ? 0 : (uint64_t)threshold;
+        req.num_pairs = batch;
+        req.samples = outer_loop;
+        req.inner = inner_loop;
+        req.burst = KERNEL_TIMING_BURST;
+
+        PHASE_BEGIN(PHASE_SAMPLING);
+        PERF_START();
+        ret = kam_time_pairs_ioctl(&req);
+        PERF_STOP();
+        PHASE_END(PHASE_SAMPLING);
+
+        if (ret < 0) {
+            eprint("In-kernel pair timing failed: %s\n", strerror(errno));
+            for (k = 0; k < batch; k++)
+                avgs[done + k] = PAIR_DEFERRED;
+            continue;
+        }
+
+        for (k = 0; k < batch; k++) {
+            struct kam_pair_stat *st = &stats[k];
+
+            sched_stats.pairs++;
+            sched_stats.samples += st->samples;
+            sched_stats.samples_rejected += st->rejected;
+            account_window(st->samples, st->rejected);
+
+            if (st->samples < (uint32_t)outer_loop) {
+                sched_stats.pairs_deferred++;
+                avgs[done + k] = PAIR_DEFERRED;
+                continue;
+            }
+
+            avgs[done + k] = (st->sum * 1.0f) / outer_loop;
+            dprintf("Avg Ticks: %0.3f,\tMax Ticks: %llu,\tMin Ticks: %llu,\tRejected: %u\n",
+                    avgs[done + k], (unsigned long long)st->max,
+                    (unsigned long long)st->min, st->rejected);
+        }
+    }
+}
+#endif /* KERNEL_PAIR_TIMING == 1 */
+
+// Returns the avg time, PAIR_DEFERRED if there was too much interference
+double find_read_time(void *_a, void *_b, double threshold)
+{
+    uint64_t a = (uint64_t)(uintptr_t)_a;
+    uint64_t b = (uint64_t)(uintptr_t)_b;
+    uint64_t val_a = measure_kernel->chase ? b : 0;
+    uint64_t val_b = measure_kernel->chase ? a : 0;
+    int i;
+    uint64_t ticks;
+    uint64_t min_ticks, max_ticks, sum_ticks;
+    uint64_t rejects, window, window_rejects;
+    double avg_ticks;
+
+    assert((uintptr_t)(a) == (uintptr_t)(_a));
+    assert((uintptr_t)(b) == (uintptr_t)(_b));
+
+#if (KERNEL_PAIR_TIMING == 1)
+    if (kernel_pair_timing) {
+        kernel_time_pairs(a, (uintptr_t *)&b, 1, threshold, &avg_ticks);
+        return avg_ticks;
+    }
+#endif
+
+    PHASE_BEGIN(PHASE_SAMPLING);
+    PERF_START();
+
+    *(uint64_t *)(_a) = val_a;
+    *(uint64_t *)(_b) = val_b;
+    for (i = 0, sum_ticks = 0, min_ticks = LONG_MAX, max_ticks = 0,
+            rejects = 0, window = 0, window_rejects = 0;
+            i < outer_loop; i++) {
+        
+#if (SIMULATED_TIMING == 1)
+        ticks = time_pair_simulated(a, b, inner_loop);
+#else
+        ticks = measure_kernel->time_pair(a, b, inner_loop);
+#endif
+
+        assert(ticks > 0);
+        assert(*(uint64_t *)_a == val_a);
+        assert(*(uint64_t *)_b == val_b);
+
+        if (++window == NOISE_WINDOW) {
+            if (window_rejects * 100 > NOISE_WINDOW_REJECT_PERCENTAGE * NOISE_WINDOW)
+                break;
+            window = 0;
+            window_rejects = 0;
+        }
+
+        /* As there are timer interrupts, we reject outliers based on threshold */
+        if ((double)(ticks) > threshold) {
+            rejects++;
+            window_rejects++;
+            if (rejects * 100 > (uint64_t)outer_loop * MAX_REJECT_PERCENTAGE)
+                break;
+            i--;
+            continue;
+        }
+        min_ticks = ticks < min_ticks ? ticks : min_ticks;
+        max_ticks = ticks > max_ticks ? ticks : max_ticks;
+        sum_ticks += ticks;
+    }
+
+    PERF_STOP();
+    PHASE_END(PHASE_SAMPLING);
+
+    sched_stats.pairs++;
+    sched_stats.samples += i;
+    sched_stats.samples_rejected += rejects;
+    account_window(i, rejects);
+
+    if (i < outer_loop) {
+        dprintf("Deferring pair: %d samples, %ld rejected\n", i, rejects);
+        sched_stats.pairs_deferred++;
+        return PAIR_DEFERRED;
+    }
+
+    avg_ticks = (sum_ticks * 1.0f) / outer_loop;
+    dprintf("Avg Ticks: %0.3f,\tMax Ticks: %ld,\tMin Ticks: %ld,\tRejected: %ld\n",
+            avg_ticks, max_ticks, min_ticks, rejects);
+    return avg_ticks;
+}
+
+/* Remeasures the deferred pairs of entry i in queue, backing off before
+ * every attempt. Measured pairs are added to avgs and sum. Returns the number
+ * of pairs given up on (their avgs are set to 0, i.e. non-outliers)
+ */
+int retry_pairs(int i, int *queue, int num_queued, double threshold,
+                    double *avgs, double *sum)
+{
+    int attempt, k, remaining;
+
+    for (attempt = 1; attempt <= MAX_PAIR_RETRIES && num_queued > 0; attempt++) {
+        usleep(RETRY_BACKOFF_US * attempt);
+
+        for (k = 0, remaining = 0; k < num_queued; k++) {
+            int j = queue[k];
+
+            sched_stats.pair_retries++;
+            avgs[j] = find_read_time((void *)entries[i].virt_addr,
+                                    (void *)entries[j].virt_addr, threshold);
+            if (avgs[j] == PAIR_DEFERRED) {
+                queue[remaining++] = j;
+                continue;
+            }
+            *sum += avgs[j];
+        }
+        num_queued = remaining;
+    }
+
+    for (k = 0; k < num_queued; k++) {
+        int j = queue[k];
+        eprint("Giving up on pair: PhyAddr1: 0x%lx, PhyAddr2: 0x%lx\n",
+                entries[i].phy_addr, entries[j].phy_addr);
+        avgs[j] = 0;
+        sched_stats.pairs_given_up++;
+    }
+
+    return num_queued;
+}
+
+// Like find_read_time() but retries deferred pair right away. Returns 0 if
+// the pair couldn't be measured
+double measure_pair(void *a, void *b, double threshold)
+{
+    double avg = PAIR_DEFERRED;
+    int attempt;
+
+    for (attempt = 0; attempt <= MAX_PAIR_RETRIES && avg == PAIR_DEFERRED;
+            attempt++) {
+        if (attempt != 0) {
+            sched_stats.pair_retries++;
+            usleep(RETRY_BACKOFF_US * attempt);
+        }
+        avg = find_read_time(a, b, threshold);
+    }
+
+    if (avg == PAIR_DEFERRED) {
+        sched_stats.pairs_given_up++;
+        return 0;
+    }
+
+    return avg;
+}
+
+void print_sched_stats(void)
+{
+    struct sched_stats *st = &sched_stats;
+
+    printf("Pairs measured: %ld, Deferred: %ld, Retries: %ld, Given up: %ld\n",
+            st->pairs, st->pairs_deferred, st->pair_retries, st->pairs_given_up);
+    printf("Samples: %ld, Rejected: %ld (%0.3f%%)\n", st->samples,
+            st->samples_rejected,
+            (st->samples_rejected * 100.0) / (st->samples + st->samples_rejected + 1));
+    printf("Time windows: %ld, Noisy: %ld, Max reject rate: %0.3f%%\n",
+            st->windows, st->windows_noisy, st->max_window_reject_rate);
+}
+
+#if (REALTIME_MEASUREMENT == 1)
+// Moves the process to highest SCHED_FIFO priority and locks all its memory
+int enter_realtime(void)
+{
+    struct sched_param param;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        eprint("Couldn't lock memory: %s\n", strerror(errno));
+        return -1;
+    }
+
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        eprint("Couldn't set SCHED_FIFO: %s\n", strerror(errno));
+        return -1;
+    }
+
+    dprintf("Running at SCHED_FIFO priority %d\n", param.sched_priority);
+    return 0;
+}
+#endif
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Entries the first entry is timed against during calibration
+int calibration_entry(int i)
+{
+    return 1 + (i * (NUM_ENTRIES - 1)) / CALIBRATION_ENTRIES;
+}
+
+// Times the first entry against the calibration entries with fewer samples
+void sample_first_entry(double *avgs)
+{
+    uintptr_t a = entries[0].virt_addr;
+    int saved_outer_loop = outer_loop;
+    double threshold;
+    int i;
+
+    outer_loop = CALIBRATION_OUTER_LOOP;
+
+    // Warm up - Get refined threshold
+    threshold = find_read_time((void *)a, (void *)(a + sizeof(uint64_t)), LONG_MAX);
+    threshold *= threshold_multiplier;
+
+    for (i = 0; i < CALIBRATION_ENTRIES; i++) {
+        avgs[i] = measure_pair((void *)a,
+                        (void *)entries[calibration_entry(i)].virt_addr, threshold);
+    }
+    outer_loop = saved_outer_loop;
+}
+
+#if (MEASURE_KERNEL == -1)
+/* Times the first entry against entries spread across the region with the
+ * current kernel. The median is taken as non-conflict latency and the max as
+ * conflict latency. Returns the gap between them relative to the spread of
+ * non-conflict latencies (0 if no conflict was seen)
+ */
+static double calibrate_measure_kernel(void)
+{
+    double avgs[CALIBRATION_ENTRIES], sorted[CALIBRATION_ENTRIES];
+    double median, conflict, outlier, mean, var;
+    int i, n;
+
+    sample_first_entry(avgs);
+
+    memcpy(sorted, avgs, sizeof(avgs));
+    qsort(sorted, CALIBRATION_ENTRIES, sizeof(double), compare_double);
+    median = sorted[CALIBRATION_ENTRIES / 2];
+    conflict = sorted[CALIBRATION_ENTRIES - 1];
+    outlier = (median * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+
+    if (conflict < outlier)
+        return 0;
+
+    for (i = 0, n = 0, mean = 0; i < CALIBRATION_ENTRIES; i++) {
+        if (avgs[i] < outlier) {
+            mean += avgs[i];
+            n++;
+        }
+    }
+    mean /= n;
+
+    for (i = 0, var = 0; i < CALIBRATION_ENTRIES; i++) {
+        if (avgs[i] < outlier)
+            var += (avgs[i] - mean) * (avgs[i] - mean);
+    }
+    var /= n;
+
+    dprintf("Kernel: %s, Non-conflict: %0.3f, Conflict: %0.3f, Stddev: %0.3f\n",
+            measure_kernel->name, median, conflict, sqrt(var));
+
+    return (conflict - median) / (sqrt(var) + 1.0);
+}
+#endif /* MEASURE_KERNEL == -1 */
+
+// Selects the kernel used by find_read_time(). Needs entries to be initialized
+int select_measure_kernel(void)
+{
+    if (kernel_pair_timing) {
+        // kam.c times pairs with the clflush kernel
+        measure_kernel = &measure_kernels[0];
+        printf("Using measurement kernel: %s (in kernel)\n", measure_kernel->name);
+        return 0;
+    }
+
+#if (MEASURE_KERNEL == -1)
+    measure_kernel_t *best = NULL;
+    double score, best_score = -1;
+    size_t i;
+
+    for (i = 0; i < NUM_MEASURE_KERNELS; i++) {
+        measure_kernel = &measure_kernels[i];
+        if (!measure_kernel->supported()) {
+            dprintf("Kernel: %s not supported\n", measure_kernel->name);
+            continue;
+        }
+
+        score = calibrate_measure_kernel();
+        printf("Kernel: %s, Score: %0.3f\n", measure_kernel->name, score);
+        if (score > best_score) {
+            best_score = score;
+            best = measure_kernel;
+        }
+    }
+
+    if (best == NULL) {
+        eprint("No measurement kernel supported\n");
+        return -1;
+    }
+
+    measure_kernel = best;
+#else
+    assert(MEASURE_KERNEL < NUM_MEASURE_KERNELS);
+    measure_kernel = &measure_kernels[MEASURE_KERNEL];
+    if (!measure_kernel->supported()) {
+        eprint("Kernel: %s not supported by CPU\n", measure_kernel->name);
+        return -1;
+    }
+#endif
+
+    printf("Using measurement kernel: %s\n", measure_kernel->name);
+    return 0;
+}
+
+// Finds TSC frequency against the monotonic clock
+void calibrate_tsc(void)
+{
+    struct timespec start, end;
+    uint64_t start_ticks, end_ticks;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_ticks = currentTicks();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    } while (ns < 100 * 1000 * 1000);
+    end_ticks = currentTicks();
+
+    tsc_per_ns = (end_ticks - start_ticks) / ns;
+    dprintf("TSC: %0.3f ticks/ns\n", tsc_per_ns);
+}
+
+#if (AUTO_TUNE_SAMPLING == 1)
+typedef struct sampling {
+    int inner_loop;
+    int outer_loop;
+} sampling_t;
+
+static int compare_sampling_cost(const void *a, const void *b)
+{
+    const sampling_t *x = a, *y = b;
+    long cx = (long)x->inner_loop * x->outer_loop;
+    long cy = (long)y->inner_loop * y->outer_loop;
+    return (cx > cy) - (cx < cy);
+}
+
+/* Picks the cheapest inner_loop/outer_loop for which the known conflict pair
+ * and non-conflict pair are classified correctly (same rule as run_exp()) in
+ * all but TUNE_TARGET_ERROR_PERCENTAGE of the repetitions.
+ * threshold_multiplier is picked so that the threshold stays above the
+ * conflict latency, so only interrupted samples get rejected.
+ */
+void tune_sampling(void)
+{
+    static const int inners[] = { 1, 2, 5, 10 };
+    static const int outers[] = { 100, 300, 1000, 3000, 10000, 30000, 100000 };
+    static const double multipliers[] = { 2, 3, 5, 8 };
+    sampling_t candidates[sizeof(inners) / sizeof(inners[0]) *
+                            sizeof(outers) / sizeof(outers[0])];
+    int num_candidates = sizeof(candidates) / sizeof(candidates[0]);
+    double avgs[CALIBRATION_ENTRIES], sorted[CALIBRATION_ENTRIES];
+    double base, conflict, nonconflict, outlier, threshold, multiplier;
+    double pair_ns, total_s, avg;
+    uintptr_t a = entries[0].virt_addr;
+    uintptr_t conflict_b = 0, nonconflict_b = 0;
+    uint64_t start_ticks, end_ticks;
+    int i, j, r, errors;
+    size_t k;
+
+    sample_first_entry(avgs);
+    memcpy(sorted, avgs, sizeof(avgs));
+    qsort(sorted, CALIBRATION_ENTRIES, sizeof(double), compare_double);
+    outlier = (sorted[CALIBRATION_ENTRIES / 2] * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+    if (sorted[CALIBRATION_ENTRIES - 1] < outlier) {
+        eprint("No conflicting pair found for tuning, using default sampling\n");
+        return;
+    }
+
+    for (i = 0; i < CALIBRATION_ENTRIES; i++) {
+        uintptr_t b = entries[calibration_entry(i)].virt_addr;
+        if (avgs[i] == sorted[CALIBRATION_ENTRIES - 1])
+            conflict_b = b;
+        if (avgs[i] == sorted[CALIBRATION_ENTRIES / 2])
+            nonconflict_b = b;
+    }
+    assert(conflict_b != 0 && nonconflict_b != 0);
+
+    for (i = 0, k = 0; i < sizeof(inners) / sizeof(inners[0]); i++) {
+        for (j = 0; j < sizeof(outers) / sizeof(outers[0]); j++, k++) {
+            candidates[k].inner_loop = inners[i];
+            candidates[k].outer_loop = outers[j];
+        }
+    }
+    qsort(candidates, num_candidates, sizeof(sampling_t), compare_sampling_cost);
+
+    for (i = 0; i < num_candidates; i++) {
+        inner_loop = candidates[i].inner_loop;
+
+        // References for this inner loop with calibration sampling
+        outer_loop = CALIBRATION_OUTER_LOOP;
+        base = find_read_time((void *)a, (void *)(a + sizeof(uint64_t)), LONG_MAX);
+        threshold = base * multipliers[sizeof(multipliers) / sizeof(multipliers[0]) - 1];
+        conflict = measure_pair((void *)a, (void *)conflict_b, threshold);
+        nonconflict = measure_pair((void *)a, (void *)nonconflict_b, threshold);
+
+        for (k = 0; k < sizeof(multipliers) / sizeof(multipliers[0]); k++) {
+            multiplier = multipliers[k];
+            if (base * multiplier >= 2 * conflict)
+                break;
+        }
+        threshold = base * multiplier;
+        outlier = (nonconflict * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+
+        outer_loop = candidates[i].outer_loop;
+        start_ticks = currentTicks();
+        for (r = 0, errors = 0; r < TUNE_REPETITIONS; r++) {
+            // Deferred measurements count as errors too
+            if (find_read_time((void *)a, (void *)conflict_b, threshold) < outlier)
+                errors++;
+            avg = find_read_time((void *)a, (void *)nonconflict_b, threshold);
+            if (avg >= outlier || avg == PAIR_DEFERRED)
+                errors++;
+        }
+        end_ticks = currentTicks();
+
+        dprintf("Tuning: Inner: %d, Outer: %d, Multiplier: %0.1f, Errors: %d/%d\n",
+                inner_loop, outer_loop, multiplier, errors, 2 * TUNE_REPETITIONS);
+
+        if (errors * 100 <= TUNE_TARGET_ERROR_PERCENTAGE * 2 * TUNE_REPETITIONS)
+            break;
+    }
+
+    if (i == num_candidates) {
+        eprint("No sampling reached target error rate, using the largest\n");
+        i = num_candidates - 1;
+        inner_loop = candidates[i].inner_loop;
+        outer_loop = candidates[i].outer_loop;
+    }
+    threshold_multiplier = multiplier;
+
+    // run_exp() measures each master against every later entry: At most N^2/2
+    pair_ns = (end_ticks - start_ticks) / tsc_per_ns / (2 * TUNE_REPETITIONS);
+    total_s = pair_ns * ((double)NUM_ENTRIES * (NUM_ENTRIES - 1) / 2) / 1e9;
+
+    printf("Sampling: Inner loop: %d, Outer loop: %d, Threshold multiplier: %0.1f\n",
+            inner_loop, outer_loop, threshold_multiplier);
+    printf("Expected time: %0.3f ms per pair, at most %0.1f s for %d entries\n",
+            pair_ns / 1e6, total_s, NUM_ENTRIES);
+}
+#endif /* AUTO_TUNE_SAMPLING == 1 */
+
+uintptr_t get_physical_addr(uintptr_t virtual_addr) {
+    
+    uint64_t frame_num;
+    int ret;
+    uint64_t value;
+    off_t pos;
+    int fd;
+
+    PHASE_BEGIN(PHASE_PAGEMAP);
+    INSTR_COUNT(pagemap_reads);
+
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    assert(fd >= 0);
+    
+    pos = lseek(fd, (virtual_addr / PAGE_SIZE) * 8, SEEK_SET);
+    assert(pos >= 0);
+    
+    ret = read(fd, &value, 8);
+    assert(ret == 8);
+    
+    ret = close(fd);
+    assert(ret == 0);
+
+    PHASE_END(PHASE_PAGEMAP);
+    
+    frame_num = value & ((1ULL << 54) - 1);
+    return (frame_num * PAGE_SIZE) | (virtual_addr & PAGE_MASK);
+}
+
+/* Searches if from start to start + length - 1 has at any point contigous pages
+ * which are contigous. If so, returns the start address of them
+ */
+void *is_contiguous(void *_start, size_t length, int contigous_pages)
+{
+    uintptr_t start = (uintptr_t)_start;
+    uintptr_t end = start + length - 1;
+    uintptr_t current;
+    uintptr_t prev_phy_addr;
+    int found = 1;
+
+    assert((start & PAGE_MASK) == 0);
+    assert((length & PAGE_MASK) == 0);
+    assert((start + length) > start);
+
+    PHASE_BEGIN(PHASE_CONTIGUITY_SCAN);
+
+    for(current = start + PAGE_SIZE, prev_phy_addr = get_physical_addr(start);
+            current <= end && found < contigous_pages;
+            current += PAGE_SIZE) {
+        
+        uintptr_t cur_phy_addr = get_physical_addr(current);
+        if (cur_phy_addr == (prev_phy_addr + PAGE_SIZE)) {
+                found++;
+        } else {
+            start = current;
+            found = 1;
+        }
+
+        prev_phy_addr = cur_phy_addr;
+    } 
+
+    PHASE_END(PHASE_CONTIGUITY_SCAN);
+
+    if (found >= contigous_pages) {
+       
+        dprintf("Found contiguous pages\n");
+        for (int i = 0; i < found; i++) {
+            dprintf("Virt:0x%lx, Phy:0x%lx\n", start + i * PAGE_SIZE,
+                    get_physical_addr(start + i * PAGE_SIZE));
+        }
+        return (void *)start;
+    }
+
+    return NULL;
+}
+
+#if (KERNEL_ALLOCATOR_MODULE==1)
+// Reads the PFN of every page of mapping into region_pfns. Older modules only
+// support KAM_IOCTL_PHY_START, for which -1 is returned
+static int read_region_pfns(int fd, void *virt_start, size_t len)
+{
+    struct kam_pfn_list req;
+    size_t num_pages = len / PAGE_SIZE;
+
+    region_pfns = malloc(num_pages * sizeof(uint64_t));
+    if (region_pfns == NULL)
+        return -1;
+
+    req.vaddr = (uintptr_t)virt_start;
+    req.max_pfns = num_pages;
+    req.pfns = (uintptr_t)region_pfns;
+    if (ioctl(fd, KAM_IOCTL_PFN_LIST, &req) < 0 || req.num_pfns != num_pages) {
+        free(region_pfns);
+        region_pfns = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+#if (KERNEL_PAIR_TIMING == 1)
+/* Modules without KAM_IOCTL_TIME_PAIRS (or not on x86) fail it with ENOSYS
+ * or ENOTTY, while the empty request is rejected with EINVAL
+ */
+static void kam_probe_pair_timing(void)
+{
+    struct kam_time_pairs req = {0};
+
+    if (ioctl(kam_fd, KAM_IOCTL_TIME_PAIRS, &req) < 0 && errno == EINVAL) {
+        kernel_pair_timing = 1;
+        return;
+    }
+
+    printf("Module can't time pairs (%s), timing them in userspace\n", strerror(errno));
+    outer_loop = MAX_OUTER_LOOP;
+}
+#endif
+
+void *mmap_contiguous(size_t len, uint64_t *phy_start_addr)
+{
+    void *ret;
+    int iret;
+    int fd = open(KERNEL_ALLOCATOR_MODULE_FILE, O_RDWR);
+    if (fd < 0) {
+        eprint("Couldn't open %s, is kam.ko loaded? (SIMULATED_TIMING runs without it)\n",
+                KERNEL_ALLOCATOR_MODULE_FILE);
+        return NULL;
+    }
+
+    ret = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+
+    /* We don't close the file. We let it close when exit */
+    if (ret == MAP_FAILED) {
+        eprint("Couldn't allocate memory from device\n");
+        return MAP_FAILED;
+    }
+
+    /*
+     * Module maps raw PFNs, which /proc/self/pagemap doesn't report.
+     * Physical layout comes from the module instead
+     */
+    if (read_region_pfns(fd, ret, len) == 0) {
+        *phy_start_addr = region_pfns[0] << PAGE_SHIFT;
+    } else {
+        // Get the physcal address of start address
+        iret = ioctl(fd, KAM_IOCTL_PHY_START, phy_start_addr);
+        if (iret < 0) {
+            eprint("Couldn't find the physical address of start\n");
+            return MAP_FAILED;
+        }
+    }
+
+    kam_fd = fd;
+    kam_virt_start = (uintptr_t)ret;
+
+#if (KERNEL_PAIR_TIMING == 1)
+    kam_probe_pair_timing();
+#endif
+
+    dprintf("Device allocate: Virt Addr: %p, Phy Addr: %p, Len: 0x%lx, PFN list: %d\n",
+            ret, (void *)*phy_start_addr, len, region_pfns != NULL);
+
+    return ret;
+}
+#endif // KERNEL_ALLOCATOR_MODULE==1
+
+#if (NUMA_MODE == 1)
+// Returns the last cpu in a sysfs cpulist (e.g. "0-7,16-23"), -1 if empty
+static int last_cpu_in_list(const char *list)
+{
+    const char *p = list;
+    char *end;
+    int cpu = -1;
+
+    while (*p != '\0' && *p != '\n') {
+        cpu = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            cpu = strtol(p, &end, 10);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return cpu;
+}
+
+// Fills the core to use for every node (-1 if node not present). Returns the
+// number of nodes
+static int find_numa_nodes(int *cpus)
+{
+    char fname[100];
+    char list[1024];
+    int node, num_nodes = 0;
+    FILE *fp;
+
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        cpus[node] = -1;
+
+        sprintf(fname, NUMA_SYSFS_DIR "/node%d/cpulist", node);
+        fp = fopen(fname, "r");
+        if (fp == NULL)
+            continue;
+
+        if (fgets(list, sizeof(list), fp) != NULL)
+            cpus[node] = last_cpu_in_list(list);
+        fclose(fp);
+
+        if (cpus[node] < 0) {
+            dprintf("Node %d has no cpus, skipping it\n", node);
+            continue;
+        }
+
+        dprintf("Node %d: Core %d\n", node, cpus[node]);
+        num_nodes++;
+    }
+
+    return num_nodes;
+}
+
+#if (KERNEL_HUGEPAGE_ENABLED == 1)
+// Checks if the node's hugepage pool can back MEM_SIZE
+static bool node_has_hugepages(int node)
+{
+    char fname[200];
+    long free_pages = 0;
+    FILE *fp;
+
+    sprintf(fname, NUMA_SYSFS_DIR "/node%d/hugepages/hugepages-%dkB/free_hugepages",
+            node, KERNEL_HUGEPAGE_SIZE / 1024);
+    fp = fopen(fname, "r");
+    if (fp == NULL)
+        return false;
+
+    if (fscanf(fp, "%ld", &free_pages) != 1)
+        free_pages = 0;
+    fclose(fp);
+
+    dprintf("Node %d: Free hugepages: %ld\n", node, free_pages);
+    return free_pages * KERNEL_HUGEPAGE_SIZE >= MEM_SIZE;
+}
+#endif
+
+// Binds the (not yet faulted) memory to the node
+static int bind_to_node(void *addr, size_t len, int node)
+{
+    unsigned long nodemask = 1UL << node;
+    long ret;
+
+    ret = syscall(SYS_mbind, addr, len, MPOL_BIND, &nodemask,
+                    sizeof(nodemask) * 8, MPOL_MF_STRICT);
+    if (ret < 0) {
+        eprint("Couldn't bind memory to node %d: %s\n", node, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+#endif /* NUMA_MODE == 1 */
+
+#if (SCATTER_MODE == 1)
+// Reads the PFN of every page of the pool from pagemap in one go
+static int read_pool_pfns(void *pool, size_t num_pages, uint64_t *pfns)
+{
+#if (SIMULATED_TIMING == 1)
+    size_t i;
+
+    sim_pfns = malloc(num_pages * sizeof(uint64_t));
+    if (sim_pfns == NULL)
+        return -1;
+    for (i = 0; i < num_pages; i++)
+        sim_pfns[i] = sim_rand() % (SIMULATED_SCATTER_MEM_SIZE / PAGE_SIZE);
+    sim_virt_start = (uintptr_t)pool;
+    memcpy(pfns, sim_pfns, num_pages * sizeof(uint64_t));
+    return 0;
+#else
+    size_t len = num_pages * sizeof(uint64_t), done;
+    off_t pos = ((uintptr_t)pool / PAGE_SIZE) * sizeof(uint64_t);
+    ssize_t ret;
+    size_t i;
+    int fd;
+
+    PHASE_BEGIN(PHASE_PAGEMAP);
+    INSTR_COUNT(pagemap_reads);
+
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+        PHASE_END(PHASE_PAGEMAP);
+        return -1;
+    }
+
+    for (done = 0; done < len; done += ret) {
+        ret = pread(fd, (char *)pfns + done, len - done, pos + done);
+        if (ret <= 0)
+            break;
+    }
+    close(fd);
+
+    PHASE_END(PHASE_PAGEMAP);
+
+    if (done != len)
+        return -1;
+
+    for (i = 0; i < num_pages; i++) {
+        // Not present, or PFNs hidden from non root users
+        if (!(pfns[i] >> 63) || (pfns[i] & ((1ULL << 54) - 1)) == 0)
+            return -1;
+        pfns[i] &= (1ULL << 54) - 1;
+    }
+
+    return 0;
+#endif
+}
+
+static const uint64_t *pool_sort_pfns;
+
+static int compare_pool_pages(const void *a, const void *b)
+{
+    uint64_t pa = pool_sort_pfns[*(const size_t *)a];
+    uint64_t pb = pool_sort_pfns[*(const size_t *)b];
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+static void add_varying_bits(size_t *counts, uint64_t bits, int delta)
+{
+    int bit;
+
+    for (bit = 0; bit < 64; bit++)
+        counts[bit] += ((bits >> bit) & 1) * delta;
+}
+
+/* Picks num_selected pool pages evenly spaced in physical order, then swaps in
+ * pool pages for any bit up to top_bit that doesn't vary yet. Returns the
+ * bits that don't vary
+ */
+static uint64_t select_scatter_pages(const uint64_t *pfns, size_t num_pool,
+                                        size_t *selected, size_t num_selected,
+                                        int top_bit)
+{
+    uint64_t wanted = ((2ULL << top_bit) - 1) & ~(uint64_t)PAGE_MASK;
+    uint64_t varying, lost, old = 0, with = 0;
+    size_t *order = malloc(num_pool * sizeof(size_t));
+    bool *in_region = calloc(num_pool, sizeof(bool));
+    size_t counts[64] = {0};    // Selected pages differing from selected[0] in bit
+    size_t i, p, slot;
+    int bit, k;
+
+    assert(order != NULL && in_region != NULL);
+    for (i = 0; i < num_pool; i++)
+        order[i] = i;
+    pool_sort_pfns = pfns;
+    qsort(order, num_pool, sizeof(size_t), compare_pool_pages);
+
+    for (i = 0; i < num_selected; i++)
+        selected[i] = order[(i * num_pool) / num_selected];
+    free(order);
+
+    for (i = 0; i < num_selected; i++) {
+        add_varying_bits(counts, (pfns[selected[i]] ^ pfns[selected[0]]) << PAGE_SHIFT, 1);
+        in_region[selected[i]] = true;
+    }
+
+    /* A missing bit is brought in by a pool page not yet in the region, in
+     * place of a page (tried from the end, selected[0] is the reference) whose
+     * bits vary in other pages too, or in the new one
+     */
+    for (bit = PAGE_SHIFT; bit <= top_bit; bit++) {
+        if (counts[bit] != 0)
+            continue;
+
+        for (slot = num_selected - 1; slot > 0; slot--) {
+            old = (pfns[selected[slot]] ^ pfns[selected[0]]) << PAGE_SHIFT;
+            for (k = PAGE_SHIFT, lost = 0; k <= top_bit; k++)
+                lost |= counts[k] == 1 ? old & ADDR_BIT(k) : 0;
+
+            for (p = 0; p < num_pool; p++) {
+                with = (pfns[p] ^ pfns[selected[0]]) << PAGE_SHIFT;
+                if (!in_region[p] && ((with >> bit) & 1) && (with & lost) == lost)
+                    break;
+            }
+            if (p < num_pool)
+                break;
+        }
+        if (slot == 0)
+            continue;
+
+        add_varying_bits(counts, old, -1);
+        add_varying_bits(counts, with, 1);
+        in_region[selected[slot]] = false;
+        in_region[p] = true;
+        selected[slot] = p;
+        dprintf("Bit %d: Using pool page with PFN 0x%lx\n", bit, pfns[p]);
+    }
+
+    for (bit = PAGE_SHIFT, varying = 0; bit <= top_bit; bit++)
+        varying |= counts[bit] != 0 ? ADDR_BIT(bit) : 0;
+    free(in_region);
+    return wanted & ~varying;
+}
+
+/* Allocates the pool and makes the region of contiguous_pages pages out of it.
+ * The pool stays allocated, so that its pages are not reused
+ */
+static void *allocate_scatter(int contiguous_pages, uintptr_t *phy_start)
+{
+    size_t num_pool = SCATTER_POOL_SIZE / PAGE_SIZE, *selected;
+    uint64_t *pfns, max_pfn, missing;
+    long phys_pages = sysconf(_SC_PHYS_PAGES);
+    void *pool;
+    size_t i;
+    int top_bit;
+
+    if ((size_t)contiguous_pages > num_pool) {
+        eprint("Scatter pool is smaller than the region\n");
+        return NULL;
+    }
+
+#if (SIMULATED_TIMING == 1)
+    // Never touched, fake PFNs are used instead
+    pool = aligned_alloc(PAGE_SIZE, SCATTER_POOL_SIZE);
+    if (pool == NULL) {
+        eprint("Memory allocation failed\n");
+        return NULL;
+    }
+    phys_pages = SIMULATED_SCATTER_MEM_SIZE / PAGE_SIZE;
+#else
+    pool = mmap(NULL, SCATTER_POOL_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        eprint("Memory allocation failed\n");
+        return NULL;
+    }
+
+    // Transparent hugepages would make runs of 512 contiguous PFNs
+    madvise(pool, SCATTER_POOL_SIZE, MADV_NOHUGEPAGE);
+#if (NUMA_MODE == 1)
+    if (bind_to_node(pool, SCATTER_POOL_SIZE, numa_node) < 0) {
+        assert(munmap(pool, SCATTER_POOL_SIZE) == 0);
+        return NULL;
+    }
+#endif
+    if (mlock(pool, SCATTER_POOL_SIZE) != 0) {
+        eprint("Couldn't lock scatter pool: %s\n", strerror(errno));
+        assert(munmap(pool, SCATTER_POOL_SIZE) == 0);
+        return NULL;
+    }
+#endif
+
+    pfns = malloc(num_pool * sizeof(uint64_t));
+    selected = malloc(contiguous_pages * sizeof(size_t));
+    region_pages = malloc(contiguous_pages * sizeof(uintptr_t));
+    region_pfns = malloc(contiguous_pages * sizeof(uint64_t));
+    assert(pfns != NULL && selected != NULL && region_pages != NULL &&
+            region_pfns != NULL);
+
+    if (read_pool_pfns(pool, num_pool, pfns) < 0) {
+        eprint("Couldn't read PFNs of scatter pool from pagemap\n");
+        free(pfns);
+        free(selected);
+        free(region_pages);
+        free(region_pfns);
+        region_pages = NULL;
+        region_pfns = NULL;
+        return NULL;
+    }
+
+    for (i = 0, max_pfn = 0; i < num_pool; i++)
+        max_pfn = pfns[i] > max_pfn ? pfns[i] : max_pfn;
+    top_bit = 63 - __builtin_clzll((max_pfn << PAGE_SHIFT) | PAGE_MASK);
+
+    // Memory has holes, so its top is at least its size
+    if (top_bit < 63 - __builtin_clzll(((uint64_t)phys_pages << PAGE_SHIFT) - 1))
+        printf("Scatter pool reaches 0x%lx of 0x%lx bytes of memory, "
+                "increase SCATTER_POOL_SIZE for higher bits\n",
+                (max_pfn + 1) << PAGE_SHIFT, (uint64_t)phys_pages << PAGE_SHIFT);
+
+    missing = select_scatter_pages(pfns, num_pool, selected, contiguous_pages,
+                                    top_bit);
+    if (missing != 0)
+        eprint("Bits not varying in scatter region: 0x%lx\n", missing);
+
+    for (i = 0; i < (size_t)contiguous_pages; i++) {
+        region_pages[i] = (uintptr_t)pool + selected[i] * PAGE_SIZE;
+        region_pfns[i] = pfns[selected[i]];
+    }
+
+    printf("Scatter: Pool pages: %zu, Region pages: %d, Top bit: %d\n",
+            num_pool, contiguous_pages, top_bit);
+
+    free(pfns);
+    free(selected);
+
+    *phy_start = region_pfns[0] << PAGE_SHIFT;
+    return (void *)region_pages[0];
+}
+#endif /* SCATTER_MODE == 1 */
+
+/* Tries to allocate physical contigous pages and return the start address */
+#if (PERSISTENT_REGION == 1)
+// Layout of the persistent region and calibration on it, cached across runs
+typedef struct region_cache {
+    bool valid;                 // Read from PERSISTENT_CACHE_FILE and matching
+    uint64_t inode;             // Of PERSISTENT_FILE
+    uint64_t size;
+    uint64_t offset;            // Of the contiguous run in the mapping
+    uint64_t phy_start;         // Of the contiguous run
+    double tsc_per_ns;
+    char kernel[32];            // Name of the measurement kernel
+    int inner_loop;
+    int outer_loop;
+    double threshold_multiplier;
+    double threshold;           // Of run_exp(), 0 if not known
+} region_cache_t;
+
+region_cache_t region_cache;
+
+// Reads PERSISTENT_CACHE_FILE, valid if it is for the file st is of
+static void load_region_cache(const struct stat *st)
+{
+    region_cache_t c = { 0 };
+    FILE *fp = fopen(PERSISTENT_CACHE_FILE, "r");
+    int n;
+
+    if (fp == NULL)
+        return;
+
+    n = fscanf(fp, "Inode: %lu\nSize: %lu\nOffset: 0x%lx\nPhyStart: 0x%lx\n"
+                "TSC: %lf\nKernel: %31s\nInner: %d\nOuter: %d\nMultiplier: %lf\n"
+                "Threshold: %lf\n", &c.inode, &c.size, &c.offset, &c.phy_start,
+                &c.tsc_per_ns, c.kernel, &c.inner_loop, &c.outer_loop,
+                &c.threshold_multiplier, &c.threshold);
+    fclose(fp);
+
+    if (n != 10 || c.inode != st->st_ino || c.size != (uint64_t)st->st_size) {
+        printf("Region cache %s is stale\n", PERSISTENT_CACHE_FILE);
+        return;
+    }
+
+    c.valid = true;
+    region_cache = c;
+}
+
+static void write_region_cache(void)
+{
+    FILE *fp = fopen(PERSISTENT_CACHE_FILE, "w");
+
+    if (fp == NULL) {
+        eprint("Couldn't open %s: %s\n", PERSISTENT_CACHE_FILE, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "Inode: %lu\nSize: %lu\nOffset: 0x%lx\nPhyStart: 0x%lx\nTSC: %f\n"
+            "Kernel: %s\nInner: %d\nOuter: %d\nMultiplier: %f\nThreshold: %f\n",
+            region_cache.inode, region_cache.size, region_cache.offset,
+            region_cache.phy_start, tsc_per_ns, measure_kernel->name, inner_loop,
+            outer_loop, threshold_multiplier, region_cache.threshold);
+    fclose(fp);
+}
+
+/* Maps PERSISTENT_FILE, creating it or resizing it to len (which drops its
+ * pages) as needed, and loads the cache of it
+ */
+static void *map_persistent_region(size_t len)
+{
+    struct stat st;
+    void *ret;
+    int fd;
+
+    fd = open(PERSISTENT_FILE, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        eprint("Couldn't open %s: %s\n", PERSISTENT_FILE, strerror(errno));
+        return MAP_FAILED;
+    }
+
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size != len) {
+        dprintf("Resizing %s from 0x%lx to 0x%lx\n", PERSISTENT_FILE, st.st_size, len);
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, len) < 0)
+            st.st_size = -1;
+        else
+            fstat(fd, &st);
+    }
+    if ((size_t)st.st_size != len) {
+        eprint("Couldn't size %s: %s\n", PERSISTENT_FILE, strerror(errno));
+        close(fd);
+        return MAP_FAILED;
+    }
+
+    // Shared, as private writes would copy the pages
+    ret = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ret == MAP_FAILED)
+        return MAP_FAILED;
+
+    load_region_cache(&st);
+    region_cache.inode = st.st_ino;
+    region_cache.size = st.st_size;
+
+    return ret;
+}
+
+// Whether the contiguous run is still where the cache says: Every page of it
+// at the PFN following the previous one from phy_start, read from pagemap at
+// once instead of by get_physical_addr()
+static bool region_cache_matches(void *virt_start, int contiguous_pages)
+{
+    uintptr_t start = (uintptr_t)virt_start + region_cache.offset;
+    uint64_t *pfns, pfn = region_cache.phy_start >> PAGE_SHIFT;
+    size_t len = contiguous_pages * sizeof(uint64_t);
+    bool matches;
+    int fd, i;
+
+    if (!region_cache.valid)
+        return false;
+
+    pfns = malloc(len);
+    assert(pfns != NULL);
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    assert(fd >= 0);
+    matches = pread(fd, pfns, len, (start / PAGE_SIZE) * sizeof(uint64_t)) == (ssize_t)len;
+    close(fd);
+    for (i = 0; i < contiguous_pages && matches; i++)
+        matches = (pfns[i] & ((1ULL << 54) - 1)) == pfn + i;
+    free(pfns);
+
+    if (matches) {
+        printf("Region from cache: Offset: 0x%lx, Phy Addr: 0x%lx\n",
+                region_cache.offset, region_cache.phy_start);
+        return true;
+    }
+
+    printf("Region moved since %s was written\n", PERSISTENT_CACHE_FILE);
+    region_cache.valid = false;
+    return false;
+}
+
+// Calibration of a previous run on the region. Returns -1 if there is none
+static int restore_calibration(void)
+{
+    size_t i;
+
+    if (!region_cache.valid)
+        return -1;
+
+    for (i = 0; i < NUM_MEASURE_KERNELS; i++) {
+        if (strcmp(measure_kernels[i].name, region_cache.kernel) == 0)
+            break;
+    }
+    if (i == NUM_MEASURE_KERNELS || !measure_kernels[i].supported())
+        return -1;
+
+    measure_kernel = &measure_kernels[i];
+    tsc_per_ns = region_cache.tsc_per_ns;
+    inner_loop = region_cache.inner_loop;
+    outer_loop = region_cache.outer_loop;
+    threshold_multiplier = region_cache.threshold_multiplier;
+
+    printf("Calibration from %s: Kernel: %s, TSC: %0.3f ticks/ns, Inner loop: %d, "
+            "Outer loop: %d, Threshold multiplier: %0.1f\n", PERSISTENT_CACHE_FILE,
+            measure_kernel->name, tsc_per_ns, inner_loop, outer_loop,
+            threshold_multiplier);
+    return 0;
+}
+#endif /* PERSISTENT_REGION == 1 */
+
+void *allocate_contigous(int contiguous_pages, uintptr_t *phy_start) {
+    
+    int max_itr = MAX_MMAP_ITR;
+    int i;
+    size_t len = MEM_SIZE;
+
+    if (contiguous_pages * PAGE_SIZE > len) {
+        eprint("Number of contiguous pages requested is too large\n");
+        return NULL;
+    }
+
+#if (SCATTER_MODE == 1)
+    return allocate_scatter(contiguous_pages, phy_start);
+#endif
+
+#if (SIMULATED_TIMING == 1)
+    // Region is reused across calls
+    if (sim_virt_start == 0) {
+        sim_virt_start = (uintptr_t)aligned_alloc(KERNEL_HUGEPAGE_SIZE,
+                                            contiguous_pages * PAGE_SIZE);
+        if (sim_virt_start == 0) {
+            eprint("Memory allocation failed\n");
+            return NULL;
+        }
+        memset((void *)sim_virt_start, 0, contiguous_pages * PAGE_SIZE);
+    }
+    kam_virt_start = sim_virt_start;
+#if (KERNEL_PAIR_TIMING == 1)
+    kernel_pair_timing = 1;
+#endif
+    *phy_start = SIMULATED_PHY_START;
+    return (void *)sim_virt_start;
+#endif
+
+    for (i = 0; i < max_itr; i++) {
+#if (KERNEL_ALLOCATOR_MODULE == 1)
+        void *virt_start = mmap_contiguous(len, phy_start);
+#elif   (PERSISTENT_REGION == 1)
+        void *virt_start = map_persistent_region(len);
+#elif   (KERNEL_HUGEPAGE_ENABLED == 1)
+        void *virt_start = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                            -1, 0);
+#else
+        void *virt_start = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                           -1, 0);
+#endif
+        if(virt_start == MAP_FAILED || virt_start == NULL) {
+            eprint("Memory allocation failed\n");
+            return NULL;
+        }
+#if (NUMA_MODE == 1)
+        // Needs to be done before the pages are faulted in by mlock()
+        if (bind_to_node(virt_start, len, numa_node) < 0) {
+            assert(munmap(virt_start, len) == 0);
+            return NULL;
+        }
+#endif
+        assert(mlock(virt_start, len) == 0);
+
+#if (KERNEL_ALLOCATOR_MODULE == 1)
+        // Physical layout of kernel allocation is known from its PFN list
+        return virt_start;
+#endif
+#if (PERSISTENT_REGION == 1)
+        if (region_cache_matches(virt_start, contiguous_pages)) {
+            *phy_start = region_cache.phy_start;
+            return (char *)virt_start + region_cache.offset;
+        }
+#endif
         void *ret = is_contiguous(virt_start, len, contiguous_pages);
         if (ret != NULL) {
-            *phy_start = get_physical_addr((uintptr_t)virt_start);
+            // Of the run, which needn't start the mapping
+            *phy_start = get_physical_addr((uintptr_t)ret);
+#if (PERSISTENT_REGION == 1)
+            region_cache.offset = (uintptr_t)ret - (uintptr_t)virt_start;
+            region_cache.phy_start = *phy_start;
+#endif
             return ret;
         }
 
-        assert(munlock(virt_start, len) == 0);
-        assert(munmap(virt_start, len) == 0);
+        assert(munlock(virt_start, len) == 0);
+        assert(munmap(virt_start, len) == 0);
+    }
+
+    return NULL;
+}
+
+void print_binary(uint64_t v)
+{
+    char buffer[100];
+    int index;
+
+    buffer[99] = '\0';
+    for (index = 98; v > 0; index--) {
+        if (v & 1)
+            buffer[index] = '1';
+        else
+            buffer[index] = '0';
+
+        v = v >> 1;
+    }
+
+    printf("%s", &buffer[index + 1]);
+}
+
+// Times entry i against entries from first on (but itself) into avgs, summing
+// them in sum. Deferred pairs are queued in retry_queue, returns their number
+static int measure_row(int i, int first, double threshold, double *avgs,
+                        double *sum, int *retry_queue)
+{
+    int j, num_retry = 0;
+
+#if (KERNEL_PAIR_TIMING == 1)
+    static uintptr_t *others;
+
+    if (others == NULL) {
+        others = calloc(NUM_ENTRIES, sizeof(uintptr_t));
+        assert(others != NULL);
+    }
+
+    // Whole row in as few ioctls as possible, timing against itself is ignored
+    if (kernel_pair_timing) {
+        for (j = first; j < NUM_ENTRIES; j++)
+            others[j] = entries[j].virt_addr;
+        kernel_time_pairs(entries[i].virt_addr, &others[first], NUM_ENTRIES - first,
+                            threshold, &avgs[first]);
+    }
+#endif
+
+    for (j = first, *sum = 0; j < NUM_ENTRIES; j++) {
+        if (j == i) {
+            avgs[j] = 0;
+            continue;
+        }
+        if (!kernel_pair_timing) {
+            dprintf("Reading Time: PhyAddr1: 0x%lx,\t PhyAddr2:0x%lx\n",
+                    entries[i].phy_addr, entries[j].phy_addr);
+            avgs[j] = find_read_time((void *)entries[i].virt_addr,
+                                    (void *)entries[j].virt_addr, threshold);
+        }
+        if (avgs[j] == PAIR_DEFERRED) {
+            retry_queue[num_retry++] = j;
+            continue;
+        }
+        *sum += avgs[j];
+    }
+
+    return num_retry;
+}
+
+/* Makes the entries after master entry i whose avgs are outliers against
+ * running_avg its siblings, or i a sibling of the master they belong to if
+ * they are already associated (same bank, same row)
+ */
+static void associate_row(int i, const double *avgs, double running_avg)
+{
+    entry_t *entry = &entries[i];
+    double running_threshold, nearest_nonoutlier;
+    int j, k, num_outlier;
+
+    running_threshold = (running_avg * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+    entry->associated = false;
+    for (j = i + 1, num_outlier = 0, nearest_nonoutlier = 0;
+            j < NUM_ENTRIES; j++) {
+        if (avgs[j] >= running_threshold) {
+            if (entries[j].associated) {
+                /* Could be in the same bank and same row */
+                if (phy_to_bank_mapping(entry->phy_addr) ==
+                         phy_to_bank_mapping(entries[j].siblings[0]->phy_addr)) {
+                    entry_t *prior_entry = entries[j].siblings[0];
+                    int siblings = prior_entry->num_sibling;
+                    prior_entry->siblings[siblings] = entry;
+                    prior_entry->num_sibling++;
+                    entry->associated = true;
+                    entry->num_sibling = 1;
+                    entry->siblings[0] = prior_entry;
+                    
+                    printf("Assuming lie on same bank:0x%lx, 0x%lx\n",
+                            prior_entry->phy_addr, entry->phy_addr);
+                    break;
+                    
+                } else {
+                    eprint("Entry being mapped to multiple siblings\n");
+                    eprint("Entry: PhyAddr: 0x%lx,"
+                            " Prior Sibling: PhyAddr: 0x%lx,"
+                            " Current Sibling: PhyAddr: 0x%lx\n",
+                            entries[j].phy_addr, entries[j].siblings[0]->phy_addr,
+                            entry->phy_addr);
+                } 
+            } else {
+                entry->siblings[num_outlier] = &entries[j];
+                num_outlier++;
+                entries[j].associated = true;
+                entries[j].siblings[0] = entry;
+                entries[j].num_sibling = 1;
+            }   
+        } else {
+            nearest_nonoutlier = avgs[j] > nearest_nonoutlier ?
+                                avgs[j] : nearest_nonoutlier;
+        }
+    }
+
+    if (entry->associated == false) {
+        entry->num_sibling = num_outlier;
+            
+        // Lines of parallel workers don't interleave
+        flockfile(stdout);
+        for (k = 0; k < entry->num_sibling; k++) {
+            printf("Siblings: PhyAddr: 0x%lx\tPhyAddr: 0x%lx\t\t", entry->phy_addr, 
+                entry->siblings[k]->phy_addr);
+            print_binary(entry->siblings[k]->phy_addr);
+            printf("\n");
+        }
+        funlockfile(stdout);
+    }
+    
+    dprintf("Nearest Nonoutlier: %f, Avg: %f, Threshold: %f\n",
+            nearest_nonoutlier, running_avg, running_threshold);
+    dprintf("Found %d siblings\n", num_outlier);
+}
+
+#if (PARALLEL_MODE == 1)
+int read_mapping(FILE *fp, const uint64_t *key, bank_mapping_t *m);
+
+typedef struct parallel_channel {
+    int *members;               // Entries of the channel, in order
+    int num_members;
+    int control[2];             // Control pair, -1 if too few members
+    double control_avg;         // Of the control pair timed alone
+} parallel_channel_t;
+
+typedef struct parallel_worker {
+    pthread_t thread;
+    int cpu;
+    double threshold;
+    uint64_t interferences;     // Rows timed again alone
+    struct sched_stats stats;   // Of the worker, when it's done
+    bool ran;                   // False if its core couldn't be set up
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+    uint64_t prefetch_flag;     // MSR of the core before the worker
+#endif
+} parallel_worker_t;
+
+static parallel_channel_t *par_channels;
+static int par_num_channels, par_next_channel;
+static pthread_mutex_t par_lock = PTHREAD_MUTEX_INITIALIZER;
+// Held shared while timing pairs, exclusively to time a row alone
+static pthread_rwlock_t par_pause;
+
+/* Times master entry x of channel ch against the members after it, taking
+ * par_pause shared unless it's held exclusively. Returns the pairs measured
+ */
+static int time_channel_row(const parallel_channel_t *ch, int x, double threshold,
+                            double *avgs, double *sum, int *retry_queue, bool alone)
+{
+    int i = ch->members[x], j, y, num_retry, given_up;
+
+    if (!alone)
+        pthread_rwlock_rdlock(&par_pause);
+
+    for (y = x + 1, *sum = 0, num_retry = 0; y < ch->num_members; y++) {
+        j = ch->members[y];
+        avgs[j] = find_read_time((void *)entries[i].virt_addr,
+                                (void *)entries[j].virt_addr, threshold);
+        if (avgs[j] == PAIR_DEFERRED) {
+            retry_queue[num_retry++] = j;
+            continue;
+        }
+        *sum += avgs[j];
+    }
+    given_up = retry_pairs(i, retry_queue, num_retry, threshold, avgs, sum);
+
+    if (!alone)
+        pthread_rwlock_unlock(&par_pause);
+
+    return ch->num_members - (x + 1) - given_up;
+}
+
+// Whether the control pair of ch got slower than alone, i.e. other workers
+// interfere with the channel
+static bool channel_interfered(const parallel_channel_t *ch, double threshold)
+{
+    double avg;
+
+    if (ch->control[0] < 0 || ch->control_avg == 0)
+        return false;
+
+    pthread_rwlock_rdlock(&par_pause);
+    avg = find_read_time((void *)entries[ch->control[0]].virt_addr,
+                        (void *)entries[ch->control[1]].virt_addr, threshold);
+    pthread_rwlock_unlock(&par_pause);
+
+    return avg == PAIR_DEFERRED ||
+            avg > (ch->control_avg * (100.0 + PARALLEL_INTERFERENCE_PERCENTAGE)) / 100.0;
+}
+
+// Like run_exp() on the members of ch
+static void associate_channel(parallel_worker_t *w, const parallel_channel_t *ch,
+                                double *avgs, int *retry_queue)
+{
+    double sum;
+    int x, i, measured;
+
+    // Entries of other channels are non-conflicts
+    memset(avgs, 0, NUM_ENTRIES * sizeof(double));
+
+    for (x = 0; x < ch->num_members; x++) {
+        i = ch->members[x];
+        if (entries[i].associated)
+            continue;
+
+        dprintf("Master Entry: %d\n", i);
+
+        measured = time_channel_row(ch, x, w->threshold, avgs, &sum, retry_queue, false);
+        if (channel_interfered(ch, w->threshold)) {
+            dprintf("Interference on master entry %d, timing it alone\n", i);
+            w->interferences++;
+            pthread_rwlock_wrlock(&par_pause);
+            measured = time_channel_row(ch, x, w->threshold, avgs, &sum, retry_queue, true);
+            pthread_rwlock_unlock(&par_pause);
+        }
+
+        associate_row(i, avgs, sum / measured);
+    }
+}
+
+static void *parallel_worker_fn(void *arg)
+{
+    parallel_worker_t *w = arg;
+    double *avgs = malloc(NUM_ENTRIES * sizeof(double));
+    int *retry_queue = malloc(NUM_ENTRIES * sizeof(int));
+    cpu_set_t mask;
+    int c;
+
+    assert(avgs != NULL && retry_queue != NULL);
+
+#if (INSTRUMENTATION == 1)
+    instr_thread_init();
+#endif
+    CPU_ZERO(&mask);
+    CPU_SET(w->cpu, &mask);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+        eprint("Couldn't set affinity of parallel worker to core %d\n", w->cpu);
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+    // Like the measuring core, other workers take the channels otherwise
+    if (disable_prefetch_on(w->cpu, &w->prefetch_flag) < 0) {
+        eprint("Couldn't disable prefetch of parallel worker on core %d\n", w->cpu);
+        free(avgs);
+        free(retry_queue);
+        return NULL;
+    }
+#endif
+    w->ran = true;
+
+    while (1) {
+        pthread_mutex_lock(&par_lock);
+        c = par_next_channel++;
+        pthread_mutex_unlock(&par_lock);
+        if (c >= par_num_channels)
+            break;
+        associate_channel(w, &par_channels[c], avgs, retry_queue);
+    }
+
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+    // A worker on the measuring core restores it disabled, like main expects
+    enable_prefetch(w->cpu, w->prefetch_flag);
+#endif
+    w->stats = sched_stats;
+    free(avgs);
+    free(retry_queue);
+    return NULL;
+}
+
+static void add_sched_stats(const struct sched_stats *st)
+{
+    sched_stats.samples += st->samples;
+    sched_stats.samples_rejected += st->samples_rejected;
+    sched_stats.pairs += st->pairs;
+    sched_stats.pairs_deferred += st->pairs_deferred;
+    sched_stats.pair_retries += st->pair_retries;
+    sched_stats.pairs_given_up += st->pairs_given_up;
+    sched_stats.windows += st->windows;
+    sched_stats.windows_noisy += st->windows_noisy;
+    sched_stats.max_window_reject_rate = st->max_window_reject_rate >
+                    sched_stats.max_window_reject_rate ?
+                    st->max_window_reject_rate : sched_stats.max_window_reject_rate;
+}
+
+/* Associates the entries of every channel of PARALLEL_CHANNEL_FILE on its own
+ * worker. Returns -1 if the channel functions aren't known
+ */
+static int run_parallel_exp(double threshold)
+{
+    parallel_worker_t workers[PARALLEL_WORKERS];
+    pthread_rwlockattr_t attr;
+    bank_mapping_t channel_mapping;
+    int num_cpu = get_nprocs(), core = sched_getcpu();
+    int num_workers, num_ran = 0, c, i, w;
+    uint64_t interferences = 0;
+    FILE *fp;
+
+    fp = fopen(PARALLEL_CHANNEL_FILE, "r");
+    if (fp == NULL) {
+        printf("No %s, timing all pairs on one core\n", PARALLEL_CHANNEL_FILE);
+        return -1;
+    }
+    i = read_mapping(fp, NULL, &channel_mapping);
+    fclose(fp);
+    if (i <= 0) {
+        eprint("No channel functions in %s\n", PARALLEL_CHANNEL_FILE);
+        return -1;
+    }
+
+    par_num_channels = 1 << channel_mapping.num_fns;
+    par_channels = calloc(par_num_channels, sizeof(parallel_channel_t));
+    assert(par_channels != NULL);
+    for (c = 0; c < par_num_channels; c++) {
+        par_channels[c].members = malloc(NUM_ENTRIES * sizeof(int));
+        assert(par_channels[c].members != NULL);
+    }
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        parallel_channel_t *ch = &par_channels[mapping_bank(&channel_mapping,
+                                                            entries[i].phy_addr)];
+        ch->members[ch->num_members++] = i;
+    }
+
+    // Control pairs are timed alone first
+    for (c = 0; c < par_num_channels; c++) {
+        parallel_channel_t *ch = &par_channels[c];
+
+        ch->control[0] = ch->control[1] = -1;
+        if (ch->num_members < 2)
+            continue;
+        ch->control[0] = ch->members[0];
+        ch->control[1] = ch->members[ch->num_members - 1];
+        ch->control_avg = measure_pair((void *)entries[ch->control[0]].virt_addr,
+                                    (void *)entries[ch->control[1]].virt_addr, threshold);
+        dprintf("Channel %d: Entries: %d, Control: %0.3f\n", c, ch->num_members,
+                ch->control_avg);
+    }
+
+    pthread_rwlockattr_init(&attr);
+    // Else a worker waiting to time a row alone could wait forever
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&par_pause, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    num_workers = PARALLEL_WORKERS < par_num_channels ? PARALLEL_WORKERS : par_num_channels;
+    num_workers = num_workers < num_cpu ? num_workers : num_cpu;
+    par_next_channel = 0;
+
+    for (w = 0; w < num_workers; w++) {
+        memset(&workers[w], 0, sizeof(workers[w]));
+        workers[w].cpu = (core + num_cpu - 1 - w) % num_cpu;
+        workers[w].threshold = threshold;
+        if (pthread_create(&workers[w].thread, NULL, parallel_worker_fn, &workers[w]) != 0) {
+            eprint("Couldn't create parallel worker\n");
+            num_workers = w;
+            break;
+        }
+        dprintf("Parallel worker %d on core %d\n", w, workers[w].cpu);
+    }
+
+    // Channels are handed out as workers get to them, so any that ran do all
+    for (w = 0; w < num_workers; w++) {
+        pthread_join(workers[w].thread, NULL);
+        if (!workers[w].ran)
+            continue;
+        num_ran++;
+        add_sched_stats(&workers[w].stats);
+        interferences += workers[w].interferences;
+    }
+
+    if (num_ran != 0)
+        printf("Parallel: Channels: %d, Workers: %d, Rows timed alone: %lu\n",
+                par_num_channels, num_ran, interferences);
+
+    pthread_rwlock_destroy(&par_pause);
+    for (c = 0; c < par_num_channels; c++)
+        free(par_channels[c].members);
+    free(par_channels);
+    par_channels = NULL;
+
+    // Timed serially if no worker ran
+    return num_ran != 0 ? 0 : -1;
+}
+#endif /* PARALLEL_MODE == 1 */
+
+void run_exp(uint64_t virt_start, uint64_t phy_start)
+{
+    uintptr_t a, b;
+    double threshold = LONG_MAX;
+    double avg, sum;
+    double *avgs;
+    int *retry_queue;
+    int i, num_retry;
+
+#if (PERSISTENT_REGION == 1)
+    if (region_cache.valid && region_cache.threshold != 0)
+        threshold = region_cache.threshold;
+#endif
+
+    // Warm up - Get refined threshold 
+    if (threshold == LONG_MAX) {
+        a = virt_start;
+        b = a + sizeof(uint64_t);
+        avg = find_read_time((void *)a, (void *)b, threshold);
+        threshold = avg * threshold_multiplier;
+    }
+#if (PERSISTENT_REGION == 1)
+    region_cache.threshold = threshold;
+#endif
+
+    dprintf("Threshold is %f\n", threshold);
+
+    PHASE_BEGIN(PHASE_ASSOCIATION);
+
+#if (PARALLEL_MODE == 1)
+    // Without the channel functions all pairs are timed here
+    if (run_parallel_exp(threshold) == 0) {
+        PHASE_END(PHASE_ASSOCIATION);
+        print_sched_stats();
+        return;
+    }
+#endif
+
+    avgs = calloc(sizeof(double), NUM_ENTRIES);
+    assert(avgs != NULL);
+    retry_queue = calloc(sizeof(int), NUM_ENTRIES);
+    assert(retry_queue != NULL);
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+
+        entry_t *entry = &entries[i]; 
+        int sub_entries = NUM_ENTRIES - (i + 1);
+        
+        if (entry->associated)
+            continue;
+
+        dprintf("Master Entry: %d\n", i);
+        
+        num_retry = measure_row(i, i + 1, threshold, avgs, &sum, retry_queue);
+
+        // Pairs given up are not counted in the average
+        sub_entries -= retry_pairs(i, retry_queue, num_retry, threshold, avgs, &sum);
+
+        associate_row(i, avgs, sum / sub_entries);
+    }
+
+    free(retry_queue);
+    free(avgs);
+
+    PHASE_END(PHASE_ASSOCIATION);
+
+    print_sched_stats();
+}
+
+#if (CLUSTER_MODE == 1)
+typedef struct cluster_state {
+    double *features;           // Normalized latency of entry e to reference r,
+                                // at e * CLUSTER_MAX_REFERENCES + r
+    uint64_t *conflicts;        // Bitmap of references an entry conflicts with
+    int refs[CLUSTER_MAX_REFERENCES];
+    int num_refs;
+    int *cluster;               // Cluster of every entry
+    double *confidence;         // Of every entry's cluster, 0 to 1
+    double *centroids;
+    int num_clusters;
+} cluster_state_t;
+
+#define CLUSTER_BITMAP_WORDS    ((CLUSTER_MAX_REFERENCES + 63) / 64)
+
+static inline double *cluster_feature(const cluster_state_t *cs, int e, int r)
+{
+    return &cs->features[(size_t)e * CLUSTER_MAX_REFERENCES + r];
+}
+
+static inline double *cluster_centroid(const cluster_state_t *cs, int c)
+{
+    return &cs->centroids[(size_t)c * CLUSTER_MAX_REFERENCES];
+}
+
+static inline uint64_t *cluster_bitmap(const cluster_state_t *cs, int e)
+{
+    return &cs->conflicts[(size_t)e * CLUSTER_BITMAP_WORDS];
+}
+
+// Times all entries against entry ref and adds it as a reference
+static void add_cluster_reference(cluster_state_t *cs, int ref, double threshold,
+                                    double *avgs, int *retry_queue)
+{
+    double sum, median, outlier, conflict_level, f;
+    double *sorted = calloc(NUM_ENTRIES, sizeof(double));
+    int r = cs->num_refs++, num_retry, num_sorted, num_conflict, e;
+
+    assert(sorted != NULL);
+
+    num_retry = measure_row(ref, 0, threshold, avgs, &sum, retry_queue);
+    retry_pairs(ref, retry_queue, num_retry, threshold, avgs, &sum);
+
+    // Most entries are in other banks
+    for (e = 0, num_sorted = 0; e < NUM_ENTRIES; e++) {
+        if (avgs[e] != 0)
+            sorted[num_sorted++] = avgs[e];
+    }
+    qsort(sorted, num_sorted, sizeof(double), compare_double);
+    median = num_sorted ? sorted[num_sorted / 2] : 1;
+    outlier = (median * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+
+    for (e = 0, conflict_level = 0, num_conflict = 0; e < NUM_ENTRIES; e++) {
+        // Given up pairs look like other banks
+        f = avgs[e] != 0 ? avgs[e] / median : 1;
+        f = f < CLUSTER_MAX_NORMALIZED ? f : CLUSTER_MAX_NORMALIZED;
+        *cluster_feature(cs, e, r) = f;
+        if (avgs[e] >= outlier) {
+            cluster_bitmap(cs, e)[r / 64] |= 1ULL << (r % 64);
+            conflict_level += f;
+            num_conflict++;
+        }
+    }
+
+    // Reference is in its own bank
+    *cluster_feature(cs, ref, r) = num_conflict ? conflict_level / num_conflict :
+                                    (100.0 + OUTLIER_PERCENTAGE) / 100.0;
+    cluster_bitmap(cs, ref)[r / 64] |= 1ULL << (r % 64);
+    cs->refs[r] = ref;
+
+    dprintf("Reference: %d, PhyAddr: 0x%lx, Conflicts: %d\n", r,
+            entries[ref].phy_addr, num_conflict);
+    free(sorted);
+}
+
+static bool entry_covered(const cluster_state_t *cs, int e)
+{
+    int w;
+
+    for (w = 0; w < CLUSTER_BITMAP_WORDS; w++) {
+        if (cluster_bitmap(cs, e)[w] != 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Entries in the row of a reference look like other banks to it, so it is
+// paired with an entry it conflicts with, in another row of the same bank
+static void add_bank_references(cluster_state_t *cs, int ref, double threshold,
+                                double *avgs, int *retry_queue)
+{
+    int r = cs->num_refs, e;
+
+    add_cluster_reference(cs, ref, threshold, avgs, retry_queue);
+
+    for (e = 0; e < NUM_ENTRIES && cs->num_refs < CLUSTER_MAX_REFERENCES; e++) {
+        if (e != ref && ((cluster_bitmap(cs, e)[r / 64] >> (r % 64)) & 1)) {
+            add_cluster_reference(cs, e, threshold, avgs, retry_queue);
+            break;
+        }
+    }
+}
+
+// Returns an entry conflicting with no reference, -1 if none
+static int find_uncovered_entry(const cluster_state_t *cs, int *uncovered)
+{
+    int e, first = -1;
+
+    for (e = 0, *uncovered = 0; e < NUM_ENTRIES; e++) {
+        if (!entry_covered(cs, e)) {
+            first = first < 0 ? e : first;
+            (*uncovered)++;
+        }
+    }
+
+    return first;
+}
+
+static const cluster_state_t *cluster_sort_state;
+
+static int compare_conflicts(const void *a, const void *b)
+{
+    return memcmp(cluster_bitmap(cluster_sort_state, *(const int *)a),
+                    cluster_bitmap(cluster_sort_state, *(const int *)b),
+                    CLUSTER_BITMAP_WORDS * sizeof(uint64_t));
+}
+
+static double cluster_distance(const cluster_state_t *cs, int e, int c)
+{
+    const double *centroid = cluster_centroid(cs, c);
+    double d = 0, diff;
+    int r;
+
+    for (r = 0; r < cs->num_refs; r++) {
+        diff = *cluster_feature(cs, e, r) - centroid[r];
+        d += diff * diff;
+    }
+
+    return d;
+}
+
+// Seeds one cluster per large group of entries with the same conflicts, which
+// estimates the number of banks
+static void seed_clusters(cluster_state_t *cs)
+{
+    int *order = calloc(NUM_ENTRIES, sizeof(int));
+    int i, k, start, size, largest, min_size, pass, r;
+    double *centroid;
+
+    assert(order != NULL);
+    for (i = 0; i < NUM_ENTRIES; i++)
+        order[i] = i;
+    cluster_sort_state = cs;
+    qsort(order, NUM_ENTRIES, sizeof(int), compare_conflicts);
+
+    for (pass = 0, largest = 0, min_size = 0; pass < 2; pass++) {
+        for (start = 0; start < NUM_ENTRIES; start += size) {
+            for (size = 1; start + size < NUM_ENTRIES &&
+                    compare_conflicts(&order[start], &order[start + size]) == 0; size++)
+                ;
+
+            if (pass == 0) {
+                largest = size > largest ? size : largest;
+                continue;
+            }
+
+            if (size < min_size || cs->num_clusters == MAX_BANKS)
+                continue;
+
+            centroid = cluster_centroid(cs, cs->num_clusters++);
+            for (k = 0; k < size; k++) {
+                for (r = 0; r < cs->num_refs; r++)
+                    centroid[r] += *cluster_feature(cs, order[start + k], r) / size;
+            }
+        }
+
+        min_size = (largest * CLUSTER_MIN_GROUP_PERCENTAGE) / 100;
+        min_size = min_size > 2 ? min_size : 2;
+    }
+
+    free(order);
+}
+
+// Lloyd's iterations from the seeded centroids
+static void kmeans_clusters(cluster_state_t *cs)
+{
+    int *counts = calloc(cs->num_clusters, sizeof(int));
+    int iter, e, c, r, best, changed;
+    double d, best_d, *centroid;
+
+    assert(counts != NULL);
+
+    for (iter = 0; iter < CLUSTER_KMEANS_ITERATIONS; iter++) {
+        for (e = 0, changed = 0; e < NUM_ENTRIES; e++) {
+            for (c = 0, best = 0, best_d = -1; c < cs->num_clusters; c++) {
+                d = cluster_distance(cs, e, c);
+                if (best_d < 0 || d < best_d) {
+                    best_d = d;
+                    best = c;
+                }
+            }
+            changed += cs->cluster[e] != best;
+            cs->cluster[e] = best;
+        }
+
+        if (changed == 0)
+            break;
+
+        // Empty clusters keep their centroid
+        memset(counts, 0, cs->num_clusters * sizeof(int));
+        for (e = 0; e < NUM_ENTRIES; e++)
+            counts[cs->cluster[e]]++;
+        for (c = 0; c < cs->num_clusters; c++) {
+            if (counts[c] != 0)
+                memset(cluster_centroid(cs, c), 0, CLUSTER_MAX_REFERENCES * sizeof(double));
+        }
+        for (e = 0; e < NUM_ENTRIES; e++) {
+            centroid = cluster_centroid(cs, cs->cluster[e]);
+            for (r = 0; r < cs->num_refs; r++)
+                centroid[r] += *cluster_feature(cs, e, r) / counts[cs->cluster[e]];
+        }
+    }
+
+    dprintf("K-means: %d iterations\n", iter);
+    free(counts);
+}
+
+// Confidence of an entry: 1 - (distance to own centroid / distance to nearest
+// other centroid), 0 when it is halfway between clusters
+static void cluster_confidence(cluster_state_t *cs)
+{
+    double own, other, d;
+    int e, c;
+
+    for (e = 0; e < NUM_ENTRIES; e++) {
+        own = sqrt(cluster_distance(cs, e, cs->cluster[e]));
+        for (c = 0, other = -1; c < cs->num_clusters; c++) {
+            if (c == cs->cluster[e])
+                continue;
+            d = sqrt(cluster_distance(cs, e, c));
+            other = other < 0 || d < other ? d : other;
+        }
+        cs->confidence[e] = other > 0 ? 1 - own / other : 1;
+        cs->confidence[e] = cs->confidence[e] > 0 ? cs->confidence[e] : 0;
+    }
+}
+
+// Clusters become sets of siblings, with their first entry as master
+static void clusters_to_entries(const cluster_state_t *cs)
+{
+    entry_t *master;
+    int c, e;
+
+    for (c = 0; c < cs->num_clusters; c++) {
+        for (e = 0, master = NULL; e < NUM_ENTRIES; e++) {
+            if (cs->cluster[e] != c)
+                continue;
+
+            if (master == NULL) {
+                master = &entries[e];
+                master->associated = false;
+                master->num_sibling = 0;
+                continue;
+            }
+
+            master->siblings[master->num_sibling++] = &entries[e];
+            entries[e].associated = true;
+            entries[e].siblings[0] = master;
+            entries[e].num_sibling = 1;
+        }
+    }
+}
+
+void run_clustering(uint64_t virt_start)
+{
+    cluster_state_t cs;
+    double threshold, *avgs, conf;
+    int *retry_queue, i, e, c, size, uncovered, low_confidence;
+
+    // Warm up - Get refined threshold
+    threshold = find_read_time((void *)virt_start,
+                                (void *)(virt_start + sizeof(uint64_t)), LONG_MAX);
+    threshold *= threshold_multiplier;
+
+    PHASE_BEGIN(PHASE_ASSOCIATION);
+
+    memset(&cs, 0, sizeof(cs));
+    cs.features = calloc((size_t)NUM_ENTRIES * CLUSTER_MAX_REFERENCES, sizeof(double));
+    cs.conflicts = calloc((size_t)NUM_ENTRIES * CLUSTER_BITMAP_WORDS, sizeof(uint64_t));
+    cs.cluster = calloc(NUM_ENTRIES, sizeof(int));
+    cs.confidence = calloc(NUM_ENTRIES, sizeof(double));
+    cs.centroids = calloc((size_t)MAX_BANKS * CLUSTER_MAX_REFERENCES, sizeof(double));
+    avgs = calloc(NUM_ENTRIES, sizeof(double));
+    retry_queue = calloc(NUM_ENTRIES, sizeof(int));
+    assert(cs.features != NULL && cs.conflicts != NULL && cs.cluster != NULL &&
+            cs.confidence != NULL && cs.centroids != NULL && avgs != NULL &&
+            retry_queue != NULL);
+
+    for (i = 0; i < CLUSTER_REFERENCES && i < NUM_ENTRIES &&
+            cs.num_refs < CLUSTER_MAX_REFERENCES; i++) {
+        e = (i * NUM_ENTRIES) / CLUSTER_REFERENCES;
+        if (!entry_covered(&cs, e))
+            add_bank_references(&cs, e, threshold, avgs, retry_queue);
+    }
+
+    // Banks without a reference yet
+    while ((e = find_uncovered_entry(&cs, &uncovered)) >= 0 &&
+            cs.num_refs < CLUSTER_MAX_REFERENCES)
+        add_bank_references(&cs, e, threshold, avgs, retry_queue);
+
+    if (e >= 0)
+        eprint("%d entries conflict with no reference, increase CLUSTER_MAX_REFERENCES\n",
+                uncovered);
+
+    seed_clusters(&cs);
+    kmeans_clusters(&cs);
+    cluster_confidence(&cs);
+    clusters_to_entries(&cs);
+
+    printf("Clusters: %d, References: %d\n", cs.num_clusters, cs.num_refs);
+    for (c = 0; c < cs.num_clusters; c++) {
+        for (e = 0, size = 0, conf = 0, low_confidence = 0; e < NUM_ENTRIES; e++) {
+            if (cs.cluster[e] != c)
+                continue;
+            size++;
+            conf += cs.confidence[e];
+            if (cs.confidence[e] < CLUSTER_LOW_CONFIDENCE) {
+                low_confidence++;
+                dprintf("Low confidence: PhyAddr: 0x%lx, Cluster: %d, Confidence: %0.3f\n",
+                        entries[e].phy_addr, c, cs.confidence[e]);
+            }
+        }
+        if (size == 0)
+            continue;
+        printf("Cluster: %d, Entries: %d, Confidence: %0.3f, Low confidence entries: %d\n",
+                c, size, conf / size, low_confidence);
+    }
+
+    free(cs.features);
+    free(cs.conflicts);
+    free(cs.cluster);
+    free(cs.confidence);
+    free(cs.centroids);
+    free(avgs);
+    free(retry_queue);
+
+    PHASE_END(PHASE_ASSOCIATION);
+
+    print_sched_stats();
+}
+#endif /* CLUSTER_MODE == 1 */
+
+
+
+/* Writes the sets of sibling entries in the format algo_finder reads: A line
+ * starting with "Bank" starts a new set, followed by one address per line
+ */
+void write_entry_sets(FILE *fp)
+{
+    int i, j, set;
+
+    for (i = 0, set = 0; i < NUM_ENTRIES; i++) {
+        entry_t *entry = &entries[i];
+
+        if (entry->associated)
+            continue;
+
+        fprintf(fp, "Bank: %d\n", set++);
+        fprintf(fp, "0x%lx\n", entry->phy_addr);
+        for (j = 0; j < entry->num_sibling; j++)
+            fprintf(fp, "0x%lx\n", entry->siblings[j]->phy_addr);
+    }
+}
+
+int dump_entry_sets(const char *fname)
+{
+    FILE *fp;
+
+    fp = fopen(fname, "w");
+    if (fp == NULL) {
+        eprint("Couldn't open %s: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    write_entry_sets(fp);
+    fclose(fp);
+    return 0;
+}
+
+#if (CHANNEL_PROBE_MODE == 1)
+typedef struct probe_worker {
+    pthread_t thread;
+    int cpu;
+    const uint64_t *lines;      // Lines of the entry being streamed
+    int num_lines;
+    int first;                  // Lines first, first + step, ... are streamed
+    int step;
+    uint64_t accesses;          // Accesses done in last probe
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+    uint64_t prefetch_flag;     // MSR of the core before the probe
+#endif
+} probe_worker_t;
+
+static probe_worker_t probe_workers[CHANNEL_PROBE_THREADS];
+static pthread_barrier_t probe_start, probe_end;
+// Held while the workers are created, they exit right away if that failed
+static pthread_mutex_t probe_create_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool probe_exit;
+static uint64_t probe_lines[2][CHANNEL_PROBE_LINES];
+
+/* Loads all lines of the worker, then flushes them, with one fence per pass
+ * rather than per line so that the misses overlap
+ */
+static void stream_entry(probe_worker_t *w)
+{
+    uint64_t start_ticks = currentTicks();
+    uint64_t accesses = 0;
+    int val, k;
+
+    while (currentTicks() - start_ticks < CHANNEL_PROBE_TICKS) {
+        for (k = w->first; k < w->num_lines; k += w->step)
+            asm volatile ("movl (%1), %0\n\t" : "=r" (val) : "r" (w->lines[k]) : "memory");
+        for (k = w->first; k < w->num_lines; k += w->step) {
+            asm volatile ("clflush (%0)\n\t" :: "r" (w->lines[k]) : "memory");
+            accesses++;
+        }
+        asm volatile ("mfence\n\t" ::: "memory");
+    }
+
+    w->accesses = accesses;
+}
+
+static void *probe_worker_fn(void *arg)
+{
+    probe_worker_t *w = arg;
+    cpu_set_t mask;
+
+    pthread_mutex_lock(&probe_create_lock);
+    pthread_mutex_unlock(&probe_create_lock);
+    if (probe_exit)
+        return NULL;
+
+    CPU_ZERO(&mask);
+    CPU_SET(w->cpu, &mask);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+        eprint("Couldn't set affinity of probe worker to core %d\n", w->cpu);
+
+    while (1) {
+        pthread_barrier_wait(&probe_start);
+        if (probe_exit)
+            break;
+        stream_entry(w);
+        pthread_barrier_wait(&probe_end);
+    }
+
+    return NULL;
+}
+
+// Restores the prefetchers of the cores of the first num workers
+static void restore_probe_prefetch(int num)
+{
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+    int i;
+
+    // A worker on the measuring core restores it disabled, like main expects
+    for (i = num - 1; i >= 0; i--)
+        enable_prefetch(probe_workers[i].cpu, probe_workers[i].prefetch_flag);
+#endif
+}
+
+static int start_probe_workers(void)
+{
+    int num_cpu = get_nprocs();
+    int core = sched_getcpu();
+    int i, j, prefetched = 0;
+
+    if (num_cpu < CHANNEL_PROBE_THREADS) {
+        eprint("Need at least %d cores for channel probing\n",
+                CHANNEL_PROBE_THREADS);
+        return -1;
+    }
+
+    pthread_barrier_init(&probe_start, NULL, CHANNEL_PROBE_THREADS + 1);
+    pthread_barrier_init(&probe_end, NULL, CHANNEL_PROBE_THREADS + 1);
+    probe_exit = false;
+
+    pthread_mutex_lock(&probe_create_lock);
+    // Keep away from our own core if there are enough cores
+    for (i = 0; i < CHANNEL_PROBE_THREADS; i++) {
+        probe_worker_t *w = &probe_workers[i];
+        w->cpu = (core + num_cpu - 1 - i) % num_cpu;
+        w->first = i % (CHANNEL_PROBE_THREADS / 2);
+        w->step = CHANNEL_PROBE_THREADS / 2;
+#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
+        // Prefetches of the streams would load other channels too
+        if (disable_prefetch_on(w->cpu, &w->prefetch_flag) < 0)
+            break;
+#endif
+        prefetched++;
+        if (pthread_create(&w->thread, NULL, probe_worker_fn, w) != 0) {
+            eprint("Couldn't create probe worker\n");
+            break;
+        }
+        dprintf("Probe worker %d on core %d\n", i, w->cpu);
+    }
+
+    if (i < CHANNEL_PROBE_THREADS) {
+        probe_exit = true;
+        pthread_mutex_unlock(&probe_create_lock);
+        for (j = 0; j < i; j++)
+            pthread_join(probe_workers[j].thread, NULL);
+        restore_probe_prefetch(prefetched);
+        pthread_barrier_destroy(&probe_start);
+        pthread_barrier_destroy(&probe_end);
+        return -1;
+    }
+    pthread_mutex_unlock(&probe_create_lock);
+
+    return 0;
+}
+
+static void stop_probe_workers(void)
+{
+    int i;
+
+    probe_exit = true;
+    pthread_barrier_wait(&probe_start);
+    for (i = 0; i < CHANNEL_PROBE_THREADS; i++)
+        pthread_join(probe_workers[i].thread, NULL);
+
+    restore_probe_prefetch(CHANNEL_PROBE_THREADS);
+
+    pthread_barrier_destroy(&probe_start);
+    pthread_barrier_destroy(&probe_end);
+}
+
+/* Lines of entry e's row in its bank under bank_mapping, the entry's own
+ * first. Returns their number
+ */
+static int probe_entry_lines(int e, uint64_t *lines)
+{
+    uint64_t row = entries[e].phy_addr >> ROW_SHIFT, off, phy;
+    int bank = mapping_bank(&bank_mapping, entries[e].phy_addr);
+    int i, k, num = 0;
+
+    for (i = 0; i < NUM_ENTRIES && num < CHANNEL_PROBE_LINES; i++) {
+        k = (e + i) % NUM_ENTRIES;
+        if (entries[k].phy_addr >> ROW_SHIFT != row)
+            continue;
+        for (off = 0; off < MIN_BANK_SIZE && num < CHANNEL_PROBE_LINES;
+                off += CACHELINE_SIZE) {
+            phy = entries[k].phy_addr + off;
+            if (phy >> ROW_SHIFT == row && mapping_bank(&bank_mapping, phy) == bank)
+                lines[num++] = entries[k].virt_addr + off;
+        }
+    }
+
+    return num;
+}
+
+// Returns the aggregate throughput (accesses per million ticks) when half the
+// workers stream entry a and the other half stream entry b
+double find_probe_throughput(int a, int b)
+{
+    int num[2] = { probe_entry_lines(a, probe_lines[0]), probe_entry_lines(b, probe_lines[1]) };
+    uint64_t accesses;
+    int i, half;
+
+    for (i = 0; i < CHANNEL_PROBE_THREADS; i++) {
+        half = i >= CHANNEL_PROBE_THREADS / 2;
+        probe_workers[i].lines = probe_lines[half];
+        probe_workers[i].num_lines = num[half];
+    }
+
+    pthread_barrier_wait(&probe_start);
+    pthread_barrier_wait(&probe_end);
+
+    for (i = 0, accesses = 0; i < CHANNEL_PROBE_THREADS; i++)
+        accesses += probe_workers[i].accesses;
+
+    return (accesses * 1000000.0) / CHANNEL_PROBE_TICKS;
+}
+
+/* Groups entries that share a channel/rank. Like run_exp() each unassociated
+ * entry becomes master and claims all entries which reduce the throughput
+ */
+int run_channel_probe(void)
+{
+    double *tputs;
+    double max_tput, running_threshold;
+    int i, j, k, num_outlier;
+
+    if (start_probe_workers() < 0)
+        return -1;
+
+    PHASE_BEGIN(PHASE_ASSOCIATION);
+
+    tputs = calloc(sizeof(double), NUM_ENTRIES);
+    assert(tputs != NULL);
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+
+        entry_t *entry = &entries[i];
+
+        if (entry->associated)
+            continue;
+
+        dprintf("Master Entry: %d\n", i);
+
+        for (j = i + 1, max_tput = 0; j < NUM_ENTRIES; j++) {
+            if (entries[j].associated)
+                continue;
+
+            PHASE_BEGIN(PHASE_SAMPLING);
+            tputs[j] = find_probe_throughput(i, j);
+            PHASE_END(PHASE_SAMPLING);
+            dprintf("Throughput: PhyAddr1: 0x%lx,\t PhyAddr2:0x%lx,\t %0.3f\n",
+                    entry->phy_addr, entries[j].phy_addr, tputs[j]);
+            max_tput = tputs[j] > max_tput ? tputs[j] : max_tput;
+        }
+
+        running_threshold = (max_tput * (100.0 - CHANNEL_PROBE_DROP_PERCENTAGE))
+                                / 100.0;
+        for (j = i + 1, num_outlier = 0; j < NUM_ENTRIES; j++) {
+            if (entries[j].associated || tputs[j] > running_threshold)
+                continue;
+
+            entry->siblings[num_outlier] = &entries[j];
+            num_outlier++;
+            entries[j].associated = true;
+            entries[j].siblings[0] = entry;
+            entries[j].num_sibling = 1;
+        }
+        entry->num_sibling = num_outlier;
+
+        dprintf("Max Throughput: %f, Threshold: %f\n", max_tput, running_threshold);
+        dprintf("Found %d entries on same channel/rank\n", num_outlier);
+    }
+
+    free(tputs);
+    stop_probe_workers();
+
+    PHASE_END(PHASE_ASSOCIATION);
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        entry_t *entry = &entries[i];
+
+        if (entry->associated)
+            continue;
+
+        printf("Sets of channel/rank entries:\n");
+        printf("PhyAddr: 0x%lx\t\t", entry->phy_addr);
+        print_binary(entry->phy_addr);
+        printf("\n");
+        for (k = 0; k < entry->num_sibling; k++) {
+            printf("PhyAddr: 0x%lx\t\t", entry->siblings[k]->phy_addr);
+            print_binary(entry->siblings[k]->phy_addr);
+            printf("\n");
+        }
+    }
+
+    if (dump_entry_sets(CHANNEL_DATA_FILE) == 0)
+        printf("Channel/rank sets written to %s. Run algo_finder on it for "
+                "the channel/rank functions\n", CHANNEL_DATA_FILE);
+
+    return 0;
+}
+#endif /* CHANNEL_PROBE_MODE == 1 */
+
+
+// Checks mapping/hypothesis
+// TODO: Check if all the bits of address have been accounted for
+// Returns number of inconsistencies of the hypothesis with the measurements
+int check_mapping(void)
+{
+    int i, j;
+    int main_bank, bank;
+    int errors = 0;
+
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        entry_t *entry = &entries[i];
+
+        // Look for only master siblings
+        if (entry->associated == true)
+            continue;
+
+        main_bank = phy_to_bank_mapping(entry->phy_addr);
+        entry->bank = main_bank;
+        for (j = 0; j < entry->num_sibling; j++) {
+            entry_t *sibling = entry->siblings[j];
+            bank = phy_to_bank_mapping(sibling->phy_addr);
+            sibling->bank = bank;
+            if (bank != main_bank) {
+                errors++;
+                eprint("Banks not match for siblings\n");
+                eprint("Main: PhyAddr: 0x%lx Bank:%d, "
+                                "Sibling: PhyAddr: 0x%lx Bank: %d\n",
+                                entry->phy_addr, main_bank,
+                                sibling->phy_addr, bank);
+            }
+        }
+
+        if (banks[main_bank].main_entry != NULL) {
+            errors++;
+            eprint("Multiple entries belong to same bank\n");
+            eprint("Hypothesis might be insufficient\n");
+            eprint("Bank: %d, Earlier Main Entry: PhyAddr: 0x%lx, "
+                            "Current Main Entry: PhyAddr: 0x:%lx\n",
+                            main_bank, banks[main_bank].main_entry->phy_addr,
+                            entry->phy_addr);
+        } else {
+            banks[main_bank].main_entry = entry;
+        }
+    }
+
+    // All entries should be assigned a bank
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        entry_t *entry = &entries[i];
+        if (entry->bank < 0) {
+            errors++;
+            eprint("Entry not assigned any bank: PhyAddr: 0x%lx\n",
+                    entry->phy_addr);
+        }
+
+        if (entry->associated)
+            continue;
+
+        printf("Sets of sibling entries:\n");
+        printf("Bank: %d, PhyAddr: 0x%lx\t\t", entry->bank, entry->phy_addr);
+        print_binary(entry->phy_addr);
+        printf("\n");
+        
+        for (j = 0; j < entry->num_sibling; j++) {
+            printf("Bank: %d, PhyAddr: 0x%lx\t\t", entry->bank, 
+                    entry->siblings[j]->phy_addr);
+            print_binary(entry->siblings[j]->phy_addr);
+            printf("\n");
+        }
+    }
+
+    // Print bank stats
+    printf("Banks in use: Total Entries: %d\n", NUM_ENTRIES);
+    for (i = 0; i < MAX_BANKS; i++) {
+        if (banks[i].main_entry == NULL)
+            continue;
+        
+        printf("Bank:%d, Entries:%d\n", i, banks[i].main_entry->num_sibling + 1);
+    }
+
+    return errors;
+}
+
+// Writes mapping in algo_finder's output format
+void write_mapping(FILE *fp, const bank_mapping_t *m)
+{
+    int i, bit, depth;
+
+    for (i = 0; i < m->num_fns; i++) {
+        fprintf(fp, "Indexes: ");
+        for (bit = 0, depth = 0; bit < 64; bit++) {
+            if ((m->fns[i] >> bit) & 1) {
+                fprintf(fp, "%d ", bit);
+                depth++;
+            }
+        }
+        fprintf(fp, "\nOps: ");
+        // XOR in algo_finder's ops_t
+        while (--depth > 0)
+            fprintf(fp, "2 ");
+        fprintf(fp, "\n");
+    }
+}
+
+/*
+ * Reads a mapping in algo_finder's output format (other lines are ignored).
+ * With key, only the functions after the matching "Fingerprint:" line are
+ * read. Functions which are XORs of earlier ones are skipped. Returns the
+ * number of functions, 0 if none found and -1 on error
+ */
+int read_mapping(FILE *fp, const uint64_t *key, bank_mapping_t *m)
+{
+    uint64_t basis[64] = {0};
+    uint64_t line_key, mask, v;
+    bool matching = key == NULL, found = false;
+    char *line = NULL, *p, *end;
+    size_t len = 0;
+    long bit;
+    int ret = -1;
+
+    m->num_fns = 0;
+    while (getline(&line, &len, fp) != -1) {
+        if (sscanf(line, "Fingerprint: %lx", &line_key) == 1) {
+            if (found)
+                break;
+            matching = key != NULL && line_key == *key;
+            continue;
+        }
+
+        if (!matching)
+            continue;
+
+        if (strncmp(line, "Ops:", 4) == 0) {
+            for (p = line + 4; (bit = strtol(p, &end, 10)) != 0 || end != p; p = end) {
+                if (bit != 2) {
+                    eprint("Only XOR functions are supported: %s", line);
+                    goto out;
+                }
+            }
+            continue;
+        }
+
+        if (strncmp(line, "Indexes:", 8) != 0)
+            continue;
+
+        for (p = line + 8, mask = 0; (bit = strtol(p, &end, 10)) != 0 || end != p; p = end) {
+            if (bit < 0 || bit > 63) {
+                eprint("Invalid bit: %s", line);
+                goto out;
+            }
+            mask |= ADDR_BIT(bit);
+        }
+        found = true;
+
+        for (v = mask, bit = 63; bit >= 0 && v; bit--) {
+            if (!((v >> bit) & 1))
+                continue;
+            if (basis[bit] == 0) {
+                basis[bit] = v;
+                break;
+            }
+            v ^= basis[bit];
+        }
+        if (v == 0)
+            continue;
+
+        if (m->num_fns == MAX_MAPPING_FNS) {
+            eprint("More than %d independent functions\n", MAX_MAPPING_FNS);
+            goto out;
+        }
+        m->fns[m->num_fns++] = mask;
+    }
+
+    ret = found ? m->num_fns : 0;
+out:
+    free(line);
+    return ret;
+}
+
+// Reads the value of first "key" line of a /proc file into val
+static int read_proc_value(const char *fname, const char *key, char *val, size_t len)
+{
+    char line[256], *p;
+    FILE *fp = fopen(fname, "r");
+    int ret = -1;
+
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, key, strlen(key)) != 0 || (p = strchr(line, ':')) == NULL)
+            continue;
+        for (p++; *p == ' ' || *p == '\t'; p++)
+            ;
+        p[strcspn(p, "\n")] = '\0';
+        snprintf(val, len, "%s", p);
+        ret = 0;
+        break;
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+static void read_sysfs_string(const char *fname, char *val, size_t len)
+{
+    FILE *fp = fopen(fname, "r");
+
+    snprintf(val, len, "?");
+    if (fp == NULL)
+        return;
+    if (fgets(val, len, fp) != NULL)
+        val[strcspn(val, "\n")] = '\0';
+    fclose(fp);
+}
+
+/*
+ * Describes the hardware into descr: CPU vendor/family/model/name, memory
+ * size in GB and the size and type of every DIMM reported by EDAC.
+ * Returns its FNV-1a hash, used as the key in the mapping database
+ */
+uint64_t hw_fingerprint(char *descr, size_t len)
+{
+    char vendor[64] = "?", family[16] = "?", model[16] = "?", name[128] = "?";
+    char memtotal[64] = "0", dir[PATH_MAX], fname[PATH_MAX + 32];
+    char size[32], type[32];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t used, i;
+    glob_t g;
+
+    read_proc_value("/proc/cpuinfo", "vendor_id", vendor, sizeof(vendor));
+    read_proc_value("/proc/cpuinfo", "cpu family", family, sizeof(family));
+    read_proc_value("/proc/cpuinfo", "model\t", model, sizeof(model));
+    read_proc_value("/proc/cpuinfo", "model name", name, sizeof(name));
+    read_proc_value("/proc/meminfo", "MemTotal", memtotal, sizeof(memtotal));
+
+    // Kernel reserves part of memory, so round up
+    used = snprintf(descr, len, "cpu=%s/%s/%s/%s;mem=%luG;dimms=", vendor,
+                    family, model, name, (strtoul(memtotal, NULL, 10) + (1UL << 20) - 1) >> 20);
+
+    if (glob(EDAC_SYSFS_DIR "/mc*/dimm*", 0, NULL, &g) == 0) {
+        for (i = 0; i < g.gl_pathc && used < len; i++) {
+            snprintf(dir, sizeof(dir), "%s", g.gl_pathv[i]);
+            snprintf(fname, sizeof(fname), "%s/size", dir);
+            read_sysfs_string(fname, size, sizeof(size));
+            snprintf(fname, sizeof(fname), "%s/dimm_mem_type", dir);
+            read_sysfs_string(fname, type, sizeof(type));
+            used += snprintf(descr + used, len - used, "%s%s:%sMB:%s", i ? "," : "",
+                            dir + strlen(EDAC_SYSFS_DIR "/"), size, type);
+        }
+        globfree(&g);
+    } else {
+        snprintf(descr + used, len - used, "none");
+    }
+
+    for (i = 0; descr[i] != '\0'; i++) {
+        hash ^= (unsigned char)descr[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Standard normal quantile, by bisection on erfc()
+static double normal_quantile(double p)
+{
+    double lo = -10, hi = 10, mid;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        mid = (lo + hi) / 2;
+        if (0.5 * erfc(-mid / sqrt(2)) < p)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return mid;
+}
+
+// Wilson score interval of k successes in n trials
+static void wilson_interval(int k, int n, double z, double *lower, double *upper)
+{
+    double p = (double)k / n, z2 = z * z;
+    double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    double half = (z / (1 + z2 / n)) * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+
+    *lower = center - half > 0 ? center - half : 0;
+    *upper = center + half < 1 ? center + half : 1;
+}
+
+typedef struct verify_bank {
+    int *members;               // Entries predicted in the bank
+    int num_members;
+    double *avgs;               // Pair timings, same bank pairs at odd indexes
+    int num_pairs;
+    int mismatches;
+    int decided;                // 1: below max mismatch rate, -1: above
+} verify_bank_t;
+
+// Draws an entry pair for bank: same bank (different row) or another bank
+static int draw_verify_pair(verify_bank_t *vb, int bank, bool same, int *i, int *j)
+{
+    int tries, other;
+
+    for (tries = 0; tries < 100; tries++) {
+        *i = vb[bank].members[random() % vb[bank].num_members];
+        if (same) {
+            *j = vb[bank].members[random() % vb[bank].num_members];
+            if ((entries[*i].phy_addr ^ entries[*j].phy_addr) >> ROW_SHIFT)
+                return 0;
+        } else {
+            other = random() % MAX_BANKS;
+            if (other != bank && vb[other].num_members > 0) {
+                *j = vb[other].members[random() % vb[other].num_members];
+                return 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Verifies the hypothesis with stratified random pairs, in rounds of a same
+ * bank and a different bank pair per predicted bank. Pairs conflicting
+ * against the prediction are mismatches. Returns 1 if the mapping is
+ * confirmed for every bank at VERIFY_CONFIDENCE, 0 otherwise
+ */
+int verify_mapping(void)
+{
+    verify_bank_t vb[MAX_BANKS];
+    uintptr_t a = entries[0].virt_addr;
+    double threshold, outlier, lower, upper, z, max_rate, avg;
+    double *diff_avgs;
+    int saved_outer_loop = outer_loop;
+    int i, j, k, bank, round, num_diff, undecided, refuted, total;
+    bool same;
+
+    z = normal_quantile(VERIFY_CONFIDENCE);
+    max_rate = VERIFY_MAX_MISMATCH_PERCENTAGE / 100.0;
+
+    memset(vb, 0, sizeof(vb));
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        bank = phy_to_bank_mapping(entries[i].phy_addr);
+        if (vb[bank].members == NULL) {
+            vb[bank].members = calloc(NUM_ENTRIES, sizeof(int));
+            vb[bank].avgs = calloc(VERIFY_MAX_PAIRS_PER_BANK, sizeof(double));
+            assert(vb[bank].members != NULL && vb[bank].avgs != NULL);
+        }
+        vb[bank].members[vb[bank].num_members++] = i;
+    }
+    diff_avgs = calloc(MAX_BANKS * VERIFY_MAX_PAIRS_PER_BANK, sizeof(double));
+    assert(diff_avgs != NULL);
+
+    threshold = find_read_time((void *)a, (void *)(a + sizeof(uint64_t)), LONG_MAX);
+    threshold *= threshold_multiplier;
+
+    outer_loop = (outer_loop * VERIFY_OUTER_LOOP_PERCENTAGE) / 100;
+    outer_loop = outer_loop > 0 ? outer_loop : 1;
+
+    for (round = 0, num_diff = 0, undecided = 1;
+            undecided && 2 * (round + 1) <= VERIFY_MAX_PAIRS_PER_BANK; round++) {
+
+        for (bank = 0; bank < MAX_BANKS; bank++) {
+            if (vb[bank].num_members == 0 || vb[bank].decided)
+                continue;
+
+            for (k = 0; k < 2; k++) {
+                same = k;
+                if (draw_verify_pair(vb, bank, same, &i, &j) < 0) {
+                    // E.g. single entry bank, mismatching pair is recorded
+                    avg = 0;
+                } else {
+                    avg = measure_pair((void *)entries[i].virt_addr,
+                                        (void *)entries[j].virt_addr, threshold);
+                }
+                vb[bank].avgs[vb[bank].num_pairs++] = avg;
+                if (!same && avg != 0)
+                    diff_avgs[num_diff++] = avg;
+            }
+        }
+
+        if (num_diff == 0)
+            break;
+
+        // Most different bank pairs don't conflict. Reference is refined
+        // every round, so all pairs are reclassified
+        qsort(diff_avgs, num_diff, sizeof(double), compare_double);
+        outlier = (diff_avgs[num_diff / 2] * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+
+        for (bank = 0, undecided = 0; bank < MAX_BANKS; bank++) {
+            verify_bank_t *b = &vb[bank];
+
+            if (b->num_members == 0 || b->decided)
+                continue;
+
+            for (k = 0, b->mismatches = 0; k < b->num_pairs; k++) {
+                same = k & 1;
+                b->mismatches += b->avgs[k] == 0 || same != (b->avgs[k] >= outlier);
+            }
+
+            if (b->num_pairs >= VERIFY_MIN_PAIRS_PER_BANK) {
+                wilson_interval(b->mismatches, b->num_pairs, z, &lower, &upper);
+                if (upper < max_rate)
+                    b->decided = 1;
+                else if (lower > max_rate)
+                    b->decided = -1;
+            }
+            undecided += !b->decided;
+        }
+    }
+
+    outer_loop = saved_outer_loop;
+
+    printf("Verification at %0.1f%% confidence, max mismatch rate %d%%:\n",
+            VERIFY_CONFIDENCE * 100, VERIFY_MAX_MISMATCH_PERCENTAGE);
+    for (bank = 0, refuted = 0, undecided = 0, total = 0; bank < MAX_BANKS; bank++) {
+        verify_bank_t *b = &vb[bank];
+
+        if (b->num_members == 0)
+            continue;
+
+        wilson_interval(b->mismatches, b->num_pairs, z, &lower, &upper);
+        printf("Bank: %d, Entries: %d, Pairs: %d, Mismatches: %d, Rate: %0.1f%% "
+                "(%0.1f%% - %0.1f%%), %s\n", bank, b->num_members, b->num_pairs,
+                b->mismatches, (b->mismatches * 100.0) / b->num_pairs,
+                lower * 100, upper * 100, b->decided == 1 ? "Confirmed" :
+                b->decided == -1 ? "Refuted" : "Undecided");
+
+        refuted += b->decided == -1;
+        undecided += b->decided == 0;
+        total += b->num_pairs;
+        free(b->members);
+        free(b->avgs);
+    }
+    free(diff_avgs);
+
+    printf("Verification: %d pairs timed, %d banks refuted, %d undecided\n",
+            total, refuted, undecided);
+
+    return refuted == 0 && undecided == 0;
+}
+
+#if (PROFILE_MODE == 1)
+typedef struct profile_sample {
+    uint64_t when;              // Ticks since start of profile
+    uint32_t ticks;
+    uint16_t bank;
+    bool spike;
+} profile_sample_t;
+
+typedef struct profile_bank {
+    int entries[2];             // Read in turn, in different rows if possible
+    double median;
+    double period_ns;           // Of spikes, 0 if not periodic
+    double autocorrelation;
+} profile_bank_t;
+
+// Latency of one uncached read of a. Sets when it started
+static uint64_t time_access(uint64_t a, uint64_t *when)
+{
+#if (SIMULATED_TIMING == 1)
+    return time_access_simulated(a, when);
+#else
+    uint64_t start_ticks, end_ticks;
+    int sum;
+
+    start_ticks = fencedStartTicks();
+    asm volatile ("movl (%1), %0\n\t" : "=r" (sum) : "r" (a) : "memory");
+    end_ticks = fencedEndTicks();
+    asm volatile ("clflush (%0)\n\t"
+                  "mfence\n\t" :: "r" (a) : "memory");
+
+    *when = start_ticks;
+    return end_ticks - start_ticks;
+#endif
+}
+
+/* Autocorrelation of the spike indicator of samples of bank (-1 for all) over
+ * lags in bins of PROFILE_BIN_NS. Samples are irregular, so every pair of
+ * samples up to PROFILE_MAX_PERIOD_NS apart counts towards the bin of its lag.
+ * Returns the period of the spikes in ns, 0 if not periodic
+ */
+static double spike_period(const profile_sample_t *samples, size_t num, int bank,
+                            double *autocorrelation)
+{
+    uint64_t max_lag = PROFILE_MAX_PERIOD_NS * tsc_per_ns, bin = PROFILE_BIN_NS * tsc_per_ns;
+    size_t num_bins = max_lag / bin + 1, min_bin = PROFILE_MIN_PERIOD_NS * tsc_per_ns / bin;
+    size_t i, j, lag;
+    uint64_t *pairs = calloc(num_bins, sizeof(uint64_t));
+    uint64_t *both = calloc(num_bins, sizeof(uint64_t));
+    double p, r, best = 0, *corr = calloc(num_bins, sizeof(double));
+    size_t spikes, total, best_lag = 0;
+
+    assert(pairs != NULL && both != NULL && corr != NULL);
+    *autocorrelation = 0;
+
+    for (i = 0, spikes = 0, total = 0; i < num; i++) {
+        if (bank >= 0 && samples[i].bank != bank)
+            continue;
+        total++;
+        spikes += samples[i].spike;
+
+        for (j = i + 1; j < num && samples[j].when - samples[i].when <= max_lag; j++) {
+            if (bank >= 0 && samples[j].bank != bank)
+                continue;
+            lag = (samples[j].when - samples[i].when) / bin;
+            pairs[lag]++;
+            both[lag] += samples[i].spike && samples[j].spike;
+        }
+    }
+
+    p = total ? (double)spikes / total : 0;
+    if (p == 0 || p == 1)
+        goto out;
+
+    // Too few pairs at a lag for even periodic spikes to coincide is noise
+    for (lag = min_bin; lag < num_bins; lag++) {
+        if (pairs[lag] * p < PROFILE_MIN_SPIKE_PAIRS)
+            continue;
+        corr[lag] = ((double)both[lag] / pairs[lag] - p * p) / (p - p * p);
+        corr[lag] = corr[lag] < 1 ? corr[lag] : 1;
+        best = corr[lag] > best ? corr[lag] : best;
+    }
+
+    // Multiples of the period correlate as well, take the first peak
+    for (lag = min_bin; lag < num_bins; lag++) {
+        r = corr[lag];
+        if (r >= 0.9 * best && r >= PROFILE_MIN_AUTOCORRELATION) {
+            for (best_lag = lag; lag + 1 < num_bins && corr[lag + 1] > corr[best_lag]; lag++)
+                best_lag = lag + 1;
+            *autocorrelation = corr[best_lag];
+            break;
+        }
+    }
+
+out:
+    free(pairs);
+    free(both);
+    free(corr);
+    return best_lag ? ((best_lag + 0.5) * bin) / tsc_per_ns : 0;
+}
+
+/* spike_period() is only as exact as PROFILE_BIN_NS, an error which builds up
+ * over the hundreds of periods of a profile. Fits the onsets of the spikes of
+ * bank (-1 for all) to a grid of period_ns by least squares, in two passes:
+ * Onsets counted from the previous one on the grid, then those close to the
+ * first fit, so that interrupts don't skew it. Returns the refined period in
+ * ns, and sets phase to the ticks of a spike onset
+ */
+static double refine_period(const profile_sample_t *samples, size_t num, int bank,
+                            double period_ns, double *phase)
+{
+    double period = period_ns * tsc_per_ns, t0 = 0, t, k, gap, sn, st, snn, snt, d;
+    uint64_t last_spike, prev_when;
+    int64_t prev_k;
+    size_t i, onsets;
+    int pass;
+
+    *phase = 0;
+    for (pass = 0; pass < 2; pass++) {
+        sn = st = snn = snt = 0;
+        onsets = 0;
+        last_spike = prev_when = prev_k = 0;
+
+        for (i = 0; i < num; i++) {
+            if ((bank >= 0 && samples[i].bank != bank) || !samples[i].spike)
+                continue;
+            // Spikes of the same refresh belong to its onset
+            if (onsets > 0 && samples[i].when - last_spike < period / 4) {
+                last_spike = samples[i].when;
+                continue;
+            }
+            last_spike = samples[i].when;
+
+            if (pass == 0) {
+                gap = (samples[i].when - prev_when) / period;
+                k = onsets > 0 ? prev_k + llround(gap) : 0;
+                if (onsets > 0 && fabs(gap - llround(gap)) > 0.125)
+                    continue;
+                prev_k = k;
+                prev_when = samples[i].when;
+            } else {
+                k = llround((samples[i].when - t0) / period);
+                if (fabs(samples[i].when - t0 - k * period) > period / 8)
+                    continue;
+            }
+
+            t = samples[i].when;
+            sn += k;
+            st += t;
+            snn += k * k;
+            snt += k * t;
+            onsets++;
+        }
+
+        d = onsets * snn - sn * sn;
+        if (onsets < 2 || d == 0)
+            return period_ns;
+        period = (onsets * snt - sn * st) / d;
+        t0 = (st - period * sn) / onsets;
+    }
+
+    *phase = t0;
+    return period / tsc_per_ns;
+}
+
+// Latency percentiles and histogram of every bank
+static void write_bank_histograms(FILE *fp, const profile_sample_t *samples,
+                                    size_t num, profile_bank_t *pbanks, int num_banks)
+{
+    uint32_t *ticks = malloc(PROFILE_SAMPLES_PER_BANK * sizeof(uint32_t));
+    uint64_t bucket_ticks = PROFILE_HIST_BUCKET_NS * tsc_per_ns, bucket;
+    size_t i, n, k, spikes;
+    int b;
+
+    assert(ticks != NULL);
+    bucket_ticks = bucket_ticks ? bucket_ticks : 1;
+    fprintf(fp, "bank,latency_ns,samples\n");
+
+    for (b = 0; b < num_banks; b++) {
+        for (i = 0, n = 0, spikes = 0; i < num; i++) {
+            if (samples[i].bank != b)
+                continue;
+            ticks[n++] = samples[i].ticks;
+            spikes += samples[i].spike;
+        }
+        if (n == 0)
+            continue;
+        qsort(ticks, n, sizeof(uint32_t), compare_u32);
+
+        printf("Bank: %d, Min: %0.1f ns, Median: %0.1f ns, P99: %0.1f ns, "
+                "Max: %0.1f ns, Spikes: %0.2f%%", b, ticks[0] / tsc_per_ns,
+                pbanks[b].median / tsc_per_ns, ticks[(n * 99) / 100] / tsc_per_ns,
+                ticks[n - 1] / tsc_per_ns, (spikes * 100.0) / n);
+        if (pbanks[b].period_ns != 0)
+            printf(", Period: %0.0f ns (%0.2f)", pbanks[b].period_ns,
+                    pbanks[b].autocorrelation);
+        printf("\n");
+
+        for (i = 0; i < n; i = k) {
+            bucket = ticks[i] / bucket_ticks;
+            for (k = i; k < n && ticks[k] / bucket_ticks == bucket; k++)
+                ;
+            fprintf(fp, "%d,%0.0f,%zu\n", b, (bucket * bucket_ticks) / tsc_per_ns, k - i);
+        }
+    }
+
+    free(ticks);
+}
+
+/* Mean latency of every bank per column: Phase within the spike period if
+ * there is one, else time window of the profile
+ */
+static void write_bank_heatmap(FILE *fp, const profile_sample_t *samples,
+                                size_t num, int num_banks, double period_ns, double phase)
+{
+    double span = period_ns != 0 ? period_ns * tsc_per_ns :
+                    (double)(samples[num - 1].when + 1);
+    double offset;
+    double *sum = calloc((size_t)num_banks * PROFILE_HEATMAP_COLUMNS, sizeof(double));
+    uint64_t *count = calloc((size_t)num_banks * PROFILE_HEATMAP_COLUMNS, sizeof(uint64_t));
+    size_t i, k;
+    int b, col;
+
+    assert(sum != NULL && count != NULL);
+
+    // Column 0 starts at a spike onset
+    for (i = 0; i < num; i++) {
+        offset = fmod((double)samples[i].when - phase, span);
+        offset = offset < 0 ? offset + span : offset;
+        col = (offset * PROFILE_HEATMAP_COLUMNS) / span;
+        col = col < PROFILE_HEATMAP_COLUMNS ? col : PROFILE_HEATMAP_COLUMNS - 1;
+        k = (size_t)samples[i].bank * PROFILE_HEATMAP_COLUMNS + col;
+        sum[k] += samples[i].ticks;
+        count[k]++;
+    }
+
+    fprintf(fp, "# Mean latency (ns) of bank per %s\n", period_ns != 0 ?
+            "phase within spike period" : "time window");
+    fprintf(fp, "bank");
+    for (col = 0; col < PROFILE_HEATMAP_COLUMNS; col++)
+        fprintf(fp, ",%0.0f", (col * span) / PROFILE_HEATMAP_COLUMNS / tsc_per_ns);
+    fprintf(fp, "\n");
+
+    for (b = 0; b < num_banks; b++) {
+        fprintf(fp, "%d", b);
+        for (col = 0; col < PROFILE_HEATMAP_COLUMNS; col++) {
+            k = (size_t)b * PROFILE_HEATMAP_COLUMNS + col;
+            if (count[k] != 0)
+                fprintf(fp, ",%0.1f", sum[k] / count[k] / tsc_per_ns);
+            else
+                fprintf(fp, ",");
+        }
+        fprintf(fp, "\n");
+    }
+
+    free(sum);
+    free(count);
+}
+
+// Picks two entries of bank in different rows, the same one twice if not found
+static int pick_profile_entries(int bank, int *pair)
+{
+    int i;
+
+    pair[0] = pair[1] = -1;
+    for (i = 0; i < NUM_ENTRIES; i++) {
+        if (phy_to_bank_mapping(entries[i].phy_addr) != bank)
+            continue;
+        if (pair[0] < 0) {
+            pair[0] = pair[1] = i;
+        } else if ((entries[i].phy_addr ^ entries[pair[0]].phy_addr) >> ROW_SHIFT) {
+            pair[1] = i;
+            break;
+        }
+    }
+
+    return pair[0] < 0 ? -1 : 0;
+}
+
+/* Reads every bank of the mapping in turn, so that all share a timeline, and
+ * writes their latency distributions and heatmap. Returns -1 on failure
+ */
+int run_profile(void)
+{
+    int num_banks = 1 << bank_mapping.num_fns, b, round;
+    size_t num = (size_t)num_banks * PROFILE_SAMPLES_PER_BANK, i, n;
+    profile_sample_t *samples = malloc(num * sizeof(profile_sample_t));
+    profile_bank_t *pbanks = calloc(num_banks, sizeof(profile_bank_t));
+    uint32_t *ticks = malloc(PROFILE_SAMPLES_PER_BANK * sizeof(uint32_t));
+    double period_ns, autocorrelation, phase = 0, bank_phase, multiple;
+    uint64_t start = 0, when;
+    FILE *fp;
+
+    assert(samples != NULL && pbanks != NULL && ticks != NULL);
+
+    for (b = 0; b < num_banks; b++) {
+        if (pick_profile_entries(b, pbanks[b].entries) < 0) {
+            eprint("No entry in bank %d\n", b);
+            free(samples);
+            free(pbanks);
+            free(ticks);
+            return -1;
+        }
+    }
+
+    PHASE_BEGIN(PHASE_SAMPLING);
+    for (round = 0, n = 0; round < PROFILE_SAMPLES_PER_BANK; round++) {
+        for (b = 0; b < num_banks; b++, n++) {
+            samples[n].ticks = time_access(entries[pbanks[b].entries[round & 1]].virt_addr,
+                                            &when);
+            start = n == 0 ? when : start;
+            samples[n].when = when - start;
+            samples[n].bank = b;
+        }
+    }
+    PHASE_END(PHASE_SAMPLING);
+
+    // Spikes are relative to the bank's median
+    for (b = 0; b < num_banks; b++) {
+        for (i = b, n = 0; i < num; i += num_banks)
+            ticks[n++] = samples[i].ticks;
+        qsort(ticks, n, sizeof(uint32_t), compare_u32);
+        pbanks[b].median = ticks[n / 2];
+        for (i = b; i < num; i += num_banks)
+            samples[i].spike = samples[i].ticks >
+                                (pbanks[b].median * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+        pbanks[b].period_ns = spike_period(samples, num, b, &pbanks[b].autocorrelation);
+    }
+
+    period_ns = spike_period(samples, num, -1, &autocorrelation);
+    if (period_ns != 0)
+        period_ns = refine_period(samples, num, -1, period_ns, &phase);
+
+    /* Sparse samples of a bank often miss the lag bins of the period, so that
+     * a multiple of it comes first. Banks with a multiple of the shared
+     * period take it, as its fit has the onsets of all banks
+     */
+    for (b = 0; b < num_banks && period_ns != 0; b++) {
+        if (pbanks[b].period_ns == 0)
+            continue;
+        multiple = llround(pbanks[b].period_ns / period_ns);
+        if (multiple >= 1 &&
+                fabs(pbanks[b].period_ns - multiple * period_ns) <= multiple * PROFILE_BIN_NS)
+            pbanks[b].period_ns = period_ns;
+        else
+            pbanks[b].period_ns = refine_period(samples, num, b, pbanks[b].period_ns,
+                                                &bank_phase);
+    }
+
+    printf("Profile: Banks: %d, Samples: %zu, Duration: %0.0f us\n", num_banks, num,
+            samples[num - 1].when / tsc_per_ns / 1000);
+    if (period_ns != 0)
+        printf("Periodic spikes: Period: %0.0f ns, Autocorrelation: %0.2f\n",
+                period_ns, autocorrelation);
+    else
+        printf("No periodic spikes\n");
+
+    fp = fopen(PROFILE_HIST_FILE, "w");
+    if (fp != NULL) {
+        write_bank_histograms(fp, samples, num, pbanks, num_banks);
+        fclose(fp);
+    }
+    fp = fopen(PROFILE_HEATMAP_FILE, "w");
+    if (fp != NULL) {
+        write_bank_heatmap(fp, samples, num, num_banks, period_ns, phase);
+        fclose(fp);
+    }
+    printf("Histograms: %s, Heatmap: %s\n", PROFILE_HIST_FILE, PROFILE_HEATMAP_FILE);
+
+    free(samples);
+    free(pbanks);
+    free(ticks);
+    return 0;
+}
+#endif /* PROFILE_MODE == 1 */
+
+#if (ROW_POLICY_MODE == 1)
+typedef struct row_policy_point {
+    double delay_ns;
+    double hit_ns;              // Median latency after a read of the same row
+    double conflict_ns;         // Median latency after a read of another row
+} row_policy_point_t;
+
+// Reads x, waits delay ticks and returns the latency of then reading y, both
+// uncached
+static uint64_t time_after(uint64_t x, uint64_t y, uint64_t delay)
+{
+#if (SIMULATED_TIMING == 1)
+    time_row_access_simulated(x);
+    sim_clock += delay;
+    return time_row_access_simulated(y);
+#else
+    uint64_t start_ticks, end_ticks;
+    int sum;
+
+    asm volatile ("clflush (%0)\n\t"
+                  "clflush (%1)\n\t"
+                  "mfence\n\t" :: "r" (x), "r" (y) : "memory");
+    // lfence waits for the read of x to finish before the delay starts
+    asm volatile ("addl (%1), %0\n\t"
+                  "lfence\n\t" : "=r" (sum) : "r" (x) : "memory");
+    start_ticks = currentTicks();
+    while (currentTicks() - start_ticks < delay)
+        ;
+
+    start_ticks = fencedStartTicks();
+    asm volatile ("addl (%1), %0\n\t" : "=r" (sum) : "r" (y) : "memory");
+    end_ticks = fencedEndTicks();
+
+    return end_ticks - start_ticks;
+#endif
+}
+
+/* Picks an entry of the mapping with another entry of its bank in the same
+ * row and one in another row, the latter confirmed to conflict with it by
+ * measure_pair(). Returns -1 if there is none
+ */
+static int pick_row_policy_entries(int *same_row, int *other_row)
+{
+    uintptr_t a = entries[0].virt_addr;
+    double threshold, conflict, base;
+    int i, j, bank, other_bank, tries;
+
+    threshold = find_read_time((void *)a, (void *)(a + sizeof(uint64_t)), LONG_MAX);
+    threshold *= threshold_multiplier;
+
+    for (i = 0, tries = 0; i < NUM_ENTRIES && tries < ROW_POLICY_CANDIDATES; i++) {
+        bank = phy_to_bank_mapping(entries[i].phy_addr);
+        *same_row = *other_row = other_bank = -1;
+        for (j = 0; j < NUM_ENTRIES; j++) {
+            if (j == i)
+                continue;
+            if (phy_to_bank_mapping(entries[j].phy_addr) != bank) {
+                other_bank = other_bank < 0 ? j : other_bank;
+            } else if ((entries[i].phy_addr ^ entries[j].phy_addr) >> ROW_SHIFT) {
+                *other_row = *other_row < 0 ? j : *other_row;
+            } else {
+                *same_row = *same_row < 0 ? j : *same_row;
+            }
+        }
+        if (*same_row < 0 || *other_row < 0 || other_bank < 0)
+            continue;
+
+        tries++;
+        conflict = measure_pair((void *)entries[i].virt_addr,
+                                (void *)entries[*other_row].virt_addr, threshold);
+        base = measure_pair((void *)entries[i].virt_addr,
+                            (void *)entries[other_bank].virt_addr, threshold);
+        if (conflict != 0 && base != 0 &&
+                conflict > (base * (100.0 + OUTLIER_PERCENTAGE)) / 100.0)
+            return i;
+
+        dprintf("No conflict: PhyAddr1: 0x%lx, PhyAddr2: 0x%lx\n",
+                entries[i].phy_addr, entries[*other_row].phy_addr);
+    }
+
+    return -1;
+}
+
+/* Times row hits and conflicts over the delays between the reads, and infers
+ * the page policy and the closing timeout. Returns -1 on failure
+ */
+int run_row_policy(void)
+{
+    int num_points = 2 + (int)(ROW_POLICY_STEPS_PER_DECADE *
+                        log10((double)ROW_POLICY_MAX_DELAY_NS / ROW_POLICY_MIN_DELAY_NS));
+    row_policy_point_t *points = calloc(num_points, sizeof(row_policy_point_t));
+    uint32_t *hits = malloc(ROW_POLICY_SAMPLES * sizeof(uint32_t));
+    uint32_t *conflicts = malloc(ROW_POLICY_SAMPLES * sizeof(uint32_t));
+    uint64_t a, same, other, delay;
+    double gap, miss_ns;
+    int i, p, s, same_row, other_row, closed, num_closed;
+
+    assert(points != NULL && hits != NULL && conflicts != NULL);
+
+    i = pick_row_policy_entries(&same_row, &other_row);
+    if (i < 0) {
+        eprint("No entry with a row conflict in its bank\n");
+        return -1;
+    }
+    a = entries[i].virt_addr;
+    same = entries[same_row].virt_addr;
+    other = entries[other_row].virt_addr;
+    printf("Row policy: Bank: %d, PhyAddr: 0x%lx, Same row: 0x%lx, Other row: 0x%lx\n",
+            phy_to_bank_mapping(entries[i].phy_addr), entries[i].phy_addr,
+            entries[same_row].phy_addr, entries[other_row].phy_addr);
+
+    PHASE_BEGIN(PHASE_SAMPLING);
+    for (p = 0; p < num_points; p++) {
+        points[p].delay_ns = p == 0 ? 0 : ROW_POLICY_MIN_DELAY_NS *
+                                pow(10, (p - 1) / (double)ROW_POLICY_STEPS_PER_DECADE);
+        delay = points[p].delay_ns * tsc_per_ns;
+
+        // Interleaved, so that both see the same interference
+        for (s = 0; s < ROW_POLICY_SAMPLES; s++) {
+            hits[s] = time_after(same, a, delay);
+            conflicts[s] = time_after(other, a, delay);
+        }
+        qsort(hits, ROW_POLICY_SAMPLES, sizeof(uint32_t), compare_u32);
+        qsort(conflicts, ROW_POLICY_SAMPLES, sizeof(uint32_t), compare_u32);
+        points[p].hit_ns = hits[ROW_POLICY_SAMPLES / 2] / tsc_per_ns;
+        points[p].conflict_ns = conflicts[ROW_POLICY_SAMPLES / 2] / tsc_per_ns;
+
+        printf("Delay: %8.0f ns,\tHit: %6.1f ns,\tConflict: %6.1f ns\n",
+                points[p].delay_ns, points[p].hit_ns, points[p].conflict_ns);
+    }
+    PHASE_END(PHASE_SAMPLING);
+
+    // The row is closed from the first delay at which the gap has halved
+    gap = points[0].conflict_ns - points[0].hit_ns;
+    for (closed = 0; closed < num_points && gap >= ROW_POLICY_MIN_GAP_NS; closed++) {
+        if (points[closed].conflict_ns - points[closed].hit_ns < gap / 2)
+            break;
+    }
+
+    // Hits and conflicts are both misses once closed
+    for (p = closed, miss_ns = 0, num_closed = 0; p < num_points; p++, num_closed++)
+        miss_ns += (points[p].hit_ns + points[p].conflict_ns) / 2;
+    miss_ns = num_closed != 0 ? miss_ns / num_closed : 0;
+
+    if (closed == 0) {
+        printf("Page policy: Closed (or closing within %0.0f ns), Row miss: %0.1f ns\n",
+                points[1].delay_ns, miss_ns);
+    } else if (closed == num_points) {
+        printf("Page policy: Open, not closing within %0.0f ns\n",
+                points[num_points - 1].delay_ns);
+        printf("Row hit: %0.1f ns, Row conflict: %0.1f ns, Conflict - Hit: %0.1f ns\n",
+                points[0].hit_ns, points[0].conflict_ns, gap);
+    } else {
+        printf("Page policy: Open, Closing timeout: %0.0f - %0.0f ns\n",
+                points[closed - 1].delay_ns, points[closed].delay_ns);
+        printf("Row hit: %0.1f ns, Row miss: %0.1f ns, Row conflict: %0.1f ns\n",
+                points[0].hit_ns, miss_ns, points[0].conflict_ns);
+        // Roughly tRCD and tRP, on top of the latency of the rest of the path
+        printf("Miss - Hit (activate): %0.1f ns, Conflict - Miss (precharge): %0.1f ns\n",
+                miss_ns - points[0].hit_ns, points[0].conflict_ns - miss_ns);
+    }
+
+    free(points);
+    free(hits);
+    free(conflicts);
+    return 0;
+}
+#endif /* ROW_POLICY_MODE == 1 */
+
+
+#if (MAPPING_DB == 1)
+/*
+ * Looks up the machine in MAPPING_DB_FILE. On a hit, the stored mapping
+ * becomes the hypothesis and is verified. Returns 1 if verified, 0 if it
+ * needs to be discovered
+ */
+static int lookup_mapping_db(uint64_t *key, char *descr, size_t len)
+{
+    bank_mapping_t m;
+    FILE *fp;
+    int ret;
+
+    *key = hw_fingerprint(descr, len);
+    printf("Fingerprint: %016lx %s\n", *key, descr);
+
+    fp = fopen(MAPPING_DB_FILE, "r");
+    if (fp == NULL) {
+        printf("Machine not in mapping database\n");
+        return 0;
+    }
+    ret = read_mapping(fp, key, &m);
+    fclose(fp);
+    if (ret <= 0) {
+        printf("Machine not in mapping database\n");
+        return 0;
+    }
+
+    bank_mapping = m;
+    if (verify_mapping() == 1) {
+        printf("Stored mapping verified:\n");
+        write_mapping(stdout, &bank_mapping);
+        return 1;
+    }
+
+    eprint("Stored mapping failed verification, rediscovering\n");
+    return 0;
+}
+
+#endif /* MAPPING_DB == 1 */
+
+#if (MAPPING_DB == 1) || (VERIFY_MODE == 1) || (INCREMENTAL_MODE == 1) || \
+    (PROFILE_MODE == 1) || (ROW_POLICY_MODE == 1) || (CHANNEL_PROBE_MODE == 1)
+// Hypothesis for discovery: MAPPING_FILE if present, else the built in one
+static void load_mapping_hypothesis(void)
+{
+    bank_mapping_t def = DEFAULT_BANK_MAPPING;
+    FILE *fp = fopen(MAPPING_FILE, "r");
+
+    bank_mapping = def;
+    if (fp == NULL)
+        return;
+
+    if (read_mapping(fp, NULL, &bank_mapping) <= 0) {
+        eprint("No mapping in %s, using built in hypothesis\n", MAPPING_FILE);
+        bank_mapping = def;
+    } else {
+        printf("Hypothesis from %s\n", MAPPING_FILE);
+    }
+    fclose(fp);
+}
+#endif
+
+#if (MAPPING_DB == 1)
+/*
+ * Stores the mapping of key, replacing its previous record (which failed
+ * verification), as readers take the first record of a key. The database is
+ * rewritten into a temporary file and renamed over the old one
+ */
+static int store_mapping(uint64_t key, const char *descr)
+{
+    FILE *in = fopen(MAPPING_DB_FILE, "r"), *out;
+    char tmp[sizeof(MAPPING_DB_FILE) + 4], *line = NULL;
+    uint64_t line_key;
+    bool skip = false;
+    size_t len = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", MAPPING_DB_FILE);
+    out = fopen(tmp, "w");
+    if (out == NULL) {
+        eprint("Couldn't open %s\n", tmp);
+        if (in != NULL)
+            fclose(in);
+        return -1;
+    }
+
+    while (in != NULL && getline(&line, &len, in) != -1) {
+        if (sscanf(line, "Fingerprint: %lx", &line_key) == 1)
+            skip = line_key == key;
+        if (!skip)
+            fputs(line, out);
+    }
+    free(line);
+    if (in != NULL)
+        fclose(in);
+
+    fprintf(out, "Fingerprint: %016lx %s\n", key, descr);
+    write_mapping(out, &bank_mapping);
+    if (fclose(out) != 0 || rename(tmp, MAPPING_DB_FILE) < 0) {
+        eprint("Couldn't write %s\n", MAPPING_DB_FILE);
+        unlink(tmp);
+        return -1;
+    }
+
+    printf("Mapping stored in %s\n", MAPPING_DB_FILE);
+    return 0;
+}
+#endif /* MAPPING_DB == 1 */
+
+#if (INCREMENTAL_MODE == 1)
+// Bank of the previous result, or found among the new entries
+typedef struct inc_group {
+    int rep;                    // Entry others are placed against
+    int companion;              // Entry conflicting with rep, so in another row
+    int label;                  // Bank by previous functions, -1 if a new bank
+} inc_group_t;
+
+// Slot of a hash table of the entries placed so far
+typedef struct inc_slot {
+    uint64_t key;
+    int value;
+    bool used;
+} inc_slot_t;
+
+static inc_group_t inc_groups[MAX_BANKS];
+static int num_inc_groups;
+static int *inc_entry_group;
+// New bits of entries (relative to entries[0]) to their measured bank XOR
+// predicted bank, -1 if in a new bank
+static inc_slot_t *inc_patterns;
+// New bits and bank by previous functions to group. As functions are XORs,
+// entries with both the same are in the same bank
+static inc_slot_t *inc_placements;
+static size_t inc_slots;
+
+// Reads the functions and the bits the sets of a previous result vary in.
+// Returns the number of functions, 0 if there is no result
+static int load_result(const char *fname, bank_mapping_t *m, uint64_t *bits)
+{
+    FILE *fp = fopen(fname, "r");
+    uint64_t addr, first = 0;
+    char *line = NULL;
+    size_t len = 0;
+    bool found = false;
+    int ret;
+
+    if (fp == NULL)
+        return 0;
+
+    ret = read_mapping(fp, NULL, m);
+    rewind(fp);
+
+    for (*bits = 0; getline(&line, &len, fp) != -1; ) {
+        if (sscanf(line, "0x%lx", &addr) != 1)
+            continue;
+        first = found ? first : addr;
+        found = true;
+        *bits |= addr ^ first;
+    }
+
+    free(line);
+    fclose(fp);
+    return found ? ret : 0;
+}
+
+// Functions followed by the sets of sibling entries
+static int write_result(const char *fname)
+{
+    FILE *fp = fopen(fname, "w");
+
+    if (fp == NULL) {
+        eprint("Couldn't open %s: %s\n", fname, strerror(errno));
+        return -1;
     }
 
-    return NULL;
+    write_mapping(fp, &bank_mapping);
+    write_entry_sets(fp);
+    fclose(fp);
+
+    printf("Result written to %s\n", fname);
+    return 0;
 }
 
-void print_binary(uint64_t v)
+static inc_slot_t *find_inc_slot(inc_slot_t *table, uint64_t key)
 {
-    char buffer[100];
-    int index;
-
-    buffer[99] = '\0';
-    for (index = 98; v > 0; index--) {
-        if (v & 1)
-            buffer[index] = '1';
-        else
-            buffer[index] = '0';
+    size_t slot = (key * 0x9e3779b97f4a7c15ULL) % inc_slots;
 
-        v = v >> 1;
-    }
+    while (table[slot].used && table[slot].key != key)
+        slot = (slot + 1) % inc_slots;
 
-    printf("%s", &buffer[index + 1]);
+    return &table[slot];
 }
 
-void run_exp(uint64_t virt_start, uint64_t phy_start)
+static bool inc_conflict(int a, int b, double threshold, double conflict_level)
 {
-    uintptr_t a, b;
-    double threshold = LONG_MAX;
-    double avg, sum, running_avg, running_threshold, nearest_nonoutlier;
-    double *avgs;
-    int i, j, k, num_outlier;
+    return measure_pair((void *)entries[a].virt_addr, (void *)entries[b].virt_addr,
+                        threshold) >= conflict_level;
+}
 
-    // Warm up - Get refined threshold 
-    a = virt_start;
-    b = a + sizeof(uint64_t);
-    avg = find_read_time((void *)a, (void *)b, threshold);
-    threshold = avg * THRESHOLD_MULTIPLIER;
+static bool inc_in_group(const inc_group_t *g, int e, double threshold,
+                            double conflict_level)
+{
+    // Entries in the row of rep don't conflict with it, but with companion
+    return inc_conflict(g->rep, e, threshold, conflict_level) ||
+            (g->companion >= 0 && inc_conflict(g->companion, e, threshold, conflict_level));
+}
 
-    dprintf("Threshold is %f\n", threshold);
+/* Adds a group for rep. Entries with the same new bits and the same bank by
+ * the previous functions are in the same bank, the first of them conflicting
+ * with rep becomes the companion
+ */
+static inc_group_t *add_inc_group(int rep, int label, const bank_mapping_t *prev,
+                                    uint64_t new_mask, double threshold,
+                                    double conflict_level)
+{
+    uint64_t bits = (entries[rep].phy_addr ^ entries[0].phy_addr) & new_mask;
+    int prev_bank = mapping_bank(prev, entries[rep].phy_addr), e, tries;
+    inc_group_t *g;
 
-    avgs = calloc(sizeof(double), NUM_ENTRIES);
-    assert(avgs != NULL);
+    if (num_inc_groups == MAX_BANKS)
+        return NULL;
 
-    for (i = 0; i < NUM_ENTRIES; i++) {
+    g = &inc_groups[num_inc_groups];
+    g->rep = rep;
+    g->label = label;
+    g->companion = -1;
+    inc_entry_group[rep] = num_inc_groups++;
 
-        entry_t *entry = &entries[i]; 
-        int sub_entries = NUM_ENTRIES - (i + 1);
-        
-        if (entry->associated)
+    for (e = 0, tries = 0; e < NUM_ENTRIES && tries < INCREMENTAL_COMPANION_TRIES; e++) {
+        if (e == rep || mapping_bank(prev, entries[e].phy_addr) != prev_bank ||
+                ((entries[e].phy_addr ^ entries[0].phy_addr) & new_mask) != bits)
             continue;
 
-        dprintf("Master Entry: %d\n", i);
-        
-        for (j = i + 1, sum = 0; j < NUM_ENTRIES; j++) {
-            a = entries[i].virt_addr;
-            b = entries[j].virt_addr;
-            dprintf("Reading Time: PhyAddr1: 0x%lx,\t PhyAddr2:0x%lx\n",
-                    entries[i].phy_addr, entries[j].phy_addr);
-            avgs[j] = find_read_time((void *)a, (void *)b, threshold);
-            sum += avgs[j];
+        tries++;
+        if (inc_conflict(rep, e, threshold, conflict_level)) {
+            g->companion = e;
+            break;
         }
+    }
 
-        running_avg = sum / sub_entries;
-        running_threshold = (running_avg * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
-        entry->associated = false;
-        for (j = i + 1, num_outlier = 0, nearest_nonoutlier = 0;
-                j < NUM_ENTRIES; j++) {
-            if (avgs[j] >= running_threshold) {
-                if (entries[j].associated) {
-                    /* Could be in the same bank and same row */
-                    if (phy_to_bank_mapping(entry->phy_addr) ==
-                             phy_to_bank_mapping(entries[j].siblings[0]->phy_addr)) {
-                        entry_t *prior_entry = entries[j].siblings[0];
-                        int siblings = prior_entry->num_sibling;
-                        prior_entry->siblings[siblings] = entry;
-                        prior_entry->num_sibling++;
-                        entry->associated = true;
-                        entry->num_sibling = 1;
-                        entry->siblings[0] = prior_entry;
-                        
-                        printf("Assuming lie on same bank:0x%lx, 0x%lx\n",
-                                prior_entry->phy_addr, entry->phy_addr);
-                        break;
-                        
-                    } else {
-                        eprint("Entry being mapped to multiple siblings\n");
-                        eprint("Entry: PhyAddr: 0x%lx,"
-                                " Prior Sibling: PhyAddr: 0x%lx,"
-                                " Current Sibling: PhyAddr: 0x%lx\n",
-                                entries[j].phy_addr, entries[j].siblings[0]->phy_addr,
-                                entry->phy_addr);
-                    } 
-                } else {
-                    entry->siblings[num_outlier] = &entries[j];
-                    num_outlier++;
-                    entries[j].associated = true;
-                    entries[j].siblings[0] = entry;
-                    entries[j].num_sibling = 1;
-                }   
-            } else {
-                nearest_nonoutlier = avgs[j] > nearest_nonoutlier ?
-                                    avgs[j] : nearest_nonoutlier;
-            }
+    // Likely if rows are above the bits the entries vary in
+    if (g->companion < 0)
+        dprintf("No entry in another row of bank of 0x%lx\n", entries[rep].phy_addr);
+
+    return g;
+}
+
+/* Places a new entry in a group: The group of an entry with the same new bits
+ * and previous bank if any, else by timing, trying first the group predicted by
+ * entries with the same new bits. Starts a new group if it is in none
+ */
+static int place_entry(int e, const bank_mapping_t *prev, uint64_t new_mask,
+                        double threshold, double conflict_level)
+{
+    uint64_t bits = (entries[e].phy_addr ^ entries[0].phy_addr) & new_mask;
+    int prev_bank = mapping_bank(prev, entries[e].phy_addr), g, pass;
+    uint64_t key = bits | ((uint64_t)prev_bank << 56);
+    inc_slot_t *placed = find_inc_slot(inc_placements, key);
+    inc_slot_t *pat = find_inc_slot(inc_patterns, bits);
+    bool prefer_new = pat->used && pat->value < 0, new_group;
+    int predicted = pat->used && pat->value >= 0 ? prev_bank ^ pat->value : -1;
+    inc_group_t *group;
+
+    if (placed->used) {
+        inc_entry_group[e] = placed->value;
+        return placed->value;
+    }
+
+    for (g = 0; g < num_inc_groups && predicted >= 0; g++) {
+        if (inc_groups[g].label == predicted &&
+                inc_in_group(&inc_groups[g], e, threshold, conflict_level))
+            goto placed;
+    }
+
+    // New banks first if the new bits are known to be in them
+    for (pass = 0; pass < 2; pass++) {
+        for (g = 0; g < num_inc_groups; g++) {
+            new_group = inc_groups[g].label < 0;
+            // Predicted group is tried already
+            if (new_group != (pass == 0 ? prefer_new : !prefer_new) ||
+                    (predicted >= 0 && inc_groups[g].label == predicted))
+                continue;
+            if (inc_in_group(&inc_groups[g], e, threshold, conflict_level))
+                goto placed;
         }
+    }
+
+    group = add_inc_group(e, -1, prev, new_mask, threshold, conflict_level);
+    if (group == NULL)
+        return -1;
+    g = group - inc_groups;
+
+placed:
+    inc_entry_group[e] = g;
+    placed->used = true;
+    placed->key = key;
+    placed->value = g;
+
+    new_group = inc_groups[g].label < 0;
+    if (!pat->used) {
+        pat->used = true;
+        pat->key = bits;
+        pat->value = new_group ? -1 : inc_groups[g].label ^ prev_bank;
+    } else if (pat->value != (new_group ? -1 : inc_groups[g].label ^ prev_bank)) {
+        eprint("Entries with same new bits in unrelated banks: 0x%lx\n",
+                entries[e].phy_addr);
+    }
+
+    return g;
+}
 
-        if (entry->associated == false) {
-            entry->num_sibling = num_outlier;
-                
-            for (k = 0; k < entry->num_sibling; k++) {
-                printf("Siblings: PhyAddr: 0x%lx\tPhyAddr: 0x%lx\t\t", entry->phy_addr, 
-                    entry->siblings[k]->phy_addr);
-                print_binary(entry->siblings[k]->phy_addr);
-                printf("\n");
+/* Solves parity(x[j] & s) == y[j] for all j. Unconstrained bits of s are 0.
+ * Returns -1 if there is no solution
+ */
+static int solve_gf2(const uint64_t *x, const int *y, size_t n, uint64_t *s)
+{
+    uint64_t rows[64] = {0}, v;
+    int rhs[64] = {0}, r, bit;
+    size_t j;
+
+    for (j = 0; j < n; j++) {
+        for (v = x[j], r = y[j], bit = 63; bit >= 0 && v; bit--) {
+            if (!((v >> bit) & 1))
+                continue;
+            if (rows[bit] == 0) {
+                rows[bit] = v;
+                rhs[bit] = r;
+                break;
             }
+            v ^= rows[bit];
+            r ^= rhs[bit];
         }
-        
-        dprintf("Nearest Nonoutlier: %f, Avg: %f, Threshold: %f\n",
-                nearest_nonoutlier, running_avg, running_threshold);
-        dprintf("Found %d siblings\n", num_outlier);
+        if (v == 0 && r != 0)
+            return -1;
     }
 
-    free(avgs);
-}
+    // Pivot of every row is its highest bit
+    for (bit = 0, *s = 0; bit < 64; bit++) {
+        if (rows[bit] != 0 &&
+                (rhs[bit] ^ __builtin_parityll(rows[bit] & *s)))
+            *s |= ADDR_BIT(bit);
+    }
 
+    return 0;
+}
 
-// Checks mapping/hypothesis
-// TODO: Check if all the bits of address have been accounted for
-void check_mapping(void)
+// Functions extended by the new bits, from the patterns seen
+static int extend_functions(const bank_mapping_t *prev, uint64_t new_mask,
+                            bank_mapping_t *ext)
 {
-    int i, j;
-    int main_bank, bank;
+    uint64_t *x = malloc(inc_slots * sizeof(uint64_t)), s;
+    int *y = malloc(inc_slots * sizeof(int));
+    size_t slot, n;
+    bool any_new = false;
+    int i, bit, ret = 0;
 
-    for (i = 0; i < NUM_ENTRIES; i++) {
-        entry_t *entry = &entries[i];
+    assert(x != NULL && y != NULL);
+    *ext = *prev;
 
-        // Look for only master siblings
-        if (entry->associated == true)
-            continue;
+    for (i = 0; i <= prev->num_fns; i++) {
+        for (slot = 0, n = 0; slot < inc_slots; slot++) {
+            const inc_slot_t *pat = &inc_patterns[slot];
 
-        main_bank = phy_to_bank_mapping(entry->phy_addr);
-        entry->bank = main_bank;
-        for (j = 0; j < entry->num_sibling; j++) {
-            entry_t *sibling = entry->siblings[j];
-            bank = phy_to_bank_mapping(sibling->phy_addr);
-            sibling->bank = bank;
-            if (bank != main_bank) {
-                eprint("Banks not match for siblings\n");
-                eprint("Main: PhyAddr: 0x%lx Bank:%d, "
-                                "Sibling: PhyAddr: 0x%lx Bank: %d\n",
-                                entry->phy_addr, main_bank,
-                                sibling->phy_addr, bank);
-            }
+            if (!pat->used)
+                continue;
+            any_new |= pat->value < 0;
+            // Previous banks give the changes of the functions, new banks
+            // the one new function
+            if (i < prev->num_fns && pat->value < 0)
+                continue;
+            x[n] = pat->key;
+            y[n++] = i == prev->num_fns ? pat->value < 0 : (pat->value >> i) & 1;
         }
 
-        if (banks[main_bank].main_entry != NULL) {
-            eprint("Multiple entries belong to same bank\n");
-            eprint("Hypothesis might be insufficient\n");
-            eprint("Bank: %d, Earlier Main Entry: PhyAddr: 0x%lx, "
-                            "Current Main Entry: PhyAddr: 0x:%lx\n",
-                            main_bank, banks[main_bank].main_entry->phy_addr,
-                            entry->phy_addr);
+        if (i == prev->num_fns && !any_new)
+            break;
+
+        if (solve_gf2(x, y, n, &s) < 0) {
+            if (i == prev->num_fns)
+                eprint("New banks are not given by one new XOR function\n");
+            else
+                eprint("New bits don't enter function %d as XOR\n", i);
+            ret = -1;
+            break;
+        }
+
+        if (i == prev->num_fns) {
+            if (ext->num_fns == MAX_MAPPING_FNS) {
+                eprint("More than %d functions\n", MAX_MAPPING_FNS);
+                ret = -1;
+                break;
+            }
+            ext->fns[ext->num_fns++] = s;
         } else {
-            banks[main_bank].main_entry = entry;
+            ext->fns[i] ^= s;
         }
-    }
 
-    // All entries should be assigned a bank
-    for (i = 0; i < NUM_ENTRIES; i++) {
-        entry_t *entry = &entries[i];
-        if (entry->bank < 0) {
-            eprint("Entry not assigned any bank: PhyAddr: 0x%lx\n",
-                    entry->phy_addr);
+        if (s == 0)
+            continue;
+        printf("Function %d, New bits:", i);
+        for (bit = 0; bit < 64; bit++) {
+            if ((s >> bit) & 1)
+                printf(" %d", bit);
         }
+        printf("\n");
+    }
 
-        if (entry->associated)
+    free(x);
+    free(y);
+    return ret;
+}
+
+// Groups become sets of siblings, with their rep as master
+static void inc_groups_to_entries(void)
+{
+    entry_t *master;
+    int e;
+
+    for (e = 0; e < NUM_ENTRIES; e++) {
+        master = &entries[inc_groups[inc_entry_group[e]].rep];
+        if (master == &entries[e])
             continue;
 
-        printf("Sets of sibling entries:\n");
-        printf("Bank: %d, PhyAddr: 0x%lx\t\t", entry->bank, entry->phy_addr);
-        print_binary(entry->phy_addr);
-        printf("\n");
-        
-        for (j = 0; j < entry->num_sibling; j++) {
-            printf("Bank: %d, PhyAddr: 0x%lx\t\t", entry->bank, 
-                    entry->siblings[j]->phy_addr);
-            print_binary(entry->siblings[j]->phy_addr);
-            printf("\n");
+        master->siblings[master->num_sibling++] = &entries[e];
+        entries[e].associated = true;
+        entries[e].siblings[0] = master;
+        entries[e].num_sibling = 1;
+    }
+}
+
+/* Extends the previous functions to the bits the region newly varies in.
+ * Returns -1 if they can't be extended
+ */
+static int extend_mapping(uint64_t virt_start, const bank_mapping_t *prev,
+                            uint64_t old_bits)
+{
+    uint64_t new_mask = 0, pairs = sched_stats.pairs;
+    double threshold, conflict_level, *baseline;
+    int reps[MAX_BANKS], num_banks = 1 << prev->num_fns;
+    int e, b, num_baseline, num_new, ret = -1;
+
+    for (e = 0; e < NUM_ENTRIES; e++)
+        new_mask |= entries[e].phy_addr ^ entries[0].phy_addr;
+    new_mask &= ~old_bits;
+
+    // Warm up - Get refined threshold
+    threshold = find_read_time((void *)virt_start,
+                                (void *)(virt_start + sizeof(uint64_t)), LONG_MAX);
+    threshold *= threshold_multiplier;
+
+    PHASE_BEGIN(PHASE_ASSOCIATION);
+
+    num_inc_groups = 0;
+    inc_slots = 2 * NUM_ENTRIES;
+    inc_entry_group = malloc(NUM_ENTRIES * sizeof(int));
+    inc_patterns = calloc(inc_slots, sizeof(inc_slot_t));
+    inc_placements = calloc(inc_slots, sizeof(inc_slot_t));
+    baseline = calloc(INCREMENTAL_BASELINE_PAIRS, sizeof(double));
+    assert(inc_entry_group != NULL && inc_patterns != NULL &&
+            inc_placements != NULL && baseline != NULL);
+    for (e = 0; e < NUM_ENTRIES; e++)
+        inc_entry_group[e] = -1;
+
+    // One rep per previous bank, among entries varying in old bits only
+    for (b = 0; b < num_banks; b++) {
+        for (e = 0; e < NUM_ENTRIES; e++) {
+            if (((entries[e].phy_addr ^ entries[0].phy_addr) & new_mask) == 0 &&
+                    mapping_bank(prev, entries[e].phy_addr) == b)
+                break;
+        }
+        if (e == NUM_ENTRIES) {
+            eprint("No entry of previous bank %d in region\n", b);
+            goto out;
         }
+        reps[b] = e;
     }
 
-    // Print bank stats
-    printf("Banks in use: Total Entries: %d\n", NUM_ENTRIES);
-    for (i = 0; i < MAX_BANKS; i++) {
-        if (banks[i].main_entry == NULL)
+    // Reps are in different banks
+    for (b = 0, num_baseline = 0; b + 1 < num_banks &&
+            num_baseline < INCREMENTAL_BASELINE_PAIRS; b++) {
+        baseline[num_baseline] = measure_pair((void *)entries[reps[b]].virt_addr,
+                                    (void *)entries[reps[b + 1]].virt_addr, threshold);
+        num_baseline += baseline[num_baseline] != 0;
+    }
+    if (num_baseline == 0) {
+        eprint("Not enough banks for a baseline\n");
+        goto out;
+    }
+    qsort(baseline, num_baseline, sizeof(double), compare_double);
+    conflict_level = (baseline[num_baseline / 2] * (100.0 + OUTLIER_PERCENTAGE)) / 100.0;
+
+    for (b = 0; b < num_banks; b++)
+        add_inc_group(reps[b], b, prev, new_mask, threshold, conflict_level);
+
+    // Old entries by the previous functions, new ones by timing
+    for (e = 0, num_new = 0; e < NUM_ENTRIES; e++) {
+        if (inc_entry_group[e] >= 0)
             continue;
-        
-        printf("Bank:%d, Entries:%d\n", i, banks[i].main_entry->num_sibling + 1);
+        if (((entries[e].phy_addr ^ entries[0].phy_addr) & new_mask) == 0) {
+            inc_entry_group[e] = mapping_bank(prev, entries[e].phy_addr);
+            continue;
+        }
+        num_new++;
+        if (place_entry(e, prev, new_mask, threshold, conflict_level) < 0) {
+            eprint("More than %d banks\n", MAX_BANKS);
+            goto out;
+        }
+    }
+
+    printf("Incremental: Old bits: 0x%lx, New bits: 0x%lx, New entries: %d, "
+            "Banks: %d, Pairs: %lu\n", old_bits, new_mask, num_new, num_inc_groups,
+            sched_stats.pairs - pairs);
+
+    if (extend_functions(prev, new_mask, &bank_mapping) < 0)
+        goto out;
+
+    inc_groups_to_entries();
+    ret = 0;
+out:
+    free(inc_entry_group);
+    free(inc_patterns);
+    free(inc_placements);
+    free(baseline);
+
+    PHASE_END(PHASE_ASSOCIATION);
+
+    print_sched_stats();
+    return ret;
+}
+
+// Extends the previous result if there is one, else discovers from scratch
+static void run_incremental(uint64_t virt_start, uint64_t phy_start)
+{
+    bank_mapping_t prev;
+    uint64_t old_bits;
+
+    if (load_result(INCREMENTAL_FILE, &prev, &old_bits) > 0) {
+        printf("Extending result in %s\n", INCREMENTAL_FILE);
+        if (extend_mapping(virt_start, &prev, old_bits) == 0)
+            return;
+
+        eprint("Couldn't extend previous result, discovering from scratch\n");
+        init_banks();
+        init_entries(virt_start, phy_start);
     }
+
+    load_mapping_hypothesis();
+#if (CLUSTER_MODE == 1)
+    run_clustering(virt_start);
+#else
+    run_exp(virt_start, phy_start);
+#endif
 }
+#endif /* INCREMENTAL_MODE == 1 */
 
-int main()
+// Benchmarks include this file and drive the experiment themselves
+#ifndef BANK_TEST_NO_MAIN
+// Finds and checks the mapping on measure_core with memory from numa_node
+static int discover_mapping(void)
 {
     void *virt_start;
     uint64_t phy_start;
+    bool calibrated = false;
+    int ret;
+#if (CHANNEL_PROBE_MODE == 0)
+    int errors = 0;
+#endif
+#if (MAPPING_DB == 1)
+    char descr[1024];
+    uint64_t key;
+    int known;
+#endif
 
 #if (SOFTWARE_CONTROL_HWPREFETCH == 1)
-    int ret;
     uint64_t pflag;
     int core;
-#endif
 
-    // TODO: Install sigsegv handler
-    printf("This program needs root permissions and currently only supports x86/x86-64\n");
-    printf("Please don't terminate the program by Ctrl-C\n");
-    
-#if (SOFTWARE_CONTROL_HWPREFETCH == 1)
     ret = disable_prefetch(&core, &pflag);
     if (ret < 0) {
         eprint("Couldn't disable prefetch\n");
         return -1;
     }
+#else
+    if (measure_core != -1 && pin_to_core(measure_core) < 0)
+        return -1;
+#endif
+
+    // Every failure from here on goes to out, which restores prefetching
+#if (REALTIME_MEASUREMENT == 1)
+    ret = enter_realtime();
+    if (ret < 0)
+        goto out;
+#endif
+
+#if (INSTRUMENTATION == 1)
+    instr_init();
 #endif
 
+    PHASE_BEGIN(PHASE_ALLOCATION);
     virt_start = allocate_contigous(NUM_CONTIGOUS_PAGES, &phy_start);
+    PHASE_END(PHASE_ALLOCATION);
     if (virt_start == NULL) {
         eprint("Couldn't find the physical contiguous addresses\n");
-        return -1;
+        ret = -1;
+        goto out;
     }
 
     init_banks();
     init_entries((uint64_t)virt_start, phy_start);
+
+#if (PERSISTENT_REGION == 1)
+    calibrated = restore_calibration() == 0;
+#endif
+    if (!calibrated)
+        calibrate_tsc();
    
+#if (CHANNEL_PROBE_MODE == 1)
+    load_mapping_hypothesis();
+    ret = run_channel_probe();
+    if (ret < 0)
+        goto out;
+#else
+    PHASE_BEGIN(PHASE_CALIBRATION);
+    ret = calibrated ? 0 : select_measure_kernel();
+#if (AUTO_TUNE_SAMPLING == 1)
+    if (ret == 0 && !calibrated)
+        tune_sampling();
+#endif
+    PHASE_END(PHASE_CALIBRATION);
+    if (ret < 0)
+        goto out;
+
+#if (VERIFY_MODE == 1)
+    load_mapping_hypothesis();
+    PHASE_BEGIN(PHASE_CHECK_MAPPING);
+    errors = verify_mapping() != 1;
+    PHASE_END(PHASE_CHECK_MAPPING);
+#elif (PROFILE_MODE == 1)
+    load_mapping_hypothesis();
+    errors = run_profile() < 0;
+#elif (ROW_POLICY_MODE == 1)
+    load_mapping_hypothesis();
+    errors = run_row_policy() < 0;
+#else
+#if (MAPPING_DB == 1)
+    PHASE_BEGIN(PHASE_CHECK_MAPPING);
+    known = lookup_mapping_db(&key, descr, sizeof(descr));
+    if (!known)
+        load_mapping_hypothesis();
+    PHASE_END(PHASE_CHECK_MAPPING);
+
+    if (!known) {
+#endif
+#if (INCREMENTAL_MODE == 1)
+    run_incremental((uint64_t)virt_start, phy_start);
+#elif (CLUSTER_MODE == 1)
+    run_clustering((uint64_t)virt_start);
+#else
     run_exp((uint64_t)virt_start, phy_start);
+#endif
+
+    PHASE_BEGIN(PHASE_CHECK_MAPPING);
+    errors = check_mapping();
+    PHASE_END(PHASE_CHECK_MAPPING);
+
+#if (INCREMENTAL_MODE == 1)
+    if (errors == 0)
+        write_result(INCREMENTAL_FILE);
+#endif
+
+#if (MAPPING_DB == 1)
+    if (errors == 0)
+        store_mapping(key, descr);
+    else
+        eprint("Hypothesis inconsistent with measurements, not stored\n");
+    }
+#endif
+    if (errors != 0)
+        printf("Hypothesis inconsistencies: %d\n", errors);
+#endif /* VERIFY_MODE == 1 */
+#endif
+
+#if (PERSISTENT_REGION == 1)
+    write_region_cache();
+#endif
+
+#if (INSTRUMENTATION == 1)
+    if (numa_node >= 0) {
+        char fname[100];
+        sprintf(fname, NUMA_STATS_FILE, numa_node);
+        instr_summary(fname);
+    } else {
+        instr_summary(STATS_FILE);
+    }
+#endif
 
-    check_mapping();
+#if (VERIFY_MODE == 1) || (PROFILE_MODE == 1) || (ROW_POLICY_MODE == 1)
+    // Exit status tells whether the mapping still holds, or profiling failed
+    ret = errors != 0 ? -1 : 0;
+#else
+    ret = 0;
+#endif
 
+out:
 #if (SOFTWARE_CONTROL_HWPREFETCH == 1)
-    ret = enable_prefetch(core, pflag);
-    if (ret < 0) {
+    if (enable_prefetch(core, pflag) < 0) {
         eprint("Couldn't reset prefetching\n");
+        ret = -1;
+    }
+#endif
+    return ret;
+}
+
+#if (NUMA_MODE == 1)
+/* Runs discovery concurrently on every node, each in its own process as all
+ * the experiment state is global
+ */
+static int run_numa_workers(void)
+{
+    int cpus[MAX_NUMA_NODES];
+    pid_t pids[MAX_NUMA_NODES];
+    char fname[100];
+    int node, num_nodes, status, failed = 0;
+
+    num_nodes = find_numa_nodes(cpus);
+    if (num_nodes == 0) {
+        eprint("Couldn't find any NUMA node in " NUMA_SYSFS_DIR "\n");
         return -1;
     }
+
+    printf("Running discovery on %d nodes\n", num_nodes);
+    fflush(stdout);
+
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        pids[node] = -1;
+        if (cpus[node] < 0)
+            continue;
+
+#if (KERNEL_HUGEPAGE_ENABLED == 1)
+        if (!node_has_hugepages(node)) {
+            eprint("Node %d doesn't have enough free hugepages, skipping it\n",
+                    node);
+            failed++;
+            continue;
+        }
+#endif
+
+        pids[node] = fork();
+        if (pids[node] < 0) {
+            eprint("Couldn't fork worker for node %d\n", node);
+            failed++;
+            continue;
+        }
+
+        if (pids[node] == 0) {
+            sprintf(fname, NUMA_OUTPUT_FILE, node);
+            if (freopen(fname, "w", stdout) == NULL) {
+                eprint("Couldn't open %s\n", fname);
+                exit(EXIT_FAILURE);
+            }
+
+            numa_node = node;
+            measure_core = cpus[node];
+            exit(discover_mapping() < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+
+    for (node = 0; node < MAX_NUMA_NODES; node++) {
+        if (pids[node] < 0)
+            continue;
+
+        assert(waitpid(pids[node], &status, 0) == pids[node]);
+        sprintf(fname, NUMA_OUTPUT_FILE, node);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+            printf("Node %d: Mapping in %s\n", node, fname);
+        } else {
+            eprint("Node %d: Discovery failed, see %s\n", node, fname);
+            failed++;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+#endif /* NUMA_MODE == 1 */
+
+int main()
+{
+    // TODO: Install sigsegv handler
+    printf("This program needs root permissions and currently only supports x86/x86-64\n");
+    printf("Please don't terminate the program by Ctrl-C\n");
+
+#if (NUMA_MODE == 1)
+    return run_numa_workers();
+#else
+    return discover_mapping();
 #endif
-    return 0;
 }
+#endif /* BANK_TEST_NO_MAIN */
@@ -0,0 +1,307 @@
+// Client library of bankmapd, see bankmap.h
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bankmap.h"
+
+// Tables of the bits every byte of an address contributes to the index
+static void build_lut(const uint64_t *fns, int num_fns, uint8_t lut[][256])
+{
+    int byte, v;
+
+    for (byte = 0; byte < BANKMAP_LUT_BYTES; byte++)
+        for (v = 0; v < 256; v++)
+            lut[byte][v] = bankmap_apply(fns, num_fns, (uint64_t)v << (8 * byte));
+}
+
+static void build_luts(bankmap_t *m)
+{
+    uint64_t covered = (1ULL << (8 * BANKMAP_LUT_BYTES)) - 1, all = 0;
+    int i;
+
+    for (i = 0; i < m->num_bank_fns; i++)
+        all |= m->bank_fns[i];
+    for (i = 0; i < m->num_channel_fns; i++)
+        all |= m->channel_fns[i];
+
+    m->lut_valid = (all & ~covered) == 0;
+    build_lut(m->bank_fns, m->num_bank_fns, m->bank_lut);
+    build_lut(m->channel_fns, m->num_channel_fns, m->channel_lut);
+}
+
+// Copies the mapping out of the segment, consistent with the seqlock
+static void read_shm(bankmap_t *m)
+{
+    const volatile struct bankmap_shm *shm = m->shm;
+    uint64_t seq;
+    int i;
+
+    do {
+        while ((seq = __atomic_load_n(&m->shm->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        m->generation = shm->generation;
+        m->num_bank_fns = shm->num_bank_fns;
+        m->num_channel_fns = shm->num_channel_fns;
+        if (m->num_bank_fns > BANKMAP_MAX_FNS)
+            m->num_bank_fns = BANKMAP_MAX_FNS;
+        if (m->num_channel_fns > BANKMAP_MAX_FNS)
+            m->num_channel_fns = BANKMAP_MAX_FNS;
+        for (i = 0; i < m->num_bank_fns; i++)
+            m->bank_fns[i] = shm->bank_fns[i];
+        for (i = 0; i < m->num_channel_fns; i++)
+            m->channel_fns[i] = shm->channel_fns[i];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&m->shm->seq, __ATOMIC_RELAXED) != seq);
+}
+
+int bankmap_open(bankmap_t *m, const char *name)
+{
+    const struct bankmap_shm *shm;
+    struct stat st;
+    int fd;
+
+    memset(m, 0, sizeof(*m));
+
+    fd = shm_open(name != NULL ? name : BANKMAP_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    // Segment of an older layout might be smaller
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*shm)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return -1;
+
+    if (shm->magic != BANKMAP_MAGIC || shm->version != BANKMAP_VERSION ||
+            shm->size != sizeof(*shm)) {
+        munmap((void *)shm, sizeof(*shm));
+        errno = EPROTO;
+        return -1;
+    }
+
+    m->shm = shm;
+    read_shm(m);
+    build_luts(m);
+    return 0;
+}
+
+int bankmap_refresh(bankmap_t *m)
+{
+    if (m->shm == NULL ||
+            __atomic_load_n(&m->shm->generation, __ATOMIC_RELAXED) == m->generation)
+        return 0;
+
+    read_shm(m);
+    build_luts(m);
+    return 1;
+}
+
+void bankmap_close(bankmap_t *m)
+{
+    if (m->shm != NULL)
+        munmap((void *)m->shm, sizeof(*m->shm));
+    m->shm = NULL;
+}
+
+int bankmap_read_fns(FILE *fp, uint64_t *fns, int max)
+{
+    uint64_t basis[64] = {0};
+    uint64_t mask, v;
+    char *line = NULL, *p, *end;
+    size_t len = 0;
+    int num = 0, bit, found = 0;
+
+    while (getline(&line, &len, fp) != -1) {
+        // Only the first machine of a mapping database
+        if (strncmp(line, "Fingerprint:", 12) == 0 && found)
+            break;
+        if (strncmp(line, "Indexes:", 8) != 0)
+            continue;
+
+        for (p = line + 8, mask = 0; (bit = strtol(p, &end, 10)) != 0 || end != p; p = end) {
+            if (bit < 0 || bit > 63) {
+                num = -1;
+                goto out;
+            }
+            mask |= 1ULL << bit;
+        }
+        found = 1;
+
+        // Dependent functions give no more banks
+        for (v = mask, bit = 63; bit >= 0 && v; bit--) {
+            if (!((v >> bit) & 1))
+                continue;
+            if (basis[bit] == 0) {
+                basis[bit] = v;
+                break;
+            }
+            v ^= basis[bit];
+        }
+        if (v == 0)
+            continue;
+
+        if (num == max) {
+            num = -1;
+            goto out;
+        }
+        fns[num++] = mask;
+    }
+
+out:
+    free(line);
+    return num;
+}
+
+static int load_fns(const char *fname, uint64_t *fns)
+{
+    FILE *fp = fopen(fname, "r");
+    int num;
+
+    if (fp == NULL)
+        return -1;
+    num = bankmap_read_fns(fp, fns, BANKMAP_MAX_FNS);
+    fclose(fp);
+
+    if (num <= 0)
+        errno = EINVAL;
+    return num > 0 ? num : -1;
+}
+
+int bankmap_load(bankmap_t *m, const char *bank_file, const char *channel_file)
+{
+    memset(m, 0, sizeof(*m));
+
+    m->num_bank_fns = load_fns(bank_file, m->bank_fns);
+    if (m->num_bank_fns < 0)
+        return -1;
+
+    if (channel_file != NULL) {
+        m->num_channel_fns = load_fns(channel_file, m->channel_fns);
+        if (m->num_channel_fns < 0)
+            return -1;
+    }
+
+    build_luts(m);
+    return 0;
+}
+
+// Constant trip count, so that the lookups are unrolled
+static inline uint8_t lookup(const uint8_t lut[][256], uint64_t phy)
+{
+    uint8_t index = 0;
+    int byte;
+
+    for (byte = 0; byte < BANKMAP_LUT_BYTES; byte++)
+        index ^= lut[byte][(phy >> (8 * byte)) & 0xff];
+
+    return index;
+}
+
+void bankmap_translate(const bankmap_t *m, const uint64_t *phys, size_t n,
+                        uint8_t *banks, uint8_t *channels)
+{
+    uint64_t phy;
+    size_t i;
+
+    if (!m->lut_valid) {
+        for (i = 0; i < n; i++) {
+            if (banks != NULL)
+                banks[i] = bankmap_bank(m, phys[i]);
+            if (channels != NULL)
+                channels[i] = bankmap_channel(m, phys[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        phy = phys[i];
+        if (banks != NULL)
+            banks[i] = lookup(m->bank_lut, phy);
+        if (channels != NULL)
+            channels[i] = lookup(m->channel_lut, phy);
+    }
+}
+
+// Full receive or send of len bytes. Returns -1 on failure, timeout or early
+// EOF. A closed peer fails with EPIPE instead of killing the caller
+static int transfer(int fd, void *buf, size_t len, bool write_buf)
+{
+    char *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write_buf ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            errno = ret == 0 ? ECONNRESET : errno;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+int bankmap_query(const char *socket_path, pid_t pid, const uint64_t *vaddrs,
+                    size_t n, struct bankmap_page *pages)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct bankmap_query q = { .version = BANKMAP_VERSION, .pid = pid };
+    struct bankmap_reply r;
+    struct timeval timeout = { .tv_sec = BANKMAP_QUERY_TIMEOUT_S };
+    size_t done, batch;
+    int fd, ret = -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+        goto out;
+
+    strncpy(addr.sun_path, socket_path != NULL ? socket_path : BANKMAP_SOCKET_PATH,
+            sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto out;
+
+    for (done = 0; done < n; done += batch) {
+        batch = n - done < BANKMAP_MAX_QUERY ? n - done : BANKMAP_MAX_QUERY;
+        q.num = batch;
+        if (transfer(fd, &q, sizeof(q), true) < 0 ||
+                transfer(fd, (void *)&vaddrs[done], batch * sizeof(uint64_t), true) < 0 ||
+                transfer(fd, &r, sizeof(r), false) < 0)
+            goto out;
+
+        if (r.status != 0 || r.num != batch) {
+            errno = r.status != 0 ? r.status : EPROTO;
+            goto out;
+        }
+        if (transfer(fd, &pages[done], batch * sizeof(*pages), false) < 0)
+            goto out;
+    }
+    ret = 0;
+
+out:
+    close(fd);
+    return ret;
+}
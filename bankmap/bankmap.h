@@ -0,0 +1,142 @@
+// Physical address to DRAM bank translation, from the mapping bank_test found.
+// bankmapd publishes it in a read only shared memory segment, which clients
+// map to translate locally. Pages of other processes are translated by
+// bankmapd, as their PFNs need root to be read.
+
+#ifndef BANKMAP_H
+#define BANKMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define BANKMAP_SHM_NAME            "/bankmap"
+#define BANKMAP_SOCKET_PATH         "/run/bankmap.sock"
+#define BANKMAP_MAGIC               0x70616d6b6e6162ULL     // "bankmap"
+// Bumped on any incompatible change of struct bankmap_shm or the protocol
+#define BANKMAP_VERSION             1
+#define BANKMAP_MAX_FNS             8
+// Translation tables cover physical addresses below 1 << (8 * BANKMAP_LUT_BYTES).
+// Functions of higher bits are translated bit by bit
+#define BANKMAP_LUT_BYTES           6
+// Pages in a query, at most
+#define BANKMAP_MAX_QUERY           (1 << 20)
+// bankmap_query() fails if bankmapd doesn't take or send data for this long
+#define BANKMAP_QUERY_TIMEOUT_S     10
+
+// Segment published by bankmapd. Bank bit i of an address is the parity of its
+// bits in bank_fns[i], likewise for channels. Writers make seq odd while
+// updating, readers retry until they see the same even seq before and after
+struct bankmap_shm {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;              // sizeof(struct bankmap_shm)
+    uint64_t seq;
+    uint64_t generation;        // Bumped on every update
+    uint32_t num_bank_fns;
+    uint32_t num_channel_fns;   // 0 if not known
+    uint64_t bank_fns[BANKMAP_MAX_FNS];
+    uint64_t channel_fns[BANKMAP_MAX_FNS];
+};
+
+// Query on BANKMAP_SOCKET_PATH: Header followed by num virtual addresses of
+// process pid. The caller needs to be root or the owner of pid
+struct bankmap_query {
+    uint32_t version;
+    uint32_t pid;
+    uint32_t num;
+    uint32_t reserved;
+};
+
+// Reply: Header followed by num pages, if status is 0 (else an errno)
+struct bankmap_reply {
+    int32_t status;
+    uint32_t num;
+};
+
+struct bankmap_page {
+    int16_t bank;               // -1 if not resident
+    int16_t channel;            // -1 if not resident, 0 if channels unknown
+};
+
+typedef struct bankmap {
+    const struct bankmap_shm *shm;  // NULL if loaded from files
+    uint64_t generation;
+    int num_bank_fns;
+    int num_channel_fns;
+    uint64_t bank_fns[BANKMAP_MAX_FNS];
+    uint64_t channel_fns[BANKMAP_MAX_FNS];
+    bool lut_valid;             // No function of bits above the tables
+    // Bank and channel bits every byte of an address contributes
+    uint8_t bank_lut[BANKMAP_LUT_BYTES][256];
+    uint8_t channel_lut[BANKMAP_LUT_BYTES][256];
+} bankmap_t;
+
+/* Maps the segment name (BANKMAP_SHM_NAME if NULL) published by bankmapd.
+ * Returns -1 with errno set on failure (EPROTO if of another version)
+ */
+int bankmap_open(bankmap_t *m, const char *name);
+
+/* Takes the mapping from the segment again if bankmapd updated it. Returns 1
+ * if it changed, 0 if not
+ */
+int bankmap_refresh(bankmap_t *m);
+
+void bankmap_close(bankmap_t *m);
+
+/* Loads the mapping from files in bank_test's MAPPING_FILE format
+ * (algo_finder's solution), without bankmapd. channel_file may be NULL.
+ * Returns -1 on failure
+ */
+int bankmap_load(bankmap_t *m, const char *bank_file, const char *channel_file);
+
+/* Reads the functions of fp, at most max. Returns the number read, -1 if
+ * invalid
+ */
+int bankmap_read_fns(FILE *fp, uint64_t *fns, int max);
+
+/* Translates n physical addresses with the tables. banks or channels may be
+ * NULL
+ */
+void bankmap_translate(const bankmap_t *m, const uint64_t *phys, size_t n,
+                        uint8_t *banks, uint8_t *channels);
+
+/* Translates n virtual addresses of process pid through bankmapd at
+ * socket_path (BANKMAP_SOCKET_PATH if NULL). Returns -1 with errno set on
+ * failure, EAGAIN if bankmapd stalls. Doesn't raise SIGPIPE
+ */
+int bankmap_query(const char *socket_path, pid_t pid, const uint64_t *vaddrs,
+                    size_t n, struct bankmap_page *pages);
+
+static inline int bankmap_num_banks(const bankmap_t *m)
+{
+    return 1 << m->num_bank_fns;
+}
+
+static inline int bankmap_num_channels(const bankmap_t *m)
+{
+    return 1 << m->num_channel_fns;
+}
+
+static inline int bankmap_apply(const uint64_t *fns, int num_fns, uint64_t phy)
+{
+    int i, index;
+
+    for (i = 0, index = 0; i < num_fns; i++)
+        index |= __builtin_parityll(phy & fns[i]) << i;
+
+    return index;
+}
+
+static inline int bankmap_bank(const bankmap_t *m, uint64_t phy)
+{
+    return bankmap_apply(m->bank_fns, m->num_bank_fns, phy);
+}
+
+static inline int bankmap_channel(const bankmap_t *m, uint64_t phy)
+{
+    return bankmap_apply(m->channel_fns, m->num_channel_fns, phy);
+}
+
+#endif /* BANKMAP_H */
@@ -0,0 +1,444 @@
+/*
+ * Publishes the bank mapping found by bank_test in shared memory, for
+ * allocators, profilers and schedulers to translate physical addresses
+ * without copying phy_to_bank_mapping() or asking for every address. Also
+ * translates pages of other processes, whose PFNs only root can read from
+ * /proc/<pid>/pagemap, for their owners over a Unix socket. Only banks are
+ * returned, not PFNs. SIGHUP reloads the mapping files, which clients see
+ * through the segment's generation.
+ *
+ * Usage: bankmapd [options]
+ *  -m <file>   Bank functions, in bank_test's MAPPING_FILE format (mapping.txt)
+ *  -c <file>   Channel functions, same format (none by default)
+ *  -n <name>   Shared memory segment (BANKMAP_SHM_NAME)
+ *  -s <path>   Socket (BANKMAP_SOCKET_PATH)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bankmap.h"
+
+#define DEBUG                           0
+#if (DEBUG == 1)
+#define dprintf(...)                    printf(__VA_ARGS__)
+#else
+#define dprintf(...)
+#endif
+
+#define eprint(...)                     fprintf(stderr, "ERROR:" __VA_ARGS__)
+
+#define PAGE_SHIFT                      12
+#define DEFAULT_MAPPING_FILE            "mapping.txt"
+// Pagemap entries read at once for consecutive pages of a query
+#define PAGEMAP_BATCH                   4096
+// A client not done with a query (from sending it to receiving the reply)
+// this long after connecting or its previous reply is dropped
+#define CLIENT_TIMEOUT_S                5
+// Clients served at once, more wait in the listen backlog
+#define MAX_CLIENTS                     16
+#define PAGEMAP_PRESENT                 (1ULL << 63)
+#define PAGEMAP_PFN_MASK                ((1ULL << 55) - 1)
+
+static const char *bank_file = DEFAULT_MAPPING_FILE, *channel_file;
+static struct bankmap_shm *shm;
+static bankmap_t mapping;
+static volatile sig_atomic_t reload;
+
+enum client_state { READ_QUERY, READ_VADDRS, WRITE_REPLY, WRITE_PAGES };
+
+// Connection being served, whose socket is non-blocking
+typedef struct client {
+    int fd;
+    enum client_state state;
+    size_t done;                // Bytes of the current message transferred
+    double deadline;
+    bool close_after;           // Reply to a bad query is the last one
+    struct bankmap_query q;
+    struct bankmap_reply r;
+    uint64_t *vaddrs;
+    struct bankmap_page *pages;
+} client_t;
+
+static client_t clients[MAX_CLIENTS];
+static int num_clients;
+
+static void on_sighup(int sig)
+{
+    reload = 1;
+}
+
+// Writes the mapping into the segment under its seqlock
+static void publish(const bankmap_t *m)
+{
+    uint64_t seq = shm->seq;
+
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    shm->num_bank_fns = m->num_bank_fns;
+    shm->num_channel_fns = m->num_channel_fns;
+    memcpy(shm->bank_fns, m->bank_fns, sizeof(shm->bank_fns));
+    memcpy(shm->channel_fns, m->channel_fns, sizeof(shm->channel_fns));
+    shm->generation++;
+
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static int load_mapping(void)
+{
+    bankmap_t m;
+
+    if (bankmap_load(&m, bank_file, channel_file) < 0) {
+        eprint("Couldn't load the mapping from %s%s%s: %s\n", bank_file,
+                channel_file != NULL ? " and " : "", channel_file != NULL ? channel_file : "",
+                strerror(errno));
+        return -1;
+    }
+
+    mapping = m;
+    publish(&mapping);
+    printf("Mapping: Banks: %d, Channels: %d, Generation: %lu\n",
+            bankmap_num_banks(&mapping), bankmap_num_channels(&mapping), shm->generation);
+    return 0;
+}
+
+/* Creates the segment, or takes over the one of a previous bankmapd of the
+ * same version, so that its clients keep working
+ */
+static int create_shm(const char *name)
+{
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        eprint("Couldn't open shared memory %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if ((size_t)st.st_size != sizeof(*shm) && ftruncate(fd, sizeof(*shm)) < 0) {
+        eprint("Couldn't size shared memory %s: %s\n", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // Readable by everyone, whatever the umask
+    fchmod(fd, 0644);
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        eprint("Couldn't map shared memory %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    if (shm->magic != BANKMAP_MAGIC || shm->version != BANKMAP_VERSION ||
+            shm->size != sizeof(*shm)) {
+        memset(shm, 0, sizeof(*shm));
+        shm->version = BANKMAP_VERSION;
+        shm->size = sizeof(*shm);
+        __atomic_store_n(&shm->magic, BANKMAP_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        eprint("Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        eprint("Couldn't listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // Access is checked per query against the peer's credentials
+    chmod(path, 0666);
+
+    return fd;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Moves what the socket takes of the len - done bytes left of buf. Returns 1
+ * once all are moved, 0 if the socket would block, -1 on errors and EOF
+ */
+static int transfer(int fd, void *buf, size_t len, size_t *done, bool write_buf)
+{
+    char *p = buf;
+    ssize_t ret;
+
+    while (*done < len) {
+        ret = write_buf ? write(fd, p + *done, len - *done) :
+                read(fd, p + *done, len - *done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (ret <= 0)
+            return -1;
+        *done += ret;
+    }
+
+    return 1;
+}
+
+/* Opens the pagemap of pid if the peer of client may see its pages: root or
+ * its owner. The owner is checked on the same /proc/<pid> as pagemap is
+ * opened from, so that a new process reusing pid can't slip in between.
+ * Returns 0 or an errno
+ */
+static int open_pagemap(int client, pid_t pid, int *fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    struct stat st;
+    char fname[64];
+    int dir;
+
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return errno;
+
+    snprintf(fname, sizeof(fname), "/proc/%d", pid);
+    dir = open(fname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0)
+        return errno;
+    if (fstat(dir, &st) < 0 || (cred.uid != 0 && cred.uid != st.st_uid)) {
+        close(dir);
+        return EPERM;
+    }
+
+    *fd = openat(dir, "pagemap", O_RDONLY | O_CLOEXEC);
+    close(dir);
+    return *fd < 0 ? errno : 0;
+}
+
+/* Translates the pages at vaddrs from pagemap fd, reading entries of
+ * consecutive pages in batches
+ */
+static void translate_pages(int fd, const uint64_t *vaddrs, uint32_t num,
+                            struct bankmap_page *pages)
+{
+    uint64_t entries[PAGEMAP_BATCH], phy;
+    uint32_t i, k, run;
+    ssize_t ret;
+
+    for (i = 0; i < num; i += run) {
+        for (run = 1; i + run < num && run < PAGEMAP_BATCH &&
+                (vaddrs[i + run] >> PAGE_SHIFT) == (vaddrs[i] >> PAGE_SHIFT) + run; run++)
+            ;
+
+        ret = pread(fd, entries, run * sizeof(uint64_t),
+                    (vaddrs[i] >> PAGE_SHIFT) * sizeof(uint64_t));
+        for (k = 0; k < run; k++) {
+            pages[i + k].bank = pages[i + k].channel = -1;
+            if ((ssize_t)((k + 1) * sizeof(uint64_t)) > ret ||
+                    !(entries[k] & PAGEMAP_PRESENT) || (entries[k] & PAGEMAP_PFN_MASK) == 0)
+                continue;
+            phy = ((entries[k] & PAGEMAP_PFN_MASK) << PAGE_SHIFT) |
+                    (vaddrs[i + k] & ((1 << PAGE_SHIFT) - 1));
+            pages[i + k].bank = bankmap_bank(&mapping, phy);
+            pages[i + k].channel = bankmap_channel(&mapping, phy);
+        }
+    }
+}
+
+static void answer_query(client_t *c)
+{
+    int fd = -1;
+
+    c->r.status = open_pagemap(c->fd, c->q.pid, &fd);
+    if (c->r.status == 0) {
+        translate_pages(fd, c->vaddrs, c->q.num, c->pages);
+        close(fd);
+    }
+    c->r.num = c->r.status == 0 ? c->q.num : 0;
+    dprintf("Query: Pid: %u, Pages: %u, Status: %d\n", c->q.pid, c->q.num, c->r.status);
+}
+
+/* Advances c as far as its socket allows without blocking. Returns -1 when
+ * it should be dropped
+ */
+static int serve_client(client_t *c)
+{
+    int ret;
+
+    while (1) {
+        switch (c->state) {
+            case READ_QUERY:
+                ret = transfer(c->fd, &c->q, sizeof(c->q), &c->done, false);
+                if (ret <= 0)
+                    return ret;
+                c->done = 0;
+                if (c->q.version != BANKMAP_VERSION || c->q.num > BANKMAP_MAX_QUERY) {
+                    c->r.status = EPROTO;
+                    c->r.num = 0;
+                    c->close_after = true;
+                    c->state = WRITE_REPLY;
+                    break;
+                }
+                c->vaddrs = realloc(c->vaddrs, (c->q.num + 1) * sizeof(uint64_t));
+                c->pages = realloc(c->pages, (c->q.num + 1) * sizeof(struct bankmap_page));
+                assert(c->vaddrs != NULL && c->pages != NULL);
+                c->state = READ_VADDRS;
+                break;
+            case READ_VADDRS:
+                ret = transfer(c->fd, c->vaddrs, c->q.num * sizeof(uint64_t), &c->done, false);
+                if (ret <= 0)
+                    return ret;
+                c->done = 0;
+                answer_query(c);
+                c->state = WRITE_REPLY;
+                break;
+            case WRITE_REPLY:
+                ret = transfer(c->fd, &c->r, sizeof(c->r), &c->done, true);
+                if (ret <= 0)
+                    return ret;
+                c->done = 0;
+                c->state = WRITE_PAGES;
+                break;
+            case WRITE_PAGES:
+                ret = transfer(c->fd, c->pages, c->r.num * sizeof(struct bankmap_page),
+                                &c->done, true);
+                if (ret <= 0)
+                    return ret;
+                if (c->close_after)
+                    return -1;
+                c->done = 0;
+                c->deadline = now_s() + CLIENT_TIMEOUT_S;
+                c->state = READ_QUERY;
+                break;
+        }
+    }
+}
+
+static void add_client(int fd)
+{
+    client_t *c = &clients[num_clients++];
+
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->state = READ_QUERY;
+    c->deadline = now_s() + CLIENT_TIMEOUT_S;
+}
+
+// Moves the last client into the slot of client i
+static void drop_client(int i)
+{
+    dprintf("Dropping client %d\n", clients[i].fd);
+    close(clients[i].fd);
+    free(clients[i].vaddrs);
+    free(clients[i].pages);
+    clients[i] = clients[--num_clients];
+}
+
+int main(int argc, char *argv[])
+{
+    const char *shm_name = BANKMAP_SHM_NAME, *socket_path = BANKMAP_SOCKET_PATH;
+    struct sigaction sa = { .sa_handler = on_sighup };
+    struct pollfd fds[MAX_CLIENTS + 1];
+    int opt, fd, client, i, timeout, ret, listening;
+    double now, next;
+
+    while ((opt = getopt(argc, argv, "m:c:n:s:")) != -1) {
+        switch (opt) {
+            case 'm': bank_file = optarg; break;
+            case 'c': channel_file = optarg; break;
+            case 'n': shm_name = optarg; break;
+            case 's': socket_path = optarg; break;
+            default:
+                fprintf(stderr, "See the top of bankmapd.c for usage\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (create_shm(shm_name) < 0 || load_mapping() < 0)
+        exit(EXIT_FAILURE);
+
+    fd = listen_socket(socket_path);
+    if (fd < 0)
+        exit(EXIT_FAILURE);
+
+    // Without SA_RESTART, so that poll() returns to reload
+    sigaction(SIGHUP, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving %s and %s\n", shm_name, socket_path);
+    fflush(stdout);
+
+    /* Clients are served in turns as their sockets are ready, so that one
+     * stalling can only hold its own slot, and only until its deadline
+     */
+    while (1) {
+        now = now_s();
+        next = now + 3600;
+        for (i = 0; i < num_clients; i++) {
+            if (clients[i].deadline <= now) {
+                drop_client(i--);
+                continue;
+            }
+            next = clients[i].deadline < next ? clients[i].deadline : next;
+            fds[i].fd = clients[i].fd;
+            fds[i].events = clients[i].state < WRITE_REPLY ? POLLIN : POLLOUT;
+        }
+        // Full: New clients wait in the backlog until a slot frees
+        listening = num_clients;
+        fds[listening].fd = num_clients < MAX_CLIENTS ? fd : -1;
+        fds[listening].events = POLLIN;
+        timeout = (next - now) * 1000 + 1;
+
+        ret = poll(fds, listening + 1, timeout);
+        if (reload) {
+            reload = 0;
+            // The previous mapping stays published if the files are broken
+            load_mapping();
+            fflush(stdout);
+        }
+        if (ret < 0) {
+            if (errno != EINTR)
+                eprint("poll: %s\n", strerror(errno));
+            continue;
+        }
+
+        // Backwards, as dropping moves the last client into the slot
+        for (i = listening - 1; i >= 0; i--)
+            if (fds[i].revents != 0 && serve_client(&clients[i]) < 0)
+                drop_client(i);
+
+        if (fds[listening].revents & POLLIN) {
+            client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client >= 0)
+                add_client(client);
+            else if (errno != EINTR && errno != EAGAIN)
+                eprint("accept: %s\n", strerror(errno));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Shows how the resident memory of a process is spread over DRAM banks and
+ * channels. Reads /proc/<pid>/maps and /proc/<pid>/pagemap in large batches
+ * and translates the PFNs with bankmap_translate(), so it needs root (or
+ * CAP_SYS_ADMIN) to see PFNs. Counts are in 4 KB pages, which functions with
+ * bits below PAGE_SHIFT spread over several banks or channels by cache line.
+ *
+ * Usage: bankocc [options] <pid>
+ *  -m <file>   Bank functions from a file instead of bankmapd's segment
+ *  -c <file>   Channel functions from a file, with -m
+ *  -n <name>   Segment of bankmapd (BANKMAP_SHM_NAME)
+ *  -i <sec>    Sample every sec seconds and print the drift, until the
+ *              process exits or -k samples are taken
+ *  -k <num>    Samples to take with -i (0 for no limit)
+ *  -v          Print the table of every sample, not only of the last one
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#include "bankmap.h"
+
+#define eprint(...)                     fprintf(stderr, "ERROR:" __VA_ARGS__)
+
+#define PAGE_SHIFT                      12
+#define PAGE_SIZE                       (1ULL << PAGE_SHIFT)
+// Pagemap entries read at once (4 MB, covering 4 GB of address space)
+#define PAGEMAP_BATCH                   (1 << 19)
+#define PAGEMAP_PRESENT                 (1ULL << 63)
+#define PAGEMAP_PFN_MASK                ((1ULL << 55) - 1)
+#define MAX_INDEXES                     (1 << BANKMAP_MAX_FNS)
+#define LINE_SHIFT                      6
+#define LINES_PER_PAGE                  (1 << (PAGE_SHIFT - LINE_SHIFT))
+
+typedef struct occupancy {
+    uint64_t banks[MAX_INDEXES];        // In cache lines
+    uint64_t channels[MAX_INDEXES];
+    uint64_t resident;          // Present pages
+    uint64_t hidden;            // Present pages without PFN
+    uint64_t swapped;
+    uint64_t vmas;
+} occupancy_t;
+
+/* Lines of a page per index of their offset in the page. As indexes are
+ * parities, a line is in the index of its page's base XOR that of its offset
+ */
+typedef struct spread {
+    int num;
+    int index[LINES_PER_PAGE];
+    uint64_t lines[LINES_PER_PAGE];
+} spread_t;
+
+typedef struct skew {
+    double max;                 // Of the largest count to the mean
+    double min;
+    double cv;                  // Coefficient of variation
+} skew_t;
+
+static uint64_t entries[PAGEMAP_BATCH];
+static uint64_t phys[PAGEMAP_BATCH];
+static uint8_t banks[PAGEMAP_BATCH], channels[PAGEMAP_BATCH];
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build_spread(const uint64_t *fns, int num_fns, spread_t *s)
+{
+    uint64_t lines[MAX_INDEXES] = {0};
+    int i;
+
+    for (i = 0; i < LINES_PER_PAGE; i++)
+        lines[bankmap_apply(fns, num_fns, (uint64_t)i << LINE_SHIFT)]++;
+
+    for (i = 0, s->num = 0; i < MAX_INDEXES; i++) {
+        if (lines[i] == 0)
+            continue;
+        s->index[s->num] = i;
+        s->lines[s->num++] = lines[i];
+    }
+}
+
+// Counts the resident pages of start to end - 1
+static int count_range(int fd, const bankmap_t *m, const spread_t *bank_spread,
+                        const spread_t *channel_spread, uint64_t start, uint64_t end,
+                        occupancy_t *occ)
+{
+    uint64_t page, num, i, n;
+    ssize_t ret;
+    int k;
+
+    for (page = start >> PAGE_SHIFT; page < end >> PAGE_SHIFT; page += num) {
+        num = (end >> PAGE_SHIFT) - page;
+        if (num > PAGEMAP_BATCH)
+            num = PAGEMAP_BATCH;
+
+        ret = pread(fd, entries, num * sizeof(uint64_t), page * sizeof(uint64_t));
+        if (ret < 0)
+            return -1;
+        // Mapping shrunk since reading maps
+        if (ret == 0)
+            break;
+        num = ret / sizeof(uint64_t);
+
+        for (i = 0, n = 0; i < num; i++) {
+            if (!(entries[i] & PAGEMAP_PRESENT)) {
+                occ->swapped += (entries[i] >> 62) & 1;
+                continue;
+            }
+            occ->resident++;
+            if ((entries[i] & PAGEMAP_PFN_MASK) == 0) {
+                occ->hidden++;
+                continue;
+            }
+            phys[n++] = (entries[i] & PAGEMAP_PFN_MASK) << PAGE_SHIFT;
+        }
+
+        bankmap_translate(m, phys, n, banks, m->num_channel_fns > 0 ? channels : NULL);
+        for (i = 0; i < n; i++)
+            for (k = 0; k < bank_spread->num; k++)
+                occ->banks[banks[i] ^ bank_spread->index[k]] += bank_spread->lines[k];
+        if (m->num_channel_fns > 0)
+            for (i = 0; i < n; i++)
+                for (k = 0; k < channel_spread->num; k++)
+                    occ->channels[channels[i] ^ channel_spread->index[k]] +=
+                        channel_spread->lines[k];
+    }
+
+    return 0;
+}
+
+// Takes a sample of pid. Returns -1 with errno set if it can't be read
+static int sample(pid_t pid, const bankmap_t *m, occupancy_t *occ)
+{
+    unsigned long long start, end;
+    char fname[64], *line = NULL;
+    spread_t bank_spread, channel_spread;
+    size_t len = 0;
+    FILE *maps;
+    int fd, ret = 0;
+
+    memset(occ, 0, sizeof(*occ));
+    build_spread(m->bank_fns, m->num_bank_fns, &bank_spread);
+    build_spread(m->channel_fns, m->num_channel_fns, &channel_spread);
+
+    snprintf(fname, sizeof(fname), "/proc/%d/maps", pid);
+    maps = fopen(fname, "r");
+    if (maps == NULL)
+        return -1;
+    snprintf(fname, sizeof(fname), "/proc/%d/pagemap", pid);
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        fclose(maps);
+        return -1;
+    }
+
+    while (getline(&line, &len, maps) != -1) {
+        if (sscanf(line, "%llx-%llx", &start, &end) != 2)
+            continue;
+        // vsyscall is not in the page tables
+        if (strstr(line, "[vsyscall]") != NULL)
+            continue;
+        occ->vmas++;
+        if (count_range(fd, m, &bank_spread, &channel_spread, start, end, occ) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(line);
+    close(fd);
+    fclose(maps);
+    return ret;
+}
+
+static skew_t compute_skew(const uint64_t *counts, int num)
+{
+    skew_t s = {0};
+    double mean, var = 0;
+    uint64_t total = 0, max = 0, min = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        total += counts[i];
+        max = counts[i] > max ? counts[i] : max;
+        min = counts[i] < min ? counts[i] : min;
+    }
+    if (total == 0)
+        return s;
+
+    mean = (double)total / num;
+    for (i = 0; i < num; i++)
+        var += (counts[i] - mean) * (counts[i] - mean);
+
+    s.max = max / mean;
+    s.min = min / mean;
+    s.cv = sqrt(var / num) / mean;
+    return s;
+}
+
+/* Total variation distance of the distributions of a and b: The share of
+ * pages that would need to move to another bank to turn one into the other
+ */
+static double drift(const uint64_t *a, const uint64_t *b, int num)
+{
+    uint64_t total_a = 0, total_b = 0;
+    double d = 0;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        total_a += a[i];
+        total_b += b[i];
+    }
+    if (total_a == 0 || total_b == 0)
+        return 0;
+
+    for (i = 0; i < num; i++)
+        d += fabs((double)a[i] / total_a - (double)b[i] / total_b);
+
+    return d / 2;
+}
+
+static void print_counts(const char *name, const uint64_t *counts, int num)
+{
+    uint64_t total = 0;
+    skew_t s;
+    int i;
+
+    for (i = 0; i < num; i++)
+        total += counts[i];
+
+    printf("%-8s %12s %12s %8s\n", name, "Pages", "MB", "Share");
+    for (i = 0; i < num; i++)
+        printf("%-8d %12.1f %12.1f %7.2f%%\n", i, (double)counts[i] / LINES_PER_PAGE,
+                counts[i] * (double)(1 << LINE_SHIFT) / (1 << 20),
+                total > 0 ? 100.0 * counts[i] / total : 0);
+
+    s = compute_skew(counts, num);
+    printf("%ss: %d, Max/mean: %.3f, Min/mean: %.3f, CV: %.3f\n",
+            name, num, s.max, s.min, s.cv);
+}
+
+static void print_occupancy(pid_t pid, const bankmap_t *m, const occupancy_t *occ,
+                            double elapsed)
+{
+    printf("Pid: %d, VMAs: %lu, Resident: %lu pages (%.1f MB), Swapped: %lu, Took: %.3f s\n",
+            pid, occ->vmas, occ->resident, occ->resident * (double)PAGE_SIZE / (1 << 20),
+            occ->swapped, elapsed);
+    print_counts("Bank", occ->banks, bankmap_num_banks(m));
+    if (m->num_channel_fns > 0)
+        print_counts("Channel", occ->channels, bankmap_num_channels(m));
+}
+
+int main(int argc, char *argv[])
+{
+    const char *bank_file = NULL, *channel_file = NULL, *shm_name = NULL;
+    static occupancy_t occ, first, prev;
+    double interval = 0, start, took = 0;
+    int opt, verbose = 0, limit = 0, samples;
+    skew_t bank_skew, channel_skew;
+    bankmap_t m;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "m:c:n:i:k:v")) != -1) {
+        switch (opt) {
+            case 'm': bank_file = optarg; break;
+            case 'c': channel_file = optarg; break;
+            case 'n': shm_name = optarg; break;
+            case 'i': interval = atof(optarg); break;
+            case 'k': limit = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default:
+                optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "See the top of bankocc.c for usage\n");
+        exit(EXIT_FAILURE);
+    }
+    pid = atoi(argv[optind]);
+
+    if (bank_file != NULL ? bankmap_load(&m, bank_file, channel_file) < 0 :
+            bankmap_open(&m, shm_name) < 0) {
+        eprint("Couldn't get the mapping from %s: %s\n",
+                bank_file != NULL ? bank_file : "bankmapd, start it or use -m",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (samples = 0; limit == 0 || samples < limit; samples++) {
+        if (samples > 0)
+            usleep(interval * 1e6);
+        // bankmapd might have a newer mapping, which makes samples incomparable
+        if (bankmap_refresh(&m) && samples > 0) {
+            printf("Mapping changed, restarting the drift\n");
+            samples = 0;
+        }
+
+        start = now_s();
+        if (sample(pid, &m, &occ) < 0) {
+            if (samples > 0 && (errno == ENOENT || errno == ESRCH))
+                break;
+            eprint("Couldn't read the pages of %d: %s\n", pid, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        took = now_s() - start;
+
+        if (occ.resident > 0 && occ.hidden == occ.resident) {
+            eprint("PFNs are hidden, run as root\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (samples == 0)
+            first = occ;
+        if (interval == 0 || verbose)
+            print_occupancy(pid, &m, &occ, took);
+        if (interval == 0)
+            break;
+
+        bank_skew = compute_skew(occ.banks, bankmap_num_banks(&m));
+        channel_skew = compute_skew(occ.channels, bankmap_num_channels(&m));
+        printf("Sample: %d, Resident: %.1f MB, Bank max/mean: %.3f, Bank CV: %.3f, "
+                "Channel CV: %.3f, Drift: %.4f, Since first: %.4f\n", samples,
+                occ.resident * (double)PAGE_SIZE / (1 << 20), bank_skew.max, bank_skew.cv,
+                channel_skew.cv, samples > 0 ? drift(prev.banks, occ.banks, bankmap_num_banks(&m)) : 0,
+                drift(first.banks, occ.banks, bankmap_num_banks(&m)));
+        fflush(stdout);
+        prev = occ;
+    }
+
+    if (interval > 0 && !verbose)
+        print_occupancy(pid, &m, &prev, took);
+
+    bankmap_close(&m);
+    return 0;
+}
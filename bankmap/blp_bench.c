@@ -0,0 +1,391 @@
+/*
+ * Bank level parallelism benchmark: Measures how bandwidth and latency depend
+ * on the number of banks a workload touches, to see what spreading buffers
+ * over banks (or confining them) is worth on a host. Streams of the same
+ * footprint are built from cache lines of 1, 2, 4 ... all banks, in the
+ * bank order of the mapping, and read sequentially, strided and in random
+ * order, on one core and on several. Needs root to see PFNs.
+ *
+ * Usage: blp_bench [options]
+ *  -m <file>   Bank functions from a file instead of bankmapd's segment
+ *  -n <name>   Segment of bankmapd (BANKMAP_SHM_NAME)
+ *  -s <MB>     Region to build the streams from (DEFAULT_REGION_MB). Every
+ *              stream is region / banks large, which should be well above
+ *              the last level cache
+ *  -t <num>    Threads of the multi core runs (cores available)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "bankmap.h"
+
+#define eprint(...)                     fprintf(stderr, "ERROR:" __VA_ARGS__)
+
+#define PAGE_SHIFT                      12
+#define PAGE_SIZE                       (1ULL << PAGE_SHIFT)
+#define LINE_SHIFT                      6
+#define LINE_SIZE                       (1ULL << LINE_SHIFT)
+#define HUGEPAGE_SIZE                   (2ULL << 20)
+#define PAGEMAP_PRESENT                 (1ULL << 63)
+#define PAGEMAP_PFN_MASK                ((1ULL << 55) - 1)
+#define MAX_INDEXES                     (1 << BANKMAP_MAX_FNS)
+
+#define DEFAULT_REGION_MB               1024
+// Lines between consecutive accesses of the strided pattern
+#define STRIDE_LINES                    16
+// Accesses per thread and measurement, rounded up to whole passes
+#define ACCESSES                        (1 << 22)
+#define RANDOM_SEED                     0x2545f4914f6cdd1dULL
+
+enum pattern { SEQUENTIAL, STRIDED, RANDOM, NUM_PATTERNS };
+static const char *pattern_names[NUM_PATTERNS] = { "sequential", "strided", "random" };
+
+typedef struct result {
+    double bandwidth;           // GB/s over all threads
+    double latency;             // ns per dependent access, mean of threads
+} result_t;
+
+typedef struct worker {
+    pthread_t thread;
+    int cpu;
+    const uint32_t *order;      // Lines in the order of the pattern
+    uint64_t num;
+    bool chase;                 // Latency instead of bandwidth
+    uint64_t ns;
+    uint64_t accesses;
+    uint64_t sum;
+} worker_t;
+
+static char *region;
+static uint64_t region_size;
+// Lines of every bank, ascending
+static uint32_t *bank_lines[MAX_INDEXES];
+static uint64_t bank_counts[MAX_INDEXES];
+static pthread_barrier_t start_barrier;
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Hugepages keep TLB misses out of the latencies, 4 KB pages work as well
+static int allocate_region(void)
+{
+    uint64_t off;
+
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (region != MAP_FAILED)
+        return 0;
+
+    printf("No hugepages (%s), using 4 KB pages, latencies include TLB misses\n",
+            strerror(errno));
+    region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        return -1;
+    madvise(region, region_size, MADV_HUGEPAGE);
+    for (off = 0; off < region_size; off += PAGE_SIZE)
+        region[off] = 1;
+
+    return 0;
+}
+
+// Sorts the lines of the region by bank
+static int classify_lines(const bankmap_t *m)
+{
+    uint64_t pages = region_size / PAGE_SIZE, lines_per_page = PAGE_SIZE / LINE_SIZE;
+    uint64_t *entries, phys[PAGE_SIZE / LINE_SIZE], page, i;
+    uint8_t banks[PAGE_SIZE / LINE_SIZE];
+    uint64_t fill[MAX_INDEXES] = {0};
+    int fd, pass, b;
+    ssize_t ret;
+
+    entries = malloc(pages * sizeof(uint64_t));
+    assert(entries != NULL);
+    fd = open("/proc/self/pagemap", O_RDONLY);
+    assert(fd >= 0);
+    ret = pread(fd, entries, pages * sizeof(uint64_t),
+                ((uintptr_t)region >> PAGE_SHIFT) * sizeof(uint64_t));
+    close(fd);
+    if (ret != (ssize_t)(pages * sizeof(uint64_t)))
+        goto fail;
+
+    for (page = 0; page < pages; page++)
+        if (!(entries[page] & PAGEMAP_PRESENT) || (entries[page] & PAGEMAP_PFN_MASK) == 0)
+            goto fail;
+
+    // Counts the lines of every bank, then fills them in
+    for (pass = 0; pass < 2; pass++) {
+        for (page = 0; page < pages; page++) {
+            for (i = 0; i < lines_per_page; i++)
+                phys[i] = ((entries[page] & PAGEMAP_PFN_MASK) << PAGE_SHIFT) | (i << LINE_SHIFT);
+            bankmap_translate(m, phys, lines_per_page, banks, NULL);
+
+            for (i = 0; i < lines_per_page; i++) {
+                if (pass == 0)
+                    bank_counts[banks[i]]++;
+                else
+                    bank_lines[banks[i]][fill[banks[i]]++] = page * lines_per_page + i;
+            }
+        }
+
+        for (b = 0; pass == 0 && b < bankmap_num_banks(m); b++) {
+            bank_lines[b] = malloc((bank_counts[b] + 1) * sizeof(uint32_t));
+            assert(bank_lines[b] != NULL);
+        }
+    }
+
+    free(entries);
+    return 0;
+
+fail:
+    eprint("Couldn't get the PFNs of the region, run as root\n");
+    free(entries);
+    return -1;
+}
+
+/* Lines of the stream over banks first to first + num_banks - 1, len lines
+ * taken from them in turn
+ */
+static void build_stream(int first, int num_banks, uint64_t len, uint32_t *lines)
+{
+    uint64_t i;
+
+    for (i = 0; i < len; i++)
+        lines[i] = bank_lines[first + i % num_banks][i / num_banks];
+}
+
+// Puts the lines of a thread in the order of the pattern
+static void build_order(enum pattern p, const uint32_t *lines, uint64_t num, uint32_t *order,
+                        uint64_t *seed)
+{
+    uint64_t i, j, s;
+    uint32_t tmp;
+
+    switch (p) {
+        case SEQUENTIAL:
+            memcpy(order, lines, num * sizeof(uint32_t));
+            break;
+        case STRIDED:
+            for (s = 0, j = 0; s < STRIDE_LINES; s++)
+                for (i = s; i < num; i += STRIDE_LINES)
+                    order[j++] = lines[i];
+            break;
+        case RANDOM:
+            memcpy(order, lines, num * sizeof(uint32_t));
+            for (i = num - 1; i > 0; i--) {
+                j = xorshift(seed) % (i + 1);
+                tmp = order[i];
+                order[i] = order[j];
+                order[j] = tmp;
+            }
+            break;
+        default:
+            assert(0);
+    }
+}
+
+// Links every line of order to the next one, for the latency runs
+static void build_chain(const uint32_t *order, uint64_t num)
+{
+    uint64_t i;
+
+    for (i = 0; i < num; i++)
+        *(char **)(region + ((uint64_t)order[i] << LINE_SHIFT)) =
+                region + ((uint64_t)order[(i + 1) % num] << LINE_SHIFT);
+}
+
+static void *worker_fn(void *arg)
+{
+    worker_t *w = arg;
+    uint64_t passes = (ACCESSES + w->num - 1) / w->num, i, pass, start, sum = 0;
+    cpu_set_t mask;
+    char **p;
+
+    CPU_ZERO(&mask);
+    CPU_SET(w->cpu, &mask);
+    sched_setaffinity(0, sizeof(mask), &mask);
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+
+    if (w->chase) {
+        p = (char **)(region + ((uint64_t)w->order[0] << LINE_SHIFT));
+        for (i = 0; i < passes * w->num; i++)
+            p = (char **)*p;
+        sum = (uintptr_t)p;
+    } else {
+        // Independent loads, as many in flight as the core allows
+        for (pass = 0; pass < passes; pass++)
+            for (i = 0; i < w->num; i++)
+                sum += *(uint64_t *)(region + ((uint64_t)w->order[i] << LINE_SHIFT));
+    }
+
+    w->ns = now_ns() - start;
+    w->accesses = passes * w->num;
+    // Keeps the loads
+    w->sum = sum;
+    return NULL;
+}
+
+// Runs every thread over its part of lines, once for bandwidth and once for latency
+static result_t run(enum pattern p, const uint32_t *lines, uint64_t len, int threads,
+                    const int *cpus, uint32_t *order)
+{
+    worker_t workers[threads];
+    uint64_t per_thread = len / threads, max_ns, bytes, seed = RANDOM_SEED;
+    result_t r = {0};
+    int t, chase;
+
+    for (t = 0; t < threads; t++) {
+        workers[t].cpu = cpus[t];
+        workers[t].order = order + t * per_thread;
+        workers[t].num = per_thread;
+        build_order(p, lines + t * per_thread, per_thread, order + t * per_thread, &seed);
+        build_chain(workers[t].order, per_thread);
+    }
+
+    for (chase = 0; chase < 2; chase++) {
+        pthread_barrier_init(&start_barrier, NULL, threads);
+        for (t = 0; t < threads; t++) {
+            workers[t].chase = chase;
+            pthread_create(&workers[t].thread, NULL, worker_fn, &workers[t]);
+        }
+
+        for (t = 0, max_ns = 0, bytes = 0; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+            max_ns = workers[t].ns > max_ns ? workers[t].ns : max_ns;
+            bytes += workers[t].accesses * LINE_SIZE;
+            sink += workers[t].sum;
+            if (chase)
+                r.latency += (double)workers[t].ns / workers[t].accesses / threads;
+        }
+        if (!chase)
+            r.bandwidth = (double)bytes / max_ns;
+        pthread_barrier_destroy(&start_barrier);
+    }
+
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *bank_file = NULL, *shm_name = NULL;
+    int opt, num_banks, banks, threads = 0, variant, num_variants, t, b;
+    uint64_t region_mb = DEFAULT_REGION_MB, len = UINT64_MAX;
+    int thread_counts[2], *cpus;
+    uint32_t *lines, *order;
+    static result_t results[2][NUM_PATTERNS][BANKMAP_MAX_FNS + 1];
+    enum pattern p;
+    cpu_set_t mask;
+    bankmap_t m;
+
+    while ((opt = getopt(argc, argv, "m:n:s:t:")) != -1) {
+        switch (opt) {
+            case 'm': bank_file = optarg; break;
+            case 'n': shm_name = optarg; break;
+            case 's': region_mb = strtoull(optarg, NULL, 0); break;
+            case 't': threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "See the top of blp_bench.c for usage\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (bank_file != NULL ? bankmap_load(&m, bank_file, NULL) < 0 :
+            bankmap_open(&m, shm_name) < 0) {
+        eprint("Couldn't get the mapping from %s: %s\n",
+                bank_file != NULL ? bank_file : "bankmapd, start it or use -m",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    num_banks = bankmap_num_banks(&m);
+
+    // Cores the benchmark may run on
+    sched_getaffinity(0, sizeof(mask), &mask);
+    cpus = malloc(CPU_SETSIZE * sizeof(int));
+    for (t = 0, b = 0; t < CPU_SETSIZE; t++)
+        if (CPU_ISSET(t, &mask))
+            cpus[b++] = t;
+    if (threads <= 0 || threads > b)
+        threads = b;
+    thread_counts[0] = 1;
+    thread_counts[1] = threads;
+    num_variants = threads > 1 ? 2 : 1;
+
+    region_size = (region_mb << 20) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+    if (region_size == 0 || region_size / LINE_SIZE > UINT32_MAX) {
+        eprint("Region must be 2 MB to 256 GB\n");
+        exit(EXIT_FAILURE);
+    }
+    if (allocate_region() < 0) {
+        eprint("Couldn't allocate %lu MB: %s\n", region_mb, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (classify_lines(&m) < 0)
+        exit(EXIT_FAILURE);
+
+    // Every stream has the lines one bank has, whatever its number of banks
+    for (b = 0; b < num_banks; b++)
+        len = bank_counts[b] < len ? bank_counts[b] : len;
+    len -= len % (num_banks * threads);
+    if (len == 0) {
+        eprint("Region too small for %d banks\n", num_banks);
+        exit(EXIT_FAILURE);
+    }
+    lines = malloc(len * sizeof(uint32_t));
+    order = malloc(len * sizeof(uint32_t));
+    assert(lines != NULL && order != NULL);
+
+    printf("Banks: %d, Stream: %.1f MB, Threads: %d, Stride: %d lines\n",
+            num_banks, len * LINE_SIZE / (double)(1 << 20), threads, STRIDE_LINES);
+    printf("%-12s %6s %8s %12s %12s\n", "Pattern", "Banks", "Threads", "GB/s", "Latency ns");
+
+    for (variant = 0; variant < num_variants; variant++) {
+        for (p = 0; p < NUM_PATTERNS; p++) {
+            for (banks = 1, b = 0; banks <= num_banks; banks *= 2, b++) {
+                build_stream(0, banks, len, lines);
+                results[variant][p][b] = run(p, lines, len, thread_counts[variant], cpus, order);
+                printf("%-12s %6d %8d %12.2f %12.1f\n", pattern_names[p], banks,
+                        thread_counts[variant], results[variant][p][b].bandwidth,
+                        results[variant][p][b].latency);
+                fflush(stdout);
+            }
+        }
+    }
+
+    // Spread over all banks against concentrated in one
+    printf("\nHeadroom (all banks / one bank):\n");
+    printf("%-12s %8s %12s %12s\n", "Pattern", "Threads", "Bandwidth", "Latency");
+    for (variant = 0; variant < num_variants; variant++)
+        for (p = 0; p < NUM_PATTERNS; p++)
+            printf("%-12s %8d %11.2fx %11.2fx\n", pattern_names[p], thread_counts[variant],
+                    results[variant][p][m.num_bank_fns].bandwidth / results[variant][p][0].bandwidth,
+                    results[variant][p][m.num_bank_fns].latency / results[variant][p][0].latency);
+
+    bankmap_close(&m);
+    return 0;
+}
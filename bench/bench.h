@@ -0,0 +1,109 @@
+// Benchmark harness: Times iterations of a benchmark and prints results as JSON
+// Each benchmark runs at least BENCH_MIN_ITERATIONS and for at least
+// BENCH_MIN_TIME_NS (capped at BENCH_MAX_ITERATIONS)
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define BENCH_MIN_ITERATIONS            5
+#define BENCH_MAX_ITERATIONS            1000
+#define BENCH_MIN_TIME_NS               (200 * 1000 * 1000ULL)
+
+typedef struct bench {
+    const char *name;
+    char params[256];           // JSON object of benchmark parameters
+    uint64_t ns[BENCH_MAX_ITERATIONS];
+    int iterations;
+    uint64_t total_ns;
+    uint64_t start_ns;
+    double items;               // Work done per iteration
+    const char *unit;           // Unit of work
+} bench_t;
+
+static FILE *bench_out;
+static int bench_results;
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_begin_suite(FILE *out, const char *suite)
+{
+    bench_out = out;
+    bench_results = 0;
+    fprintf(bench_out, "{\n  \"suite\": \"%s\",\n  \"results\": [", suite);
+}
+
+static void bench_end_suite(void)
+{
+    fprintf(bench_out, "\n  ]\n}\n");
+    fflush(bench_out);
+}
+
+static void bench_init(bench_t *b, const char *name, double items, const char *unit)
+{
+    b->name = name;
+    b->params[0] = '\0';
+    b->iterations = 0;
+    b->total_ns = 0;
+    b->items = items;
+    b->unit = unit;
+}
+
+// Returns 1 while more iterations need to be run
+static int bench_more(const bench_t *b)
+{
+    if (b->iterations >= BENCH_MAX_ITERATIONS)
+        return 0;
+    return b->iterations < BENCH_MIN_ITERATIONS || b->total_ns < BENCH_MIN_TIME_NS;
+}
+
+static void bench_start(bench_t *b)
+{
+    b->start_ns = bench_now_ns();
+}
+
+static void bench_stop(bench_t *b)
+{
+    uint64_t ns = bench_now_ns() - b->start_ns;
+    b->ns[b->iterations++] = ns;
+    b->total_ns += ns;
+}
+
+static void bench_report(bench_t *b)
+{
+    uint64_t min, median, p99;
+
+    qsort(b->ns, b->iterations, sizeof(uint64_t), bench_compare_u64);
+    min = b->ns[0];
+    median = b->ns[b->iterations / 2];
+    p99 = b->ns[(b->iterations * 99) / 100];
+
+    fprintf(bench_out, "%s\n    {\n", bench_results++ ? "," : "");
+    fprintf(bench_out, "      \"name\": \"%s\",\n", b->name);
+    fprintf(bench_out, "      \"params\": {%s},\n", b->params);
+    fprintf(bench_out, "      \"iterations\": %d,\n", b->iterations);
+    fprintf(bench_out, "      \"min_ns\": %" PRIu64 ",\n", min);
+    fprintf(bench_out, "      \"median_ns\": %" PRIu64 ",\n", median);
+    fprintf(bench_out, "      \"p99_ns\": %" PRIu64 ",\n", p99);
+    fprintf(bench_out, "      \"throughput\": %0.3f,\n", b->items * 1e9 / median);
+    fprintf(bench_out, "      \"throughput_unit\": \"%s/s\"\n", b->unit);
+    fprintf(bench_out, "    }");
+    fflush(bench_out);
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,262 @@
+// Benchmarks of algo_finder's solver on synthetic bank clusters
+// Needs no root, hugepages or MSR access
+
+#define ALGO_NO_MAIN
+#include "../algo_finder/algo.c"
+#include "bench.h"
+
+#define BENCH_SEED              0x5eed
+#define BENCH_LOW_BITS          6       // Bits below window are random
+
+typedef struct dataset {
+    uint64_t *addrs;            // Addresses of bank i at i * per_bank
+    int banks;
+    int per_bank;
+    int window;
+    solution_t fns[MAX_DEPTH];  // Functions used to generate the banks
+    int num_fns;
+} dataset_t;
+
+static uint64_t rng_state;
+
+static uint64_t bench_rand(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int parity(uint64_t v)
+{
+    return __builtin_parityll(v);
+}
+
+/* Generates log2(banks) random linearly independent XOR functions (1-3 bits
+ * each) over the window starting at START_INDEX and fills every bank with
+ * per_bank random addresses
+ */
+static void gen_dataset(dataset_t *d, int window, int banks, int per_bank)
+{
+    uint64_t masks[MAX_DEPTH], basis[64] = {0};
+    uint64_t window_mask = ((1ULL << window) - 1) << START_INDEX;
+    int *filled;
+    int i, j, bank;
+
+    rng_state = BENCH_SEED;
+    d->banks = banks;
+    d->per_bank = per_bank;
+    d->window = window;
+    d->num_fns = 0;
+
+    while ((1 << d->num_fns) < banks) {
+        uint64_t mask = 0, v;
+        int bits = 1 + bench_rand() % 3;
+
+        for (j = 0; j < bits; j++)
+            mask |= 1ULL << (START_INDEX + bench_rand() % window);
+
+        // Keep only if independent of functions so far
+        for (v = mask, j = 63; j >= 0 && v; j--) {
+            if (!((v >> j) & 1))
+                continue;
+            if (basis[j] == 0)
+                break;
+            v ^= basis[j];
+        }
+        if (v == 0)
+            continue;
+        basis[63 - __builtin_clzll(v)] = v;
+
+        masks[d->num_fns] = mask;
+        solution_t *s = &d->fns[d->num_fns++];
+        memset(s, 0, sizeof(*s));
+        s->valid = 1;
+        for (j = 0; j < 64; j++) {
+            if ((mask >> j) & 1) {
+                s->indexes[s->depth] = j;
+                s->ops[s->depth] = XOR;
+                s->depth++;
+            }
+        }
+    }
+
+    d->addrs = malloc(sizeof(uint64_t) * banks * per_bank);
+    filled = calloc(sizeof(int), banks);
+    assert(d->addrs != NULL && filled != NULL);
+
+    for (i = 0; i < banks * per_bank; ) {
+        uint64_t addr = 0x3c0000000ULL | (bench_rand() & window_mask) |
+                        (bench_rand() & ((1ULL << START_INDEX) - 1) &
+                            ~((1ULL << BENCH_LOW_BITS) - 1));
+
+        for (j = 0, bank = 0; j < d->num_fns; j++)
+            bank |= parity(addr & masks[j]) << j;
+
+        if (filled[bank] == per_bank)
+            continue;
+        d->addrs[bank * per_bank + filled[bank]++] = addr;
+        i++;
+    }
+
+    free(filled);
+}
+
+static void free_dataset(dataset_t *d)
+{
+    free(d->addrs);
+}
+
+// Same as algo.c's main(), on in-memory banks. Returns solutions found
+static int solve(const dataset_t *d, solution_array_t *sarray,
+                    solution_array_t *temp_sarray)
+{
+    int bank, i, count;
+
+    sarray->max_solutions = MAX_SOLUTION;
+    sarray->num_solutions = -1;
+
+    for (bank = 0; bank < d->banks; bank++) {
+        temp_sarray->max_solutions = MAX_SOLUTION;
+        temp_sarray->num_solutions = -1;
+
+        find_algo(&d->addrs[bank * d->per_bank], d->per_bank, temp_sarray);
+        if (temp_sarray->num_solutions == 0)
+            return 0;
+
+        if (find_intersection(sarray, temp_sarray) != 1)
+            return 0;
+    }
+
+    find_unique(sarray);
+
+    for (i = 0, count = 0; i < sarray->num_solutions; i++)
+        count += sarray->s[i].valid == 1;
+
+    return count;
+}
+
+static void bench_check(void)
+{
+    dataset_t d;
+    bench_t b;
+    int bank, valid;
+
+    gen_dataset(&d, MAX_DEPTH, 32, MAX_ADDR_PER_BANK);
+
+    bench_init(&b, "check", (double)d.banks * d.per_bank, "addr");
+    snprintf(b.params, sizeof(b.params), "\"banks\": %d, \"addr_per_bank\": %d, "
+                "\"depth\": %d", d.banks, d.per_bank, d.fns[0].depth);
+    while (bench_more(&b)) {
+        bench_start(&b);
+        for (bank = 0, valid = 0; bank < d.banks; bank++)
+            valid += check(&d.addrs[bank * d.per_bank], d.per_bank, &d.fns[0]);
+        bench_stop(&b);
+        assert(valid == d.banks);
+    }
+    bench_report(&b);
+
+    free_dataset(&d);
+}
+
+static void bench_find_algo(solution_array_t *sarray)
+{
+    dataset_t d;
+    bench_t b;
+
+    gen_dataset(&d, MAX_DEPTH, 32, MAX_ADDR_PER_BANK);
+
+    bench_init(&b, "find_algo", (double)((1 << MAX_DEPTH) - 1), "candidate");
+    snprintf(b.params, sizeof(b.params), "\"window\": %d, \"addr_per_bank\": %d",
+                d.window, d.per_bank);
+    while (bench_more(&b)) {
+        sarray->max_solutions = MAX_SOLUTION;
+        sarray->num_solutions = -1;
+        bench_start(&b);
+        find_algo(d.addrs, d.per_bank, sarray);
+        bench_stop(&b);
+    }
+    bench_report(&b);
+
+    free_dataset(&d);
+}
+
+static void bench_find_intersection(solution_array_t *sarray)
+{
+    static solution_array_t first, second;
+    dataset_t d;
+    bench_t b;
+
+    gen_dataset(&d, MAX_DEPTH, 32, MAX_ADDR_PER_BANK);
+
+    first.max_solutions = second.max_solutions = MAX_SOLUTION;
+    first.num_solutions = second.num_solutions = -1;
+    find_algo(&d.addrs[0], d.per_bank, &first);
+    find_algo(&d.addrs[d.per_bank], d.per_bank, &second);
+
+    bench_init(&b, "find_intersection", (double)first.num_solutions, "solution");
+    snprintf(b.params, sizeof(b.params), "\"solutions\": %d, \"other_solutions\": %d",
+                first.num_solutions, second.num_solutions);
+    while (bench_more(&b)) {
+        memcpy(sarray, &first, sizeof(first));
+        bench_start(&b);
+        find_intersection(sarray, &second);
+        bench_stop(&b);
+    }
+    bench_report(&b);
+
+    free_dataset(&d);
+}
+
+// Whole solver on datasets of increasing window, banks and addresses per bank
+static void bench_end_to_end(solution_array_t *sarray, solution_array_t *temp_sarray)
+{
+    static const int windows[] = { 8, 11, MAX_DEPTH };
+    static const int banks[] = { 8, 32 };
+    static const int per_banks[] = { 100, MAX_ADDR_PER_BANK };
+    size_t w, k, p;
+    dataset_t d;
+    bench_t b;
+    int found = 0;
+
+    for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        for (k = 0; k < sizeof(banks) / sizeof(banks[0]); k++) {
+            for (p = 0; p < sizeof(per_banks) / sizeof(per_banks[0]); p++) {
+
+                gen_dataset(&d, windows[w], banks[k], per_banks[p]);
+                end_index = START_INDEX + windows[w] - 1;
+
+                bench_init(&b, "solve", (double)d.banks * d.per_bank, "addr");
+                while (bench_more(&b)) {
+                    bench_start(&b);
+                    found = solve(&d, sarray, temp_sarray);
+                    bench_stop(&b);
+                }
+                snprintf(b.params, sizeof(b.params), "\"window\": %d, "
+                        "\"banks\": %d, \"addr_per_bank\": %d, \"functions\": %d, "
+                        "\"solutions\": %d", d.window, d.banks, d.per_bank,
+                        d.num_fns, found);
+                bench_report(&b);
+
+                free_dataset(&d);
+            }
+        }
+    }
+
+    end_index = END_INDEX;
+}
+
+int main()
+{
+    static solution_array_t sarray, temp_sarray;
+
+    bench_begin_suite(stdout, "algo_finder");
+
+    bench_check();
+    bench_find_algo(&sarray);
+    bench_find_intersection(&sarray);
+    bench_end_to_end(&sarray, &temp_sarray);
+
+    bench_end_suite();
+    return 0;
+}
@@ -0,0 +1,178 @@
+// Benchmarks of bank_test's association on simulated timings
+// Needs no root, hugepages or MSR access
+
+#define BANK_TEST_NO_MAIN
+#define SIMULATED_TIMING        1
+#include "../bank_test.c"
+#include "bench.h"
+
+// Sampling used while benchmarking the association, so that the benchmark
+// measures run_exp() and not the simulated timing loop
+#define BENCH_INNER_LOOP        1
+#define BENCH_OUTER_LOOP        10
+
+// Pairs timed by the find_read_time() benchmark
+#define BENCH_PAIRS             1000
+
+static uint64_t virt_start, phy_start;
+// Simulated timing's seed, restored so that iterations time alike
+static uint64_t sim_seed;
+
+static void reset_experiment(void)
+{
+    init_banks();
+    init_entries(virt_start, phy_start);
+    sim_rng_state = sim_seed;
+}
+
+// Threshold as run_exp() gets it from its warm up
+static double bench_threshold(void)
+{
+    return find_read_time((void *)virt_start, (void *)(virt_start + sizeof(uint64_t)),
+                            LONG_MAX) * threshold_multiplier;
+}
+
+static void bench_find_read_time(void)
+{
+    double threshold;
+    bench_t b;
+    int j;
+
+    inner_loop = BENCH_INNER_LOOP;
+    outer_loop = BENCH_OUTER_LOOP;
+    reset_experiment();
+    threshold = bench_threshold();
+
+    bench_init(&b, "find_read_time", (double)BENCH_PAIRS, "pair");
+    snprintf(b.params, sizeof(b.params), "\"pairs\": %d, \"inner_loop\": %d, "
+            "\"outer_loop\": %d", BENCH_PAIRS, inner_loop, outer_loop);
+    while (bench_more(&b)) {
+        sim_rng_state = sim_seed;
+        bench_start(&b);
+        // Entry 0 against the next ones, in its bank or not
+        for (j = 1; j <= BENCH_PAIRS; j++)
+            find_read_time((void *)entries[0].virt_addr,
+                            (void *)entries[j % NUM_ENTRIES].virt_addr, threshold);
+        bench_stop(&b);
+    }
+    bench_report(&b);
+}
+
+/* Association of run_exp() without the timing: Every row is timed once into
+ * avgs, then associate_row() makes the siblings from them on each iteration
+ */
+static void bench_associate(void)
+{
+    double *avgs = calloc((size_t)NUM_ENTRIES * NUM_ENTRIES, sizeof(double));
+    double *running_avgs = calloc(NUM_ENTRIES, sizeof(double));
+    int *retry_queue = calloc(NUM_ENTRIES, sizeof(int));
+    double threshold, sum;
+    int i, num_retry, sub_entries;
+    bench_t b;
+
+    assert(avgs != NULL && running_avgs != NULL && retry_queue != NULL);
+
+    inner_loop = BENCH_INNER_LOOP;
+    outer_loop = BENCH_OUTER_LOOP;
+    reset_experiment();
+    threshold = bench_threshold();
+    for (i = 0; i < NUM_ENTRIES - 1; i++) {
+        num_retry = measure_row(i, i + 1, threshold, &avgs[(size_t)i * NUM_ENTRIES],
+                                &sum, retry_queue);
+        sub_entries = NUM_ENTRIES - (i + 1) -
+                        retry_pairs(i, retry_queue, num_retry, threshold,
+                                    &avgs[(size_t)i * NUM_ENTRIES], &sum);
+        running_avgs[i] = sub_entries > 0 ? sum / sub_entries : 0;
+    }
+
+    bench_init(&b, "associate", (double)NUM_ENTRIES, "entry");
+    snprintf(b.params, sizeof(b.params), "\"entries\": %d", NUM_ENTRIES);
+    while (bench_more(&b)) {
+        init_banks();
+        init_entries(virt_start, phy_start);
+        bench_start(&b);
+        for (i = 0; i < NUM_ENTRIES - 1; i++) {
+            if (entries[i].associated)
+                continue;
+            associate_row(i, &avgs[(size_t)i * NUM_ENTRIES], running_avgs[i]);
+        }
+        bench_stop(&b);
+    }
+    bench_report(&b);
+
+    free(retry_queue);
+    free(running_avgs);
+    free(avgs);
+}
+
+static void bench_run_exp(void)
+{
+    uint64_t pairs;
+    bench_t b;
+
+    inner_loop = BENCH_INNER_LOOP;
+    outer_loop = BENCH_OUTER_LOOP;
+
+    // Pairs measured are the same on every iteration, as the seed is restored
+    reset_experiment();
+    pairs = sched_stats.pairs;
+    run_exp(virt_start, phy_start);
+    pairs = sched_stats.pairs - pairs;
+
+    bench_init(&b, "run_exp", (double)pairs, "pair");
+    snprintf(b.params, sizeof(b.params), "\"entries\": %d, \"inner_loop\": %d, "
+            "\"outer_loop\": %d", NUM_ENTRIES, inner_loop, outer_loop);
+    while (bench_more(&b)) {
+        reset_experiment();
+        bench_start(&b);
+        run_exp(virt_start, phy_start);
+        bench_stop(&b);
+    }
+    bench_report(&b);
+}
+
+static void bench_check_mapping(void)
+{
+    bench_t b;
+
+    bench_init(&b, "check_mapping", (double)NUM_ENTRIES, "entry");
+    snprintf(b.params, sizeof(b.params), "\"entries\": %d", NUM_ENTRIES);
+    while (bench_more(&b)) {
+        // check_mapping() only assigns banks, so association is reused
+        init_banks();
+        bench_start(&b);
+        check_mapping();
+        bench_stop(&b);
+    }
+    bench_report(&b);
+}
+
+int main()
+{
+    FILE *out;
+    int fd;
+
+    // bank_test prints its progress on stdout, results go to original stdout
+    fd = dup(STDOUT_FILENO);
+    assert(fd >= 0);
+    out = fdopen(fd, "w");
+    assert(out != NULL);
+    assert(freopen("/dev/null", "w", stdout) != NULL);
+
+    sim_seed = sim_rng_state;
+    instr_init();
+    calibrate_tsc();
+
+    virt_start = (uint64_t)allocate_contigous(NUM_CONTIGOUS_PAGES, &phy_start);
+    assert(virt_start != 0);
+
+    bench_begin_suite(out, "bank_test");
+
+    bench_find_read_time();
+    bench_associate();
+    bench_run_exp();
+    bench_check_mapping();
+
+    bench_end_suite();
+    return 0;
+}
@@ -1,5 +1,6 @@
 // Kernel allocator module
-// Allocates contiguous physical pages using mmap
+// Allocates physical pages using mmap. Every mmap() is backed by chunks of
+// contiguous higher order pages, and their PFNs can be read in one ioctl
 
 #include <linux/module.h>
 #include <linux/version.h>
@@ -12,25 +13,55 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <asm/page.h>
-#include <linux/dma-mapping.h>
+#ifdef CONFIG_X86
+#include <asm/tsc.h>
+#endif
 #include <linux/uaccess.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/refcount.h>
+#include <linux/irqflags.h>
+
+#include "kam.h"
 
 #define DRIVER_NAME "kam_driver"
 #define DEV_NAME    "kam"
 #define CLASS_NAME  "chardrv"
 
+// Largest allocation tried for a chunk (order 10 is 4 MB)
+#define KAM_MAX_ORDER   10
+
 static dev_t first; // Global variable for the first device number
 static struct cdev c_dev; // Global variable for the character device structure
 static struct class *cl; // Global variable for the device class
 static struct device *dev;
 
+// Chunk of 2^order physically contiguous pages
+struct kam_chunk {
+    struct page *page;
+    unsigned int order;
+};
+
+struct mmap_info;
+
+/* One per mmap(). Held by every VMA mapping it (several after a split or
+ * mremap()) and by ioctls using it, pages are freed with the last reference
+ */
+struct kam_mapping {
+    struct list_head list;
+    struct mmap_info *info;
+    refcount_t refs;
+    size_t nrpages;
+    int nr_chunks;
+    struct kam_chunk *chunks;
+};
+
 struct mmap_info {
+    struct mutex lock;
+    struct list_head mappings;
     int count;
-    int using_coherent;
-    dma_addr_t dma_addr;
-    size_t alloc_size;
-    void *pages;
-    unsigned long phy_start_addr;
 };
 
 // Function to get virtual address of physical page using page table walks
@@ -69,88 +100,166 @@ long get_pfn_of_virtual_address(struct vm_area_struct *vma,
     return 0; 
 
 } 
+static void kam_free_mapping(struct kam_mapping *m)
+{
+    int i;
+
+    for (i = 0; i < m->nr_chunks; i++)
+        __free_pages(m->chunks[i].page, m->chunks[i].order);
+
+    kvfree(m->chunks);
+    kfree(m);
+}
+
+// Allocates nrpages with as few chunks as possible, largest order first
+static struct kam_mapping *kam_alloc_mapping(size_t nrpages)
+{
+    struct kam_mapping *m;
+    size_t left = nrpages;
+    unsigned int order = KAM_MAX_ORDER;
+    struct page *page;
+
+    m = kzalloc(sizeof(*m), GFP_KERNEL);
+    if (m == NULL)
+        return NULL;
+
+    // At worst every chunk is a single page
+    m->chunks = kvcalloc(nrpages, sizeof(struct kam_chunk), GFP_KERNEL);
+    if (m->chunks == NULL) {
+        kfree(m);
+        return NULL;
+    }
+    m->nrpages = nrpages;
+
+    while (left > 0) {
+        while (order > 0 && (1UL << order) > left)
+            order--;
+
+        page = alloc_pages(GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN |
+                            __GFP_NORETRY, order);
+        if (page == NULL) {
+            if (order == 0) {
+                kam_free_mapping(m);
+                return NULL;
+            }
+            order--;
+            continue;
+        }
+
+        m->chunks[m->nr_chunks].page = page;
+        m->chunks[m->nr_chunks].order = order;
+        m->nr_chunks++;
+        left -= 1UL << order;
+    }
+
+    return m;
+}
+
+static void kam_put_mapping(struct kam_mapping *m)
+{
+    struct mmap_info *info = m->info;
+
+    if (!refcount_dec_and_test(&m->refs))
+        return;
+
+    mutex_lock(&info->lock);
+    list_del(&m->list);
+    info->count--;
+    mutex_unlock(&info->lock);
+
+    kam_free_mapping(m);
+}
+
+static void kam_vm_open(struct vm_area_struct *vma)
+{
+    struct kam_mapping *m = vma->vm_private_data;
+
+    refcount_inc(&m->refs);
+}
+
+// munmap() of the last VMA frees the pages, not only closing the file
+static void kam_vm_close(struct vm_area_struct *vma)
+{
+    kam_put_mapping(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct kam_vm_ops = {
+    .open = kam_vm_open,
+    .close = kam_vm_close,
+};
+
+/* Mapping of filp at vaddr in the caller, as returned by mmap(), with a
+ * reference held. NULL if there is none
+ */
+static struct kam_mapping *kam_get_mapping(struct file *filp, __u64 vaddr)
+{
+    struct mm_struct *mm = current->mm;
+    struct vm_area_struct *vma;
+    struct kam_mapping *m = NULL;
+
+    mmap_read_lock(mm);
+    vma = find_vma(mm, vaddr);
+    if (vma != NULL && vma->vm_start == vaddr && vma->vm_ops == &kam_vm_ops &&
+            vma->vm_file == filp) {
+        m = vma->vm_private_data;
+        refcount_inc(&m->refs);
+    }
+    mmap_read_unlock(mm);
+
+    return m;
+}
+
 static int kam_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-    struct mmap_info *info;
+    struct mmap_info *info = filp->private_data;
+    struct kam_mapping *m;
     size_t size = vma->vm_end - vma->vm_start;
-    size_t nrpages = size / PAGE_SIZE;
-    size_t alloc_size = size + 2 * PAGE_SIZE;
-    unsigned long vaddr;
-    int i, ret = 0;
-
-    pr_info("mmap\n");
-
-    // TODO: Do arguments checks
-    // TODO: Is there an API to allocate contiguous aligned memory?
-    info = vma->vm_private_data = filp->private_data;
-    if (info->count != 0) {
-        pr_err("Driver allocates memory only once\n");
+    unsigned long addr = vma->vm_start;
+    int i, ret;
+
+    if (size == 0 || vma->vm_pgoff != 0)
+        return -EINVAL;
+
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTCOPY | VM_LOCKED | VM_DONTDUMP;
+
+    m = kam_alloc_mapping(size >> PAGE_SHIFT);
+    if (m == NULL) {
+        pr_err("Couldn't allocate 0x%zx bytes\n", size);
         return -ENOMEM;
     }
+    m->info = info;
 
-    vma->vm_flags |= VM_DONTEXPAND | VM_DONTCOPY | VM_LOCKED | VM_DONTDUMP;
-    
-    info->pages = kmalloc(alloc_size, GFP_HIGHUSER);
-    if (info->pages == NULL) {
-       
-        info->pages = dma_alloc_coherent(dev, alloc_size, &info->dma_addr, GFP_HIGHUSER);
-        if (info->pages == NULL) { 
-            pr_err("Couldn't kmalloc\n");
-            return -ENOMEM;
+    for (i = 0; i < m->nr_chunks; i++) {
+        unsigned long chunk_size = PAGE_SIZE << m->chunks[i].order;
+
+        ret = remap_pfn_range(vma, addr, page_to_pfn(m->chunks[i].page),
+                                chunk_size, PAGE_SHARED);
+        if (ret) {
+            pr_err("Couldn't map pages\n");
+            kam_free_mapping(m);
+            return -EAGAIN;
         }
-        info->using_coherent = 1;
-    }
 
-    info->alloc_size = alloc_size;
-
-    vaddr = ((unsigned long)(info->pages) + PAGE_SIZE - 1) & PAGE_MASK;
-    if (remap_pfn_range(vma,
-			    vma->vm_start,
-			    virt_to_phys((void *)vaddr) >> PAGE_SHIFT,
-			    size,
-			    PAGE_SHARED)) {
-
-        pr_err("Couldn't map pages");
-		ret = -EAGAIN;
-        goto err;
-	}
-
-    info->phy_start_addr = virt_to_phys((void *)vaddr);
-
-/* TODO: Not working currently
-    // Try to pin the pages
-    ret = get_user_pages(vma->vm_start, nrpages, 0, NULL, NULL);
-    if (ret < 0) {
-        pr_err("Couldn't pin pages\n");
-        // TODO: Do I need to remove the mapping?
-        kfree(info->pages);
-        return -EAGAIN;
+        pr_debug("Chunk %d: Virt: %p, Phys: %p, Order: %u\n", i, (void *)addr,
+                (void *)(page_to_pfn(m->chunks[i].page) << PAGE_SHIFT),
+                m->chunks[i].order);
+        addr += chunk_size;
     }
-*/  
-    info->count = 1;
 
-    pr_info("mmap done: Virt: %p, Phys %p\n", (void *)vaddr,
-            (void *)virt_to_phys((void *)vaddr));
+    // Reference of the VMA, dropped by kam_vm_close()
+    refcount_set(&m->refs, 1);
+    vma->vm_private_data = m;
+    vma->vm_ops = &kam_vm_ops;
 
-    for (i = 0; i < nrpages; i++) {
-        unsigned long v = vma->vm_start + i * PAGE_SIZE;
-        unsigned long pfn;
-        int ret;
-        
-        ret = get_pfn_of_virtual_address(vma, v, &pfn); 
+    mutex_lock(&info->lock);
+    list_add_tail(&m->list, &info->mappings);
+    info->count++;
+    mutex_unlock(&info->lock);
 
-        pr_info("User:Virt:%p, Phy:%p, Ret:%d\n", (void *)v,
-                (void *)(pfn << PAGE_SHIFT), ret);
-    }
-    return 0;
+    pr_info("mmap done: Virt: %p, Size: 0x%zx, Chunks: %d\n",
+            (void *)vma->vm_start, size, m->nr_chunks);
 
-err:
-    if (info->using_coherent) {
-        dma_free_coherent(dev, info->alloc_size, info->pages, info->dma_addr);
-    } else {
-        kfree(info->pages);
-    }
-    return ret;
+    return 0;
 }
 
 static int kam_open(struct inode *inode, struct file *filp)
@@ -163,12 +272,15 @@ static int kam_open(struct inode *inode, struct file *filp)
     if (info == NULL)
         return -EPERM;
 
+    mutex_init(&info->lock);
+    INIT_LIST_HEAD(&info->mappings);
     info->count = 0;
-    info->using_coherent = 0;
     filp->private_data = info;
     
     return 0;
 }
+
+// Every VMA holds the file, so its mappings are gone by now
 static int kam_release(struct inode *inode, struct file *filp)
 {
     struct mmap_info *info;
@@ -176,41 +288,244 @@ static int kam_release(struct inode *inode, struct file *filp)
     pr_info("release\n");
     
     info = filp->private_data;
-    if (info->count != 0) {
-        if (info->using_coherent) {
-            dma_free_coherent(dev, info->alloc_size, info->pages, info->dma_addr);
-        } else {
-            kfree(info->pages);
-        }   
-    }
+    WARN_ON(!list_empty(&info->mappings));
 
     kfree(info);
     filp->private_data = NULL;
     return 0;
 }
 
+static long kam_ioctl_pfn_list(struct file *filp, void __user *arg)
+{
+    struct kam_pfn_list req;
+    struct kam_mapping *found;
+    __u64 __user *pfns;
+    unsigned long pfn;
+    size_t n = 0;
+    int i, j;
+    long ret = 0;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    found = kam_get_mapping(filp, req.vaddr);
+    if (found == NULL)
+        return -ENOENT;
+
+    req.num_pfns = found->nrpages;
+    if (req.max_pfns < found->nrpages) {
+        // Caller can retry with a large enough buffer
+        ret = -ENOSPC;
+        goto copy_req;
+    }
+
+    pfns = (__u64 __user *)(uintptr_t)req.pfns;
+    for (i = 0; i < found->nr_chunks; i++) {
+        pfn = page_to_pfn(found->chunks[i].page);
+        for (j = 0; j < (1 << found->chunks[i].order); j++, n++) {
+            if (put_user((__u64)(pfn + j), &pfns[n])) {
+                ret = -EFAULT;
+                goto out;
+            }
+        }
+    }
+
+copy_req:
+    if (copy_to_user(arg, &req, sizeof(req)))
+        ret = -EFAULT;
+out:
+    kam_put_mapping(found);
+    return ret;
+}
+
+// Kernel address of offset in mapping, NULL if outside it
+static void *kam_offset_to_kva(struct kam_mapping *m, __u64 offset)
+{
+    unsigned long chunk_size;
+    int i;
+
+    if (offset + sizeof(__u64) > m->nrpages << PAGE_SHIFT ||
+            !IS_ALIGNED(offset, sizeof(__u64)))
+        return NULL;
+
+    for (i = 0; i < m->nr_chunks; i++) {
+        chunk_size = PAGE_SIZE << m->chunks[i].order;
+        if (offset < chunk_size)
+            return page_address(m->chunks[i].page + (offset >> PAGE_SHIFT)) +
+                    offset_in_page(offset);
+        offset -= chunk_size;
+    }
+
+    return NULL;
+}
+
+#ifdef CONFIG_X86
+// Same access pattern as bank_test's clflush kernel
+static u64 kam_time_pair(void *a, void *b, u32 inner)
+{
+    u64 start_ticks, end_ticks;
+    u32 j;
+    int sum = 0;
+
+    start_ticks = rdtsc_ordered();
+    for (j = 0; j < inner; j++) {
+        asm volatile ("addl (%1), %0\n\t"
+                      "addl (%2), %0\n\t"
+                      "clflush (%1)\n\t"
+                      "clflush (%2)\n\t"
+                      "mfence\n\t": "+r" (sum) : "r" (a), "r" (b) : "memory");
+    }
+    end_ticks = rdtsc_ordered();
+
+    return end_ticks - start_ticks;
+}
+
+// Bursts are short so that IRQs are not held off for long
+static void kam_time_one_pair(void *a, void *b, struct kam_time_pairs *req,
+                                struct kam_pair_stat *st)
+{
+    u64 ticks;
+    u32 attempts = 0, max_attempts = req->samples * KAM_MAX_ATTEMPTS_FACTOR;
+    u32 k;
+    unsigned long flags;
+
+    st->sum = 0;
+    st->min = U64_MAX;
+    st->max = 0;
+    st->samples = 0;
+    st->rejected = 0;
+
+    while (st->samples < req->samples && attempts < max_attempts) {
+        preempt_disable();
+        local_irq_save(flags);
+
+        for (k = 0; k < req->burst && st->samples < req->samples; k++, attempts++) {
+            ticks = kam_time_pair(a, b, req->inner);
+            if (req->threshold && ticks > req->threshold) {
+                st->rejected++;
+                continue;
+            }
+            st->sum += ticks;
+            st->min = ticks < st->min ? ticks : st->min;
+            st->max = ticks > st->max ? ticks : st->max;
+            st->samples++;
+        }
+
+        local_irq_restore(flags);
+        preempt_enable();
+        cond_resched();
+    }
+}
+
+static long kam_ioctl_time_pairs(struct file *filp, void __user *arg)
+{
+    struct kam_time_pairs req;
+    struct kam_mapping *found;
+    struct kam_pair *pairs = NULL;
+    struct kam_pair_stat *stats = NULL;
+    void *a, *b;
+    u32 i;
+    long ret = 0;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    if (req.num_pairs == 0 || req.num_pairs > KAM_MAX_TIME_PAIRS ||
+            req.samples == 0 || req.samples > KAM_MAX_SAMPLES ||
+            req.inner == 0 || req.inner > KAM_MAX_INNER ||
+            req.burst == 0 || req.burst > KAM_MAX_BURST)
+        return -EINVAL;
+
+    pairs = kvmalloc_array(req.num_pairs, sizeof(*pairs), GFP_KERNEL);
+    stats = kvmalloc_array(req.num_pairs, sizeof(*stats), GFP_KERNEL);
+    if (pairs == NULL || stats == NULL) {
+        ret = -ENOMEM;
+        goto free;
+    }
+
+    if (copy_from_user(pairs, (void __user *)(uintptr_t)req.pairs,
+                        req.num_pairs * sizeof(*pairs))) {
+        ret = -EFAULT;
+        goto free;
+    }
+
+    found = kam_get_mapping(filp, req.vaddr);
+    if (found == NULL) {
+        ret = -ENOENT;
+        goto free;
+    }
+
+    for (i = 0; i < req.num_pairs; i++) {
+        a = kam_offset_to_kva(found, pairs[i].a);
+        b = kam_offset_to_kva(found, pairs[i].b);
+        if (a == NULL || b == NULL) {
+            ret = -EINVAL;
+            break;
+        }
+
+        kam_time_one_pair(a, b, &req, &stats[i]);
+
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+    }
+
+    kam_put_mapping(found);
+
+    if (ret == 0 && copy_to_user((void __user *)(uintptr_t)req.stats, stats,
+                                    req.num_pairs * sizeof(*stats)))
+        ret = -EFAULT;
+
+free:
+    kvfree(pairs);
+    kvfree(stats);
+    return ret;
+}
+#else
+static long kam_ioctl_time_pairs(struct file *filp, void __user *arg)
+{
+    return -ENOSYS;
+}
+#endif /* CONFIG_X86 */
+
 static long kam_ioctl(struct file *filp, unsigned int ioctl_num,
         unsigned long ioctl_param)
 {
     uint64_t *user_phy_addr_buf;
     struct mmap_info *info;
+    struct kam_mapping *m;
+    unsigned long phy_start_addr;
     int ret;
 
     info = filp->private_data;
+    if (info == NULL)
+        return -EAGAIN;
 
-    // Only '0' ioctl is supported
-    if (ioctl_num != 0)
+    if (ioctl_num == KAM_IOCTL_PFN_LIST)
+        return kam_ioctl_pfn_list(filp, (void __user *)ioctl_param);
+
+    if (ioctl_num == KAM_IOCTL_TIME_PAIRS)
+        return kam_ioctl_time_pairs(filp, (void __user *)ioctl_param);
+
+    if (ioctl_num != KAM_IOCTL_PHY_START)
         return -ENOSYS;
 
     // Check if mmap() has been called yet?
-    if (info == NULL || info->pages == NULL)
+    mutex_lock(&info->lock);
+    m = list_first_entry_or_null(&info->mappings, struct kam_mapping, list);
+    if (m == NULL) {
+        mutex_unlock(&info->lock);
         return -EAGAIN;
+    }
+    phy_start_addr = page_to_pfn(m->chunks[0].page) << PAGE_SHIFT;
+    mutex_unlock(&info->lock);
 
-    // Return the physical address of the start of mmap region
+    // Return the physical address of the start of first mmap region
     user_phy_addr_buf = (uint64_t *)ioctl_param;
-    ret = copy_to_user(user_phy_addr_buf, &info->phy_start_addr, 
-                        sizeof(info->phy_start_addr));
-    if (ret < 0) {
+    ret = copy_to_user(user_phy_addr_buf, &phy_start_addr, 
+                        sizeof(phy_start_addr));
+    if (ret != 0) {
         pr_err("Couldn't copy to user\n");
         return -EINVAL;
     }
@@ -0,0 +1,60 @@
+// Interface of the kernel allocator module (kam.c), shared with userspace
+
+#ifndef KAM_H
+#define KAM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define KAM_IOCTL_MAGIC         'k'
+
+// Legacy: Physical address of start of first mapping, argument is a __u64 *
+#define KAM_IOCTL_PHY_START     0
+
+// Physical frame numbers of every page of a mapping
+struct kam_pfn_list {
+    __u64 vaddr;                // In: Start of mapping as returned by mmap()
+    __u64 max_pfns;             // In: Entries in pfns buffer
+    __u64 num_pfns;             // Out: Pages in mapping
+    __u64 pfns;                 // In: User pointer to __u64[max_pfns]
+};
+
+#define KAM_IOCTL_PFN_LIST      _IOWR(KAM_IOCTL_MAGIC, 1, struct kam_pfn_list)
+
+// Pair of offsets in a mapping to be timed
+struct kam_pair {
+    __u64 a;
+    __u64 b;
+};
+
+struct kam_pair_stat {
+    __u64 sum;                  // Ticks of accepted samples
+    __u64 min;
+    __u64 max;
+    __u32 samples;              // Accepted samples
+    __u32 rejected;             // Samples above threshold
+};
+
+// Times pairs with preemption and IRQs disabled, in bursts of samples
+#define KAM_MAX_TIME_PAIRS      4096
+#define KAM_MAX_BURST           64
+// Bound the time IRQs are off for a burst, and attempts of a pair to a __u32
+#define KAM_MAX_INNER           16
+#define KAM_MAX_SAMPLES         (1 << 20)
+// A pair is given up after this many times the samples wanted
+#define KAM_MAX_ATTEMPTS_FACTOR 4
+
+struct kam_time_pairs {
+    __u64 vaddr;                // In: Start of mapping as returned by mmap()
+    __u64 pairs;                // In: User pointer to struct kam_pair[num_pairs]
+    __u64 stats;                // Out: User pointer to struct kam_pair_stat[num_pairs]
+    __u64 threshold;            // In: Samples above it are rejected, 0 for none
+    __u32 num_pairs;            // In: At most KAM_MAX_TIME_PAIRS
+    __u32 samples;              // In: Samples wanted per pair, at most KAM_MAX_SAMPLES
+    __u32 inner;                // In: Accesses of pair per sample, at most KAM_MAX_INNER
+    __u32 burst;                // In: Samples per burst, at most KAM_MAX_BURST
+};
+
+#define KAM_IOCTL_TIME_PAIRS    _IOWR(KAM_IOCTL_MAGIC, 2, struct kam_time_pairs)
+
+#endif /* KAM_H */